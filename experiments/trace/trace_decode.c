@@ -0,0 +1,180 @@
+/*
+#
+# Copyright 2022- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+// Decodes the request trace of virtiofs_emu_ll, see README
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <linux/fuse.h>
+
+#include "virtiofs_emu_trace.h"
+
+static const char *opnames[] = {
+    [FUSE_LOOKUP] = "LOOKUP",
+    [FUSE_FORGET] = "FORGET",
+    [FUSE_GETATTR] = "GETATTR",
+    [FUSE_SETATTR] = "SETATTR",
+    [FUSE_READLINK] = "READLINK",
+    [FUSE_SYMLINK] = "SYMLINK",
+    [FUSE_MKNOD] = "MKNOD",
+    [FUSE_MKDIR] = "MKDIR",
+    [FUSE_UNLINK] = "UNLINK",
+    [FUSE_RMDIR] = "RMDIR",
+    [FUSE_RENAME] = "RENAME",
+    [FUSE_LINK] = "LINK",
+    [FUSE_OPEN] = "OPEN",
+    [FUSE_READ] = "READ",
+    [FUSE_WRITE] = "WRITE",
+    [FUSE_STATFS] = "STATFS",
+    [FUSE_RELEASE] = "RELEASE",
+    [FUSE_FSYNC] = "FSYNC",
+    [FUSE_SETXATTR] = "SETXATTR",
+    [FUSE_GETXATTR] = "GETXATTR",
+    [FUSE_LISTXATTR] = "LISTXATTR",
+    [FUSE_REMOVEXATTR] = "REMOVEXATTR",
+    [FUSE_FLUSH] = "FLUSH",
+    [FUSE_INIT] = "INIT",
+    [FUSE_OPENDIR] = "OPENDIR",
+    [FUSE_READDIR] = "READDIR",
+    [FUSE_RELEASEDIR] = "RELEASEDIR",
+    [FUSE_FSYNCDIR] = "FSYNCDIR",
+    [FUSE_GETLK] = "GETLK",
+    [FUSE_SETLK] = "SETLK",
+    [FUSE_SETLKW] = "SETLKW",
+    [FUSE_ACCESS] = "ACCESS",
+    [FUSE_CREATE] = "CREATE",
+    [FUSE_INTERRUPT] = "INTERRUPT",
+    [FUSE_BMAP] = "BMAP",
+    [FUSE_DESTROY] = "DESTROY",
+    [FUSE_IOCTL] = "IOCTL",
+    [FUSE_POLL] = "POLL",
+    [FUSE_NOTIFY_REPLY] = "NOTIFY_REPLY",
+    [FUSE_BATCH_FORGET] = "BATCH_FORGET",
+    [FUSE_FALLOCATE] = "FALLOCATE",
+    [FUSE_READDIRPLUS] = "READDIRPLUS",
+    [FUSE_RENAME2] = "RENAME2",
+    [FUSE_LSEEK] = "LSEEK",
+    [FUSE_COPY_FILE_RANGE] = "COPY_FILE_RANGE",
+    [FUSE_SETUPMAPPING] = "SETUPMAPPING",
+    [FUSE_REMOVEMAPPING] = "REMOVEMAPPING",
+};
+
+static const char *opname(uint32_t opcode)
+{
+    static char buf[16];
+    if (opcode < sizeof(opnames) / sizeof(opnames[0]) && opnames[opcode])
+        return opnames[opcode];
+    snprintf(buf, sizeof(buf), "OP_%u", opcode);
+    return buf;
+}
+
+// Duration of a stage, 0 when one of its ends wasn't recorded
+static uint64_t stage(uint64_t from, uint64_t to)
+{
+    return from && to && to > from ? to - from : 0;
+}
+
+static int cmp_harvest(const void *a, const void *b)
+{
+    const struct virtiofs_emu_trace_rec *ra = a, *rb = b;
+    return ra->t_harvest < rb->t_harvest ? -1 : ra->t_harvest > rb->t_harvest;
+}
+
+static void usage()
+{
+    printf("trace_decode [-f] trace_file\n"
+           "Prints the requests of the trace in harvest order with the time they spent\n"
+           "queued (harvest to dispatch), in the backend (dispatch to done)\n"
+           "and waiting to be published (done to publish), in ns.\n"
+           "-f prints folded stacks for flamegraph.pl instead\n");
+}
+
+int main(int argc, char **argv)
+{
+    int folded = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "f")) != -1) {
+        switch (opt) {
+            case 'f':
+                folded = 1;
+                break;
+            default: /* '?' */
+                usage();
+                exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        exit(1);
+    }
+
+    FILE *f = fopen(argv[optind], "r");
+    if (!f) {
+        perror(argv[optind]);
+        exit(1);
+    }
+
+    struct virtiofs_emu_trace_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, VIRTIOFS_EMU_TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+        fprintf(stderr, "%s is not a virtiofs_emu trace\n", argv[optind]);
+        exit(1);
+    }
+    if (hdr.version != VIRTIOFS_EMU_TRACE_VERSION ||
+        hdr.rec_size != sizeof(struct virtiofs_emu_trace_rec)) {
+        fprintf(stderr, "Unsupported trace version %u (record size %u)\n", hdr.version, hdr.rec_size);
+        exit(1);
+    }
+
+    size_t nrecs = 0;
+    size_t cap = 4096;
+    struct virtiofs_emu_trace_rec *recs = malloc(cap * sizeof(*recs));
+    while (recs && fread(&recs[nrecs], sizeof(*recs), 1, f) == 1) {
+        if (++nrecs == cap) {
+            cap *= 2;
+            recs = realloc(recs, cap * sizeof(*recs));
+        }
+    }
+    fclose(f);
+    if (!recs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    qsort(recs, nrecs, sizeof(*recs), cmp_harvest);
+
+    if (folded) {
+        // One line per request and stage, flamegraph.pl adds up the same stacks
+        for (size_t i = 0; i < nrecs; i++) {
+            struct virtiofs_emu_trace_rec *r = &recs[i];
+            const char *op = opname(r->opcode);
+            printf("%s;queued %" PRIu64 "\n", op, stage(r->t_harvest, r->t_dispatch));
+            printf("%s;backend %" PRIu64 "\n", op, stage(r->t_dispatch, r->t_done));
+            printf("%s;publish %" PRIu64 "\n", op, stage(r->t_done, r->t_publish));
+        }
+        free(recs);
+        return 0;
+    }
+
+    printf("# %zu requests of %u threads\n", nrecs, hdr.nthreads);
+    printf("%-16s %3s %4s %10s %-12s %10s %8s %5s %6s %10s %10s %10s\n", "harvest_ns", "thr", "exec",
+           "unique", "op", "nodeid", "size", "error", "status", "queued", "backend", "publish");
+    uint64_t t0 = nrecs ? recs[0].t_harvest : 0;
+    for (size_t i = 0; i < nrecs; i++) {
+        struct virtiofs_emu_trace_rec *r = &recs[i];
+        printf("%-16" PRIu64 " %3u %4u %10" PRIu64 " %-12s %10" PRIu64 " %8u %5d %6d %10" PRIu64
+               " %10" PRIu64 " %10" PRIu64 "\n",
+               r->t_harvest - t0, r->thread, r->exec_thread, r->unique, opname(r->opcode), r->nodeid,
+               r->size, r->error, r->backend_status, stage(r->t_harvest, r->t_dispatch),
+               stage(r->t_dispatch, r->t_done), stage(r->t_done, r->t_publish));
+    }
+    free(recs);
+
+    return 0;
+}
@@ -8,11 +8,11 @@
 */
 
 /*
- * The ENOSYS returns for FUSE operations are always after fully parsing
- * the input data, this is useful because that data can then be used
- * for debug printing. It does not affect performance because FUSE
- * implementations are required to never call that operation again after
- * an ENOSYS.
+ * Every request goes through fuse_ll_handle(), which validates it against
+ * its row of FUSE_LL_OPCODES (see fuse_ll_opcodes.h), sets up the reply header
+ * and answers the EBUSY and ENOSYS cases before the fuse_ll_<name> handler runs.
+ * The ENOSYS returns don't affect performance because FUSE implementations are
+ * required to never call that operation again after an ENOSYS.
  */
 
 #include <stdint.h>
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <err.h>
+#include <fnmatch.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -32,6 +33,7 @@
 #include "config.h"
 #include "common.h"
 #include "fuse_ll.h"
+#include "fuse_ll_opcodes.h"
 #include "debug.h"
 #include "virtiofs_emu_ll.h"
 
@@ -215,6 +217,128 @@ int fuse_ll_reply_iov(struct fuse_session *se, struct fuse_out_header *out_hdr,
     return 0;
 }
 
+bool fuse_ll_notify_supported(struct fuse_session *se)
+{
+    return se->got_init && se->conn.proto_minor >= 12 &&
+           virtiofs_emu_ll_notifications_supported(se->emu, se->dev);
+}
+
+// iov[0] is left for the header, like send_notify_iov of libfuse
+static int fuse_ll_notify(struct fuse_session *se, int notify_code, struct iovec *iov, int iovcnt)
+{
+    if (!fuse_ll_notify_supported(se))
+        return -ENOSYS;
+
+    struct fuse_out_header out;
+    out.unique = 0;
+    out.error = notify_code;
+    out.len = sizeof(out);
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(out);
+    for (int i = 1; i < iovcnt; i++)
+        out.len += iov[i].iov_len;
+
+    int ret = virtiofs_emu_ll_send_notification(se->emu, se->dev, iov, iovcnt);
+    return ret == -ENOTSUP ? -ENOSYS : ret;
+}
+
+int fuse_ll_notify_inval_inode(struct fuse_session *se, fuse_ino_t ino, off_t off, off_t len)
+{
+    struct fuse_notify_inval_inode_out outarg;
+    outarg.ino = ino;
+    outarg.off = off;
+    outarg.len = len;
+
+    struct iovec iov[2];
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+    return fuse_ll_notify(se, FUSE_NOTIFY_INVAL_INODE, iov, 2);
+}
+
+int fuse_ll_notify_inval_entry(struct fuse_session *se, fuse_ino_t parent,
+                               const char *name, size_t namelen)
+{
+    // Newer kernel headers call the padding flags
+    struct fuse_notify_inval_entry_out outarg;
+    memset(&outarg, 0, sizeof(outarg));
+    outarg.parent = parent;
+    outarg.namelen = namelen;
+
+    struct iovec iov[3];
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+    // With the terminating zero
+    iov[2].iov_base = (void *) name;
+    iov[2].iov_len = namelen + 1;
+    return fuse_ll_notify(se, FUSE_NOTIFY_INVAL_ENTRY, iov, 3);
+}
+
+int fuse_ll_notify_delete(struct fuse_session *se, fuse_ino_t parent, fuse_ino_t child,
+                          const char *name, size_t namelen)
+{
+    if (se->conn.proto_minor < 18)
+        return -ENOSYS;
+
+    struct fuse_notify_delete_out outarg;
+    outarg.parent = parent;
+    outarg.child = child;
+    outarg.namelen = namelen;
+    outarg.padding = 0;
+
+    struct iovec iov[3];
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+    iov[2].iov_base = (void *) name;
+    iov[2].iov_len = namelen + 1;
+    return fuse_ll_notify(se, FUSE_NOTIFY_DELETE, iov, 3);
+}
+
+int fuse_ll_direct_io_parse(const char *spec, struct fuse_ll_direct_io *dio)
+{
+    memset(dio, 0, sizeof(*dio));
+    char *end;
+    uint64_t mib = strtoull(spec, &end, 10);
+    if (end == spec || (*end != '\0' && *end != ','))
+        return -EINVAL;
+    dio->size = mib << 20;
+
+    while (*end == ',') {
+        const char *pattern = end + 1;
+        end = (char *) pattern + strcspn(pattern, ",");
+        if (end == pattern)
+            goto err;
+        char **patterns = realloc(dio->patterns, (dio->npatterns + 1) * sizeof(char *));
+        if (!patterns)
+            goto err;
+        dio->patterns = patterns;
+        dio->patterns[dio->npatterns] = strndup(pattern, end - pattern);
+        if (!dio->patterns[dio->npatterns])
+            goto err;
+        dio->npatterns++;
+    }
+    return 0;
+err:
+    fuse_ll_direct_io_free(dio);
+    return -EINVAL;
+}
+
+void fuse_ll_direct_io_free(struct fuse_ll_direct_io *dio)
+{
+    for (uint32_t i = 0; i < dio->npatterns; i++)
+        free(dio->patterns[i]);
+    free(dio->patterns);
+    memset(dio, 0, sizeof(*dio));
+}
+
+bool fuse_ll_direct_io_name(const struct fuse_ll_direct_io *dio, const char *name)
+{
+    for (uint32_t i = 0; i < dio->npatterns; i++) {
+        if (fnmatch(dio->patterns[i], name, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
 void iov_init(struct iov *iov, struct iovec *iovec, int iovcnt) {
     iov->iovec = iovec;
     iov->iovcnt = iovcnt;
@@ -309,20 +433,111 @@ size_t fuse_add_direntry_plus(struct iov *read_iov,
     return iov_write_buf(read_iov, buf, entlen_padded);
 }
 
-static int fuse_ll_init(struct fuse_ll *f_ll,
+typedef int (*fuse_ll_handler_t) (struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
-               struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
+               struct snap_fs_dev_io_done_ctx *cb);
+
+#define X(opcode, name, impl, in_iovs, in_min, out_iovs, out_min, flags) \
+static int fuse_ll_##name(struct fuse_ll *f_ll, \
+               struct iovec *fuse_in_iov, int in_iovcnt, \
+               struct iovec *fuse_out_iov, int out_iovcnt, \
+               struct snap_fs_dev_io_done_ctx *cb);
+FUSE_LL_OPCODES(X)
+#undef X
+
+struct fuse_ll_opcode {
+    fuse_ll_handler_t handler;
+    const char *name;
+    uint8_t in_iovs;
+    uint8_t out_iovs;
+    uint8_t flags;
+    uint32_t in_min;
+    uint32_t out_min;
+};
+
+static const struct fuse_ll_opcode fuse_ll_opcodes[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN] = {
+#define X(opcode, name, impl, in_iovs, in_min, out_iovs, out_min, flags) \
+    [opcode] = { fuse_ll_##name, #opcode, in_iovs, out_iovs, flags, in_min, out_min },
+FUSE_LL_OPCODES(X)
+#undef X
+};
+
+// hdr is the fuse_in_header or fuse_out_header that the first iovec starts with
+static inline bool fuse_ll_iovs_valid(struct iovec *iov, int iovcnt, uint8_t iovs, bool more,
+                                      size_t hdr, size_t min)
+{
+    if (iovcnt < iovs || (!more && iovcnt != iovs))
+        return false;
+    if (iovs == 0)
+        return true;
+    if (iovs == 1)
+        return iov[0].iov_len >= hdr + min;
+    return iov[0].iov_len >= hdr && iov[iovs - 1].iov_len >= min;
+}
+
+// Everything that comes before the handler of a request
+// returns 0 to call the handler, 1 when the reply is already there or -EINVAL
+static inline int fuse_ll_prologue(struct fuse_ll *f_ll,
+               struct iovec *fuse_in_iov, int in_iovcnt,
+               struct iovec *fuse_out_iov, int out_iovcnt)
+{
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    // emu_ll only gives us the opcodes of the table
+    const struct fuse_ll_opcode *op = &fuse_ll_opcodes[in_hdr->opcode];
+
+    if (!fuse_ll_iovs_valid(fuse_in_iov, in_iovcnt, op->in_iovs, op->flags & FUSE_LL_OP_MORE_IN,
+                            sizeof(struct fuse_in_header), op->in_min) ||
+        !fuse_ll_iovs_valid(fuse_out_iov, out_iovcnt, op->out_iovs, op->flags & FUSE_LL_OP_MORE_OUT,
+                            sizeof(struct fuse_out_header), op->out_min)) {
+        fprintf(stderr, "%s: invalid iovecs!\n", op->name);
         return -EINVAL;
     }
+    if (op->flags & FUSE_LL_OP_NOREPLY)
+        return 0;
 
-    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
     out_hdr->unique = in_hdr->unique;
     out_hdr->len = sizeof(*out_hdr);
     out_hdr->error = 0;
+    if (op->flags & FUSE_LL_OP_PREINIT)
+        return 0;
+
+    if (!f_ll->se->init_done) {
+        out_hdr->error = -EBUSY;
+        return 1;
+    }
+    if (!f_ll->implemented[in_hdr->opcode]) {
+#ifdef DEBUG_ENABLED
+        printf("%s: not implemented\n", op->name);
+#endif
+        out_hdr->error = -ENOSYS;
+        return 1;
+    }
+    return 0;
+}
+
+// The emu_ll handler of every opcode in the table
+static int fuse_ll_handle(struct fuse_ll *f_ll,
+               struct iovec *fuse_in_iov, int in_iovcnt,
+               struct iovec *fuse_out_iov, int out_iovcnt,
+               struct snap_fs_dev_io_done_ctx *cb)
+{
+    int ret = fuse_ll_prologue(f_ll, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt);
+    if (ret)
+        return ret < 0 ? ret : 0;
+
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    return fuse_ll_opcodes[in_hdr->opcode].handler(f_ll, fuse_in_iov, in_iovcnt,
+                                                   fuse_out_iov, out_iovcnt, cb);
+}
+
+static int fuse_ll_init(struct fuse_ll *f_ll,
+               struct iovec *fuse_in_iov, int in_iovcnt,
+               struct iovec *fuse_out_iov, int out_iovcnt,
+               struct snap_fs_dev_io_done_ctx *cb) {
+    struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
+    struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
     struct fuse_init_in *inarg = (struct fuse_init_in *) fuse_in_iov[1].iov_base;
     struct fuse_init_out *outarg = (struct fuse_init_out *) fuse_out_iov[1].iov_base;
 
@@ -331,8 +546,22 @@ static int fuse_ll_init(struct fuse_ll *f_ll,
         out_hdr->error = -EISCONN;
         return 0;
     }
+    // What we tell the guest holds for the whole mount, so wait until the backend knows
+    uint32_t max_io = f_ll->ops.max_io_size ? f_ll->ops.max_io_size(f_ll->user_data) : 0;
+    if (f_ll->ops.max_io_size && max_io == 0)
+        return EBUSY;
+    virtiofs_emu_ll_startup_mark("FUSE_INIT from the host");
 
     size_t bufsize = se->bufsize;
+    if (max_io) {
+        size_t pages = max_io / getpagesize();
+        if (pages < 1)
+            pages = 1;
+        if (bufsize > pages * getpagesize() + FUSE_BUFFER_HEADER_SIZE)
+            bufsize = pages * getpagesize() + FUSE_BUFFER_HEADER_SIZE;
+        if (se->conn.max_readahead > pages * getpagesize())
+            se->conn.max_readahead = pages * getpagesize();
+    }
     size_t outargsize = sizeof(*inarg);
 #ifdef DEBUG_ENABLED
     printf("INIT in: %u.%u\n", inarg->major, inarg->minor);
@@ -345,7 +574,7 @@ static int fuse_ll_init(struct fuse_ll *f_ll,
     se->conn.proto_minor = inarg->minor;
     se->conn.capable = 0;
     se->conn.want = 0;
-    se->conn.max_background = VIRTIOFS_EMU_LL_MAX_BACKGROUND;
+    se->conn.max_background = f_ll->max_background;
 
     memset(outarg, 0, sizeof(*outarg));
     outarg->major = FUSE_KERNEL_VERSION;
@@ -543,6 +772,9 @@ static int fuse_ll_init(struct fuse_ll *f_ll,
     }
     if (se->conn.proto_minor >= 23)
         outarg->time_gran = se->conn.time_gran;
+    if (max_io)
+        printf("FUSE_INIT: READ/WRITE up to %u KiB, readahead %u KiB\n",
+               outarg->max_write >> 10, outarg->max_readahead >> 10);
 
 #ifdef DEBUG_ENABLED
     printf("INIT out: %u.%u\n", outarg->major, outarg->minor);
@@ -567,16 +799,8 @@ static int fuse_ll_destroy(struct fuse_ll *f_ll,
                   struct iovec *fuse_in_iov, int in_iovcnt,
                   struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 1 || out_iovcnt != 1) {
-        fprintf(stderr, "fuser_destroy: invalid number of iovecs!\n");
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     f_ll->se->got_destroy = 1;
     if (f_ll->ops.destroy)
@@ -590,16 +814,8 @@ static int fuse_ll_lookup(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
     const char *const in_name = fuse_in_iov[1].iov_base;
     struct fuse_entry_out *out_entry = (struct fuse_entry_out *) fuse_out_iov[1].iov_base;
 
@@ -608,16 +824,7 @@ static int fuse_ll_lookup(struct fuse_ll *f_ll,
     printf("* in_name: %s\n", in_name);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (f_ll->ops.lookup)
-        return f_ll->ops.lookup(f_ll->se, f_ll->user_data, in_hdr, in_name, out_hdr, out_entry, cb);
-    else {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
+    return f_ll->ops.lookup(f_ll->se, f_ll->user_data, in_hdr, in_name, out_hdr, out_entry, cb);
 }
 
 static int fuse_ll_setattr(struct fuse_ll *f_ll,
@@ -625,16 +832,8 @@ static int fuse_ll_setattr(struct fuse_ll *f_ll,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
 
-    if (in_iovcnt != 2 || out_iovcnt != 2) {
-        fprintf(stderr, "fuser_setattr: invalid number of iovecs!\n");
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_setattr_in *in_setattr = (struct fuse_setattr_in *) fuse_in_iov[1].iov_base;
     struct fuse_attr_out *out_attr = (struct fuse_attr_out *) fuse_out_iov[1].iov_base;
@@ -644,11 +843,6 @@ static int fuse_ll_setattr(struct fuse_ll *f_ll,
     printf("* fh: %lu", in_setattr->fh);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-
     if (f_ll->ops.setattr) {
         struct fuse_file_info *fi = NULL;
         struct fuse_file_info fi_store;
@@ -673,11 +867,8 @@ static int fuse_ll_setattr(struct fuse_ll *f_ll,
             FUSE_SET_ATTR_CTIME;
 
         return f_ll->ops.setattr(f_ll->se, f_ll->user_data, in_hdr, &s, in_setattr->valid, fi, out_hdr, out_attr, cb);
-    } else if (f_ll->ops.setattr_async) {
-        return f_ll->ops.setattr_async(f_ll->se, f_ll->user_data, in_hdr, in_setattr, out_hdr, out_attr, cb);
     } else {
-        out_hdr->error = -ENOSYS;
-        return 0;
+        return f_ll->ops.setattr_async(f_ll->se, f_ll->user_data, in_hdr, in_setattr, out_hdr, out_attr, cb);
     }
 }
     
@@ -686,16 +877,8 @@ static int fuse_ll_create(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     char *name;
     struct fuse_entry_out *out_entry = (struct fuse_entry_out *) fuse_out_iov[1].iov_base;
@@ -723,15 +906,6 @@ static int fuse_ll_create(struct fuse_ll *f_ll,
     printf("* name: %s\n", name);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.create) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.create(f_ll->se, f_ll->user_data, in_hdr, in_create, name, out_hdr, out_entry, out_open, cb);
 }
 
@@ -739,16 +913,8 @@ static int fuse_ll_flush(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_flush_in *in_flush = (struct fuse_flush_in *) fuse_in_iov[1].iov_base;
     struct fuse_file_info fi;
@@ -758,15 +924,6 @@ static int fuse_ll_flush(struct fuse_ll *f_ll,
     printf("* fh: %lu\n", in_flush->fh);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.flush) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     memset(&fi, 0, sizeof(fi));
     fi.fh = in_flush->fh;
     fi.flush = 1;
@@ -780,16 +937,8 @@ static int fuse_ll_setlk_common(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                struct snap_fs_dev_io_done_ctx *cb, bool sleep) {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_lk_in *in_lk = (struct fuse_lk_in *) fuse_in_iov[1].iov_base;
     struct fuse_file_info fi;
@@ -800,11 +949,6 @@ static int fuse_ll_setlk_common(struct fuse_ll *f_ll,
     printf("* fh: %lu\n", in_lk->fh);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-
     fi.fh = in_lk->fh;
     fi.lock_owner = in_lk->owner;
 
@@ -825,12 +969,7 @@ static int fuse_ll_setlk_common(struct fuse_ll *f_ll,
         if (!sleep)
             op |= LOCK_NB;
 
-        if (f_ll->ops.flock) {
-            return f_ll->ops.flock(f_ll->se, f_ll->user_data, in_hdr, &fi, op, out_hdr, cb);
-        } else {
-            out_hdr->error = -ENOSYS;
-            return 0;
-        }
+        return f_ll->ops.flock(f_ll->se, f_ll->user_data, in_hdr, &fi, op, out_hdr, cb);
     }
     else {
         out_hdr->error = -ENOSYS;
@@ -856,16 +995,8 @@ static int fuse_ll_getattr(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 2) {
-        fprintf(stderr, "fuser_mirror_getattr: invalid number of iovecs!\n");
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_getattr_in *in_getattr = (struct fuse_getattr_in *) fuse_in_iov[1].iov_base;
     struct fuse_attr_out *out_attr = (struct fuse_attr_out *) fuse_out_iov[1].iov_base;
@@ -875,32 +1006,53 @@ static int fuse_ll_getattr(struct fuse_ll *f_ll,
     printf("* fh: %lu\n", in_getattr->fh);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.getattr) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.getattr(f_ll->se, f_ll->user_data, in_hdr, in_getattr, out_hdr, out_attr, cb);
 }
 
+static uint32_t fuse_ll_getattr_burst(struct fuse_ll *f_ll, uint32_t opcode,
+               struct virtiofs_emu_ll_req *reqs, uint32_t nreqs) {
+    struct fuse_ll_getattr_req greqs[VIRTIOFS_EMU_LL_MAX_BURST];
+    uint32_t greqs_idx[VIRTIOFS_EMU_LL_MAX_BURST]; // Where greqs[j] is in reqs
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < nreqs; i++) {
+        struct virtiofs_emu_ll_req *r = &reqs[i];
+        int ret = fuse_ll_prologue(f_ll, r->fuse_in_iov, r->in_iovcnt, r->fuse_out_iov, r->out_iovcnt);
+        if (ret) {
+            r->cb->cb(ret < 0 ? SNAP_FS_DEV_OP_IO_ERROR : SNAP_FS_DEV_OP_SUCCESS, r->cb->user_arg);
+            continue;
+        }
+
+        struct fuse_in_header *in_hdr = (struct fuse_in_header *) r->fuse_in_iov[0].iov_base;
+        struct fuse_out_header *out_hdr = (struct fuse_out_header *) r->fuse_out_iov[0].iov_base;
+
+#ifdef DEBUG_ENABLED
+        fuse_ll_debug_print_in_hdr(in_hdr);
+#endif
+
+        greqs[n].in_hdr = in_hdr;
+        greqs[n].in_getattr = (struct fuse_getattr_in *) r->fuse_in_iov[1].iov_base;
+        greqs[n].out_hdr = out_hdr;
+        greqs[n].out_attr = (struct fuse_attr_out *) r->fuse_out_iov[1].iov_base;
+        greqs[n].cb = r->cb;
+        greqs_idx[n] = i;
+        n++;
+    }
+
+    uint32_t took = n ? f_ll->ops.getattr_burst(f_ll->se, f_ll->user_data, greqs, n) : 0;
+    // The ones handed back go to the end of reqs in the same order, the places of
+    // the others are free as they are done
+    for (uint32_t j = n; j-- > took;)
+        reqs[nreqs - (n - j)] = reqs[greqs_idx[j]];
+    return nreqs - (n - took);
+}
+
 static int fuse_ll_opendir(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_open_in *in_open = (struct fuse_open_in *) fuse_in_iov[1].iov_base;
     struct fuse_open_out *out_open = (struct fuse_open_out *) fuse_out_iov[1].iov_base;
@@ -910,15 +1062,11 @@ static int fuse_ll_opendir(struct fuse_ll *f_ll,
     printf("* flags: 0x%X\n", in_open->flags);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.opendir) {
+    // Open-less, the guest takes this as success and never asks again
+    if (f_ll->se->conn.want & FUSE_CAP_NO_OPENDIR_SUPPORT) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
-
     return f_ll->ops.opendir(f_ll->se, f_ll->user_data, in_hdr, in_open, out_hdr, out_open, cb);
 }
 
@@ -926,16 +1074,8 @@ static int fuse_ll_releasedir(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_release_in *in_release = (struct fuse_release_in *) fuse_in_iov[1].iov_base;
 
@@ -944,15 +1084,6 @@ static int fuse_ll_releasedir(struct fuse_ll *f_ll,
     printf("* fh: %lu\n", in_release->fh);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.releasedir) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.releasedir(f_ll->se, f_ll->user_data, in_hdr, in_release, out_hdr, cb);
 }
 
@@ -961,17 +1092,8 @@ static int fuse_ll_readdir_common(struct fuse_ll *f_ll,
                struct iovec *fuse_out_iov, int out_iovcnt,
                struct snap_fs_dev_io_done_ctx *cb,
                bool plus) {
-    if (!(in_iovcnt > 1 || out_iovcnt > 1)) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
-
 
     struct fuse_read_in *in_read = (struct fuse_read_in *) fuse_in_iov[1].iov_base;
 
@@ -980,15 +1102,6 @@ static int fuse_ll_readdir_common(struct fuse_ll *f_ll,
     printf("* fh: %lu\n", in_read->fh);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.readdir) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     struct iov read_iov;
     iov_init(&read_iov, &fuse_out_iov[1], out_iovcnt-1);
 
@@ -1013,16 +1126,8 @@ static int fuse_ll_open(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_open_in *in_open = (struct fuse_open_in *) fuse_in_iov[1].iov_base;
     struct fuse_open_out *out_open = (struct fuse_open_out *) fuse_out_iov[1].iov_base;
@@ -1032,15 +1137,11 @@ static int fuse_ll_open(struct fuse_ll *f_ll,
     printf("* flags: 0x%X\n", in_open->flags);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.open) {
+    // Open-less, the guest takes this as success and never asks again
+    if (f_ll->se->conn.want & FUSE_CAP_NO_OPEN_SUPPORT) {
         out_hdr->error = -ENOSYS;
         return 0;
     }
-
     return f_ll->ops.open(f_ll->se, f_ll->user_data, in_hdr, in_open, out_hdr, out_open, cb);
 }
 
@@ -1048,16 +1149,8 @@ static int fuse_ll_release(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_release_in *in_release = (struct fuse_release_in *) fuse_in_iov[1].iov_base;
 
@@ -1069,15 +1162,6 @@ static int fuse_ll_release(struct fuse_ll *f_ll,
     printf("* lock_owner: %lu\n", in_release->lock_owner);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.release) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.release(f_ll->se, f_ll->user_data, in_hdr, in_release, out_hdr, cb);
 }
 
@@ -1085,16 +1169,8 @@ static int fuse_ll_fsync(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_fsync_in *in_fsync = (struct fuse_fsync_in *) fuse_in_iov[1].iov_base;
 
@@ -1104,15 +1180,6 @@ static int fuse_ll_fsync(struct fuse_ll *f_ll,
     printf("* fsync_flags: 0x%X\n", in_fsync->fsync_flags);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.fsync) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.fsync(f_ll->se, f_ll->user_data, in_hdr, in_fsync, out_hdr, cb);
 }
 
@@ -1120,16 +1187,8 @@ static int fuse_ll_fsyncdir(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_fsync_in *in_fsync = (struct fuse_fsync_in *) fuse_in_iov[1].iov_base;
 
@@ -1139,15 +1198,6 @@ static int fuse_ll_fsyncdir(struct fuse_ll *f_ll,
     printf("* fsync_flags: 0x%X\n", in_fsync->fsync_flags);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.fsyncdir) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.fsyncdir(f_ll->se, f_ll->user_data, in_hdr, in_fsync, out_hdr, cb);
 }
 
@@ -1155,16 +1205,8 @@ static int fuse_ll_rmdir(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     const char *const in_name = (const char *) fuse_in_iov[1].iov_base;
 
@@ -1173,15 +1215,6 @@ static int fuse_ll_rmdir(struct fuse_ll *f_ll,
     printf("* name: %s\n", in_name);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.rmdir) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.rmdir(f_ll->se, f_ll->user_data, in_hdr, in_name, out_hdr, cb);
 }
 
@@ -1189,11 +1222,6 @@ static int fuse_ll_forget(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 1 || out_iovcnt != 0) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_forget_in *in_forget = (struct fuse_forget_in *) (((char *) fuse_in_iov[0].iov_base) + sizeof(struct fuse_in_header));
 
@@ -1211,11 +1239,6 @@ static int fuse_ll_batch_forget(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 1 || out_iovcnt != 0) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_batch_forget_in *in_batch_forget = (struct fuse_batch_forget_in *) (((char *) fuse_in_iov[0].iov_base)
             + sizeof(struct fuse_in_header));
@@ -1236,16 +1259,8 @@ static int fuse_ll_rename(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_rename_in *in_rename = (struct fuse_rename_in *) fuse_in_iov[1].iov_base;
     const char *name = ((char *) fuse_in_iov[1].iov_base) + sizeof(*in_rename);
@@ -1258,15 +1273,6 @@ static int fuse_ll_rename(struct fuse_ll *f_ll,
     printf("* new_name: %s\n", new_name);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.rename) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.rename(f_ll->se, f_ll->user_data, in_hdr, name, in_rename->newdir,
                     new_name, 0, out_hdr, cb);
 }
@@ -1275,16 +1281,8 @@ static int fuse_ll_rename2(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_rename2_in *in_rename2 = (struct fuse_rename2_in *) fuse_in_iov[1].iov_base;
     const char *name = ((char *) fuse_in_iov[1].iov_base) + sizeof(*in_rename2);
@@ -1298,15 +1296,6 @@ static int fuse_ll_rename2(struct fuse_ll *f_ll,
     printf("* new_name: %s\n", new_name);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.rename) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
 
     return f_ll->ops.rename(f_ll->se, f_ll->user_data, in_hdr, name, in_rename2->newdir,
                     new_name, in_rename2->flags, out_hdr, cb);
@@ -1316,16 +1305,8 @@ static int fuse_ll_read(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                   struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt != 2 || out_iovcnt < 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_read_in *in_read = (struct fuse_read_in *) fuse_in_iov[1].iov_base;
 
@@ -1339,15 +1320,6 @@ static int fuse_ll_read(struct fuse_ll *f_ll,
     printf("* flags: 0x%X\n", in_read->flags);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.read) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     size_t total_read_iov_size = 0;
     for (int i = 1; i < out_iovcnt; i++) {
         total_read_iov_size += fuse_out_iov[i].iov_len;
@@ -1366,16 +1338,8 @@ static int fuse_ll_write(struct fuse_ll *f_ll,
                struct iovec *fuse_in_iov, int in_iovcnt,
                struct iovec *fuse_out_iov, int out_iovcnt,
                struct snap_fs_dev_io_done_ctx *cb) {
-    if (in_iovcnt < 2 || out_iovcnt != 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_write_in *in_write = (struct fuse_write_in *) fuse_in_iov[1].iov_base;
     struct fuse_write_out *out_write = (struct fuse_write_out *) fuse_out_iov[1].iov_base;
@@ -1390,15 +1354,6 @@ static int fuse_ll_write(struct fuse_ll *f_ll,
     printf("* flags: 0x%X\n", in_write->flags);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.write) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     size_t total_write_iov_size = 0;
     for (int i = 2; i < in_iovcnt; i++) {
         total_write_iov_size += fuse_in_iov[i].iov_len;
@@ -1418,25 +1373,8 @@ static int fuse_ll_mknod(struct fuse_ll *f_ll,
                struct iovec *fuse_out_iov, int out_iovcnt,
            struct snap_fs_dev_io_done_ctx *cb)
 {
-    if (in_iovcnt != 2 || out_iovcnt != 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
-
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.mknod) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
 
     struct fuse_mknod_in *in_mknod = (struct fuse_mknod_in *) fuse_in_iov[1].iov_base;
     const char *in_name;
@@ -1463,16 +1401,8 @@ static int fuse_ll_mkdir(struct fuse_ll *f_ll,
                struct iovec *fuse_out_iov, int out_iovcnt,
            struct snap_fs_dev_io_done_ctx *cb)
 {
-    if (in_iovcnt != 2 || out_iovcnt != 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_mkdir_in *in_mkdir = (struct fuse_mkdir_in *) fuse_in_iov[1].iov_base;
     const char *in_name = ((char *) fuse_in_iov[1].iov_base) + sizeof(struct fuse_mkdir_in);
@@ -1485,15 +1415,6 @@ static int fuse_ll_mkdir(struct fuse_ll *f_ll,
     printf("* umask: 0x%X\n", in_mkdir->umask);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.mkdir) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.mkdir(f_ll->se, f_ll->user_data, in_hdr, in_mkdir, in_name, out_hdr, out_entry, cb);
 }
 
@@ -1502,16 +1423,8 @@ static int fuse_ll_symlink(struct fuse_ll *f_ll,
                struct iovec *fuse_out_iov, int out_iovcnt,
            struct snap_fs_dev_io_done_ctx *cb)
 {
-    if (in_iovcnt != 2 || out_iovcnt != 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     const char *in_name = fuse_in_iov[1].iov_base;
     const char *in_link_name = in_name + strlen(in_name)+1;
@@ -1525,15 +1438,6 @@ static int fuse_ll_symlink(struct fuse_ll *f_ll,
     printf("* oldnodeid: %lu\n", in_link->oldnodeid);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.symlink) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.symlink(f_ll->se, f_ll->user_data, in_hdr, in_name, in_link_name, out_hdr, out_entry, cb);
 }
 
@@ -1542,16 +1446,8 @@ static int fuse_ll_statfs(struct fuse_ll *f_ll,
                struct iovec *fuse_out_iov, int out_iovcnt,
            struct snap_fs_dev_io_done_ctx *cb)
 {
-    if (in_iovcnt != 1 || out_iovcnt != 2) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_statfs_out *out_statfs = (struct fuse_statfs_out *) fuse_out_iov[1].iov_base;
 
@@ -1559,15 +1455,6 @@ static int fuse_ll_statfs(struct fuse_ll *f_ll,
     fuse_ll_debug_print_in_hdr(in_hdr);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.statfs) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.statfs(f_ll->se, f_ll->user_data, in_hdr, out_hdr, out_statfs, cb);
 }
 
@@ -1576,16 +1463,8 @@ static int fuse_ll_unlink(struct fuse_ll *f_ll,
                struct iovec *fuse_out_iov, int out_iovcnt,
            struct snap_fs_dev_io_done_ctx *cb)
 {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     const char *in_name = (const char *) fuse_in_iov[1].iov_base;
 
@@ -1594,15 +1473,6 @@ static int fuse_ll_unlink(struct fuse_ll *f_ll,
     printf("* name: %s\n", in_name);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.unlink) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.unlink(f_ll->se, f_ll->user_data , in_hdr, in_name, out_hdr, cb);
 }
 
@@ -1633,16 +1503,8 @@ static int fuse_ll_fallocate(struct fuse_ll *f_ll,
                struct iovec *fuse_out_iov, int out_iovcnt,
            struct snap_fs_dev_io_done_ctx *cb)
 {
-    if (in_iovcnt != 2 || out_iovcnt != 1) {
-        fprintf(stderr, "%s: invalid number of iovecs!\n", __func__);
-        return -EINVAL;
-    }
-
     struct fuse_in_header *in_hdr = (struct fuse_in_header *) fuse_in_iov[0].iov_base;
     struct fuse_out_header *out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
-    out_hdr->unique = in_hdr->unique;
-    out_hdr->len = sizeof(*out_hdr);
-    out_hdr->error = 0;
 
     struct fuse_fallocate_in *in_fallocate = (struct fuse_fallocate_in *) fuse_in_iov[1].iov_base;
 
@@ -1654,62 +1516,51 @@ static int fuse_ll_fallocate(struct fuse_ll *f_ll,
     printf("* mode: %u\n", in_fallocate->mode);
 #endif
 
-    if (!f_ll->se->init_done) {
-        out_hdr->error = -EBUSY;
-        return 0;
-    }
-    if (!f_ll->ops.fallocate) {
-        out_hdr->error = -ENOSYS;
-        return 0;
-    }
-
     return f_ll->ops.fallocate(f_ll->se, f_ll->user_data, in_hdr, in_fallocate, out_hdr, cb);
 }
 
-static void fuse_ll_map_emu(struct virtiofs_emu_ll_params *emu_ll_params) {
-    emu_ll_params->fuse_handlers[FUSE_INIT] = (virtiofs_emu_ll_handler_t) fuse_ll_init;
-    emu_ll_params->fuse_handlers[FUSE_DESTROY] = (virtiofs_emu_ll_handler_t) fuse_ll_destroy;
-    emu_ll_params->fuse_handlers[FUSE_GETATTR] = (virtiofs_emu_ll_handler_t) fuse_ll_getattr;
-    emu_ll_params->fuse_handlers[FUSE_LOOKUP] = (virtiofs_emu_ll_handler_t) fuse_ll_lookup;
-    emu_ll_params->fuse_handlers[FUSE_SETATTR] = (virtiofs_emu_ll_handler_t) fuse_ll_setattr;
-    emu_ll_params->fuse_handlers[FUSE_OPENDIR] = (virtiofs_emu_ll_handler_t) fuse_ll_opendir;
-    emu_ll_params->fuse_handlers[FUSE_RELEASEDIR] = (virtiofs_emu_ll_handler_t) fuse_ll_releasedir;
-    emu_ll_params->fuse_handlers[FUSE_READDIR] = (virtiofs_emu_ll_handler_t) fuse_ll_readdir;
-    emu_ll_params->fuse_handlers[FUSE_READDIRPLUS] = (virtiofs_emu_ll_handler_t) fuse_ll_readdirplus;
-    emu_ll_params->fuse_handlers[FUSE_OPEN] = (virtiofs_emu_ll_handler_t) fuse_ll_open;
-    emu_ll_params->fuse_handlers[FUSE_RELEASE] = (virtiofs_emu_ll_handler_t) fuse_ll_release;
-    //// We don't impl FUSE_FLUSH. The only use would be to return write errors on close()
-    //// but that's of no use with a remote file system
-    emu_ll_params->fuse_handlers[FUSE_FSYNC] = (virtiofs_emu_ll_handler_t) fuse_ll_fsync;
-    emu_ll_params->fuse_handlers[FUSE_FSYNCDIR] = (virtiofs_emu_ll_handler_t) fuse_ll_fsyncdir;
-    emu_ll_params->fuse_handlers[FUSE_CREATE] = (virtiofs_emu_ll_handler_t) fuse_ll_create;
-    emu_ll_params->fuse_handlers[FUSE_RMDIR] = (virtiofs_emu_ll_handler_t) fuse_ll_rmdir;
-    emu_ll_params->fuse_handlers[FUSE_FORGET] = (virtiofs_emu_ll_handler_t) fuse_ll_forget;
-    emu_ll_params->fuse_handlers[FUSE_BATCH_FORGET] = (virtiofs_emu_ll_handler_t) fuse_ll_batch_forget;
-    emu_ll_params->fuse_handlers[FUSE_RENAME] = (virtiofs_emu_ll_handler_t) fuse_ll_rename;
-    emu_ll_params->fuse_handlers[FUSE_RENAME2] = (virtiofs_emu_ll_handler_t) fuse_ll_rename2;
-    emu_ll_params->fuse_handlers[FUSE_READ] = (virtiofs_emu_ll_handler_t) fuse_ll_read;
-    emu_ll_params->fuse_handlers[FUSE_WRITE] = (virtiofs_emu_ll_handler_t) fuse_ll_write;
-    emu_ll_params->fuse_handlers[FUSE_MKNOD] = (virtiofs_emu_ll_handler_t) fuse_ll_mknod;
-    emu_ll_params->fuse_handlers[FUSE_MKDIR] = (virtiofs_emu_ll_handler_t) fuse_ll_mkdir;
-    emu_ll_params->fuse_handlers[FUSE_SYMLINK] = (virtiofs_emu_ll_handler_t) fuse_ll_symlink;
-    emu_ll_params->fuse_handlers[FUSE_STATFS] = (virtiofs_emu_ll_handler_t) fuse_ll_statfs;
-    emu_ll_params->fuse_handlers[FUSE_UNLINK] = (virtiofs_emu_ll_handler_t) fuse_ll_unlink;
-    emu_ll_params->fuse_handlers[FUSE_READLINK] = (virtiofs_emu_ll_handler_t) fuse_ll_readlink;
-    emu_ll_params->fuse_handlers[FUSE_FLUSH] = (virtiofs_emu_ll_handler_t) fuse_ll_flush;
-    emu_ll_params->fuse_handlers[FUSE_SETLKW] = (virtiofs_emu_ll_handler_t) fuse_ll_setlkw;
-    emu_ll_params->fuse_handlers[FUSE_SETLK] = (virtiofs_emu_ll_handler_t) fuse_ll_setlk;
-    emu_ll_params->fuse_handlers[FUSE_FALLOCATE] = (virtiofs_emu_ll_handler_t) fuse_ll_fallocate;
+static void fuse_ll_map_emu(struct virtiofs_emu_ll_params *emu_ll_params, struct fuse_ll *f_ll) {
+    struct fuse_ll_operations *ops = &f_ll->ops;
+
+#define X(opcode, name, impl, in_iovs, in_min, out_iovs, out_min, flags) \
+    emu_ll_params->fuse_handlers[opcode] = (virtiofs_emu_ll_handler_t) fuse_ll_handle; \
+    f_ll->implemented[opcode] = (impl);
+    FUSE_LL_OPCODES(X)
+#undef X
 }
 
-int virtiofs_emu_fuse_ll_main(struct fuse_ll_operations *ops, struct virtiofs_emu_params *emu_params,
-                              void *user_data, bool debug)
+static void fuse_ll_map_emu_burst(struct virtiofs_emu_ll_params *emu_ll_params,
+                                  struct fuse_ll_operations *ops) {
+    if (ops->getattr_burst)
+        emu_ll_params->burst_handlers[FUSE_GETATTR] = (virtiofs_emu_ll_burst_handler_t) fuse_ll_getattr_burst;
+}
+
+static uint32_t fuse_ll_capacity(struct fuse_ll *f_ll, size_t thread_id) {
+    return f_ll->ops.capacity(f_ll->user_data, thread_id);
+}
+
+void fuse_ll_session_save(const struct fuse_session *se, struct fuse_ll_session_state *state)
 {
-#ifdef DEBUG_ENABLED
-    printf("virtiofs_emu_fuse_ll is running in DEBUG mode\n");
-#endif
+    memset(state, 0, sizeof(*state));
+    state->conn = se->conn;
+    state->bufsize = se->bufsize;
+}
+
+void fuse_ll_session_restore(struct fuse_session *se, const struct fuse_ll_session_state *state)
+{
+    se->conn = state->conn;
+    se->bufsize = state->bufsize;
+    se->got_init = 1;
+    virtiofs_emu_ll_startup_mark("FUSE session restored");
+}
 
+static struct fuse_ll *fuse_ll_new(struct fuse_ll_operations *ops, void *user_data, bool debug,
+                                  uint32_t max_background)
+{
     struct fuse_ll *f_ll = calloc(1, sizeof(struct fuse_ll));
+    if (f_ll == NULL) {
+        err(1, "ERROR: Could not allocate memory for struct fuse_ll");
+    }
     f_ll->ops = *ops;
     f_ll->debug = debug;
     f_ll->user_data = user_data;
@@ -1723,20 +1574,86 @@ int virtiofs_emu_fuse_ll_main(struct fuse_ll_operations *ops, struct virtiofs_em
 
     f_ll->se->bufsize = FUSE_MAX_MAX_PAGES * getpagesize() +
         FUSE_BUFFER_HEADER_SIZE;
+    f_ll->max_background = max_background;
+    return f_ll;
+}
+
+static void fuse_ll_free(struct fuse_ll *f_ll)
+{
+    free(f_ll->se);
+    free(f_ll);
+}
+
+int virtiofs_emu_fuse_ll_main(struct fuse_ll_operations *ops, struct virtiofs_emu_params *emu_params,
+                              void *user_data, bool debug)
+{
+#ifdef DEBUG_ENABLED
+    printf("virtiofs_emu_fuse_ll is running in DEBUG mode\n");
+#endif
+
+    virtiofs_emu_params_fill_defaults(emu_params);
+    // Every device has its own FUSE session, the guests negotiate them separately
+    uint32_t ndevs = emu_params->ndevs ? emu_params->ndevs : 1;
+    struct fuse_ll *f_lls[ndevs];
+    struct virtiofs_emu_dev devs[ndevs];
+    for (uint32_t d = 0; d < ndevs; d++) {
+        void *dev_user_data = emu_params->ndevs && emu_params->devs[d].user_data ?
+            emu_params->devs[d].user_data : user_data;
+        f_lls[d] = fuse_ll_new(ops, dev_user_data, debug, emu_params->max_background);
+        if (emu_params->ndevs) {
+            devs[d] = emu_params->devs[d];
+            devs[d].user_data = f_lls[d];
+        }
+    }
+    struct fuse_ll *f_ll = f_lls[0];
+    int ret = 0;
+
+    if (emu_params->recover) {
+        if (!ops->recover || ndevs > 1) {
+            fprintf(stderr, "The file system cannot take over a device, no live restart possible\n");
+            ret = -1;
+            goto out;
+        }
+        ret = ops->recover(f_ll->se, user_data);
+        if (ret < 0) {
+            fprintf(stderr, "The file system failed to recover its state (err=%d), exiting...\n", ret);
+            goto out;
+        }
+    }
 
     struct virtiofs_emu_ll_params emu_ll_params;
     memset(&emu_ll_params, 0, sizeof(emu_ll_params));
     memcpy(&emu_ll_params.emu_params, emu_params, sizeof(struct virtiofs_emu_params));
+    if (emu_params->ndevs)
+        emu_ll_params.emu_params.devs = devs;
     emu_ll_params.user_data = f_ll;
-    fuse_ll_map_emu(&emu_ll_params);
+    if (ops->capacity)
+        emu_ll_params.capacity = (uint32_t (*)(void *, size_t)) fuse_ll_capacity;
+    fuse_ll_map_emu(&emu_ll_params, f_ll);
+    fuse_ll_map_emu_burst(&emu_ll_params, ops);
+    // The opcode table is the same for all of them
+    for (uint32_t d = 1; d < ndevs; d++)
+        memcpy(f_lls[d]->implemented, f_ll->implemented, sizeof(f_ll->implemented));
 
     struct virtiofs_emu_ll *emu = virtiofs_emu_ll_new(&emu_ll_params);
     if (emu == NULL) {
         fprintf(stderr, "Failed to initialize emu_ll, exiting...\n");
-        return -1;
+        ret = -1;
+        goto out;
+    }
+    for (uint32_t d = 0; d < ndevs; d++) {
+        f_lls[d]->se->emu = emu;
+        f_lls[d]->se->dev = d;
     }
     virtiofs_emu_ll_loop(emu);
     virtiofs_emu_ll_destroy(emu);
-    
-    return 0;
+
+    // The guest did not unmount, so the next process can take over
+    if (ops->handoff && ndevs == 1 && f_ll->se->got_init && !f_ll->se->got_destroy)
+        ret = ops->handoff(f_ll->se, user_data);
+
+out:
+    for (uint32_t d = 0; d < ndevs; d++)
+        fuse_ll_free(f_lls[d]);
+    return ret < 0 ? -1 : 0;
 }
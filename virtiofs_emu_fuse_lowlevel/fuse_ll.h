@@ -49,6 +49,9 @@ struct fuse_session {
     size_t bufsize;
     int error;
     bool init_done;
+    // Where the notifications go, set before the device gets polled
+    struct virtiofs_emu_ll *emu;
+    uint32_t dev;
 };
 
 #define FUSE_MAX_MAX_PAGES 256
@@ -138,12 +141,62 @@ int fuse_ll_reply_create(struct fuse_session *se, struct fuse_out_header *out_hd
 int fuse_ll_reply_statfs(struct fuse_session *se, struct fuse_out_header *out_hdr,
     struct fuse_statfs_out *out_statfs, const struct statvfs *stbuf);
 
+// Cache invalidation pushed to the guest over the notification virtqueue, so that the file
+// system can give out long timeouts and invalidate when it learns of a change (see
+// virtiofs_emu_ll_send_notification). Any thread can call them once the session got
+// FUSE_INIT. They return 0 once queued, -ENOSYS when the device has no notification queue
+// or the guest's FUSE is too old (keep the timeouts short then) or another negative errno.
+// True if the notifications can reach the guest
+bool fuse_ll_notify_supported(struct fuse_session *se);
+// Drops the attributes of ino and its cached data in [off, off + len), a len of 0 means up
+// to the end of the file and a negative off only drops the attributes
+int fuse_ll_notify_inval_inode(struct fuse_session *se, fuse_ino_t ino, off_t off, off_t len);
+// Drops name in parent from the guest's dentry cache
+int fuse_ll_notify_inval_entry(struct fuse_session *se, fuse_ino_t parent,
+                               const char *name, size_t namelen);
+// The same, and when the dentry still points to child it is deleted (FUSE 7.18)
+int fuse_ll_notify_delete(struct fuse_session *se, fuse_ino_t parent, fuse_ino_t child,
+                          const char *name, size_t namelen);
+
+// Files that are only streamed through once, e.g. checkpoints or videos, would just push
+// everything else out of the guest's page cache. A file system can open them with
+// fi->direct_io (FOPEN_DIRECT_IO) instead: the ones whose name matches one of the
+// fnmatch(3) patterns or that are at least size bytes large (0 means no size limit).
+struct fuse_ll_direct_io {
+    char **patterns;
+    uint32_t npatterns;
+    uint64_t size;
+};
+// Parses "<MiB>[,<pattern>...]", e.g. "1024,*.mp4,*.ckpt", returns 0 or -EINVAL
+int fuse_ll_direct_io_parse(const char *spec, struct fuse_ll_direct_io *dio);
+void fuse_ll_direct_io_free(struct fuse_ll_direct_io *dio);
+// name is the last component, as in FUSE_LOOKUP
+bool fuse_ll_direct_io_name(const struct fuse_ll_direct_io *dio, const char *name);
+static inline bool fuse_ll_direct_io_size(const struct fuse_ll_direct_io *dio, uint64_t size)
+{
+    return dio->size && size >= dio->size;
+}
+
 size_t fuse_add_direntry(struct iov *read_iov, const char *name,
                   const struct stat *stbuf, off_t off);
 size_t fuse_add_direntry_plus(struct iov *read_iov, const char *name,
                   const struct fuse_entry_param *e, off_t off);
 
+// One FUSE_GETATTR of a burst
+struct fuse_ll_getattr_req {
+    struct fuse_in_header *in_hdr;
+    struct fuse_getattr_in *in_getattr;
+    struct fuse_out_header *out_hdr;
+    struct fuse_attr_out *out_attr;
+    struct snap_fs_dev_io_done_ctx *cb;
+};
+
 struct fuse_ll_operations {
+    // Can add to conn->want what conn->capable offers. With FUSE_CAP_NO_OPEN_SUPPORT
+    // (FUSE_CAP_NO_OPENDIR_SUPPORT) fuse_ll answers FUSE_OPEN (FUSE_OPENDIR) with ENOSYS
+    // without calling open (opendir), upon which the guest stops sending them and their
+    // RELEASEs: the READs and WRITEs come with fh 0 and the file system must do without
+    // open state. The guest then always keeps its page cache of the file.
     int (*init) (struct fuse_session *, void *user_data,
                  struct fuse_in_header *, struct fuse_init_in *,
                  struct fuse_conn_info *, struct fuse_out_header *);
@@ -151,6 +204,22 @@ struct fuse_ll_operations {
                     struct fuse_in_header *,
                     struct fuse_out_header *,
                     struct snap_fs_dev_io_done_ctx *cb);
+    // Live restart, both optional (see virtiofs_emu_params.recover)
+    // handoff is called once the device is suspended and nothing is in flight anymore, while
+    // the guest is still mounted, to save the state the next process needs with
+    // fuse_ll_session_save(). In that next process recover is called instead of init, before
+    // the device gets polled, it restores the session with fuse_ll_session_restore() and
+    // sets init_done once it can serve (just like after init).
+    int (*handoff) (struct fuse_session *, void *user_data);
+    int (*recover) (struct fuse_session *, void *user_data);
+    // Optional admission control, see virtiofs_emu_ll_params.capacity. A handler can
+    // also return EBUSY when it has no room, the request is handed to it again later.
+    uint32_t (*capacity) (void *user_data, size_t thread_id);
+    // Optional, the largest READ/WRITE payload in bytes the file system handles in one
+    // request, e.g. what its backend negotiated. FUSE_INIT advertises max_pages, max_write
+    // and max_readahead to match (up to FUSE_MAX_MAX_PAGES). Returning 0 means the file
+    // system does not know yet, FUSE_INIT then waits (see the EBUSY handler return).
+    uint32_t (*max_io_size) (void *user_data);
     // Reply with fuse_ll_reply_entry()
     int (*lookup) (struct fuse_session *, void *user_data,
                    struct fuse_in_header *, const char *const in_name,
@@ -181,6 +250,12 @@ struct fuse_ll_operations {
                       struct fuse_in_header *, struct fuse_getattr_in *,
                       struct fuse_out_header *, struct fuse_attr_out *,
                     struct snap_fs_dev_io_done_ctx *cb);
+    // Optional, gets the FUSE_GETATTRs that arrived in the same poll together instead
+    // of through getattr. Every request it takes must be completed through its cb.
+    // Returns how many it took from the first on, the others go to getattr later
+    // (as after an EBUSY from it) once there is room again.
+    uint32_t (*getattr_burst) (struct fuse_session *, void *user_data,
+                               struct fuse_ll_getattr_req *reqs, uint32_t nreqs);
     // Reply with fuse_ll_reply_open()
     int (*opendir) (struct fuse_session *, void *user_data,
                     struct fuse_in_header *, struct fuse_open_in *,
@@ -268,8 +343,22 @@ struct fuse_ll {
     struct fuse_ll_operations ops;
     struct fuse_session *se;
     bool debug;
+    // Derived from the virtqueue shape, told to the host in FUSE_INIT
+    uint32_t max_background;
+    // Whether ops has what an opcode needs, see FUSE_LL_OPCODES
+    bool implemented[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN];
 };
 
+// What the guest negotiated with FUSE_INIT, which the process that takes over
+// the device after a live restart has to go on with
+struct fuse_ll_session_state {
+    struct fuse_conn_info conn;
+    uint64_t bufsize;
+};
+
+void fuse_ll_session_save(const struct fuse_session *se, struct fuse_ll_session_state *state);
+void fuse_ll_session_restore(struct fuse_session *se, const struct fuse_ll_session_state *state);
+
 int virtiofs_emu_fuse_ll_main(struct fuse_ll_operations *ops, struct virtiofs_emu_params *emu_params,
                               void *user_data, bool debug);
 
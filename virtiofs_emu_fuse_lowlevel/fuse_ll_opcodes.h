@@ -0,0 +1,108 @@
+/*
+#
+# Copyright 2022- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef VIRTIOFS_EMU_FUSE_LOWLEVEL_FUSE_LL_OPCODES_H
+#define VIRTIOFS_EMU_FUSE_LOWLEVEL_FUSE_LL_OPCODES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/fuse.h>
+
+// Flags of an opcode in FUSE_LL_OPCODES
+// More in/out iovecs than in_iovs/out_iovs are allowed (payloads)
+#define FUSE_LL_OP_MORE_IN (1 << 0)
+#define FUSE_LL_OP_MORE_OUT (1 << 1)
+// There is no reply, so no fuse_out_header to fill in
+#define FUSE_LL_OP_NOREPLY (1 << 2)
+// Handled before FUSE_INIT is done, and the handler deals with a missing op itself
+#define FUSE_LL_OP_PREINIT (1 << 3)
+
+// The smallest fuse_read_in and fuse_init_in the kernel sends
+#define FUSE_LL_COMPAT_READ_IN_SIZE offsetof(struct fuse_read_in, lock_owner)
+#define FUSE_LL_COMPAT_INIT_IN_SIZE (offsetof(struct fuse_init_in, flags) + sizeof(uint32_t))
+
+/*
+ * Every FUSE opcode fuse_ll handles, which generates the emu_ll dispatch table
+ * and the validation that runs before the handler fuse_ll_<name> is called:
+ *
+ * X(opcode, name, impl, in_iovs, in_min, out_iovs, out_min, flags)
+ *
+ * impl:        expression on struct fuse_ll_operations *ops, the opcode
+ *              gets -ENOSYS when it is false
+ * in_iovs:     number of in iovecs, the fuse_in_header included
+ * in_min:      minimum size of the argument, which is the last of the in_iovs
+ *              iovecs or follows the header when in_iovs is 1
+ * out_iovs:    out_min: the same for the reply
+ *
+ * Adding an opcode is adding a row here and writing fuse_ll_<name>(), which can
+ * assume the iovecs are there, the fuse_out_header is set up and the op exists.
+ */
+#define FUSE_LL_OPCODES(X) \
+    X(FUSE_LOOKUP, lookup, ops->lookup, \
+      2, 1, 2, FUSE_COMPAT_ENTRY_OUT_SIZE, 0) \
+    X(FUSE_FORGET, forget, 1, \
+      1, sizeof(struct fuse_forget_in), 0, 0, FUSE_LL_OP_NOREPLY | FUSE_LL_OP_PREINIT) \
+    X(FUSE_GETATTR, getattr, ops->getattr, \
+      2, sizeof(struct fuse_getattr_in), 2, FUSE_COMPAT_ATTR_OUT_SIZE, 0) \
+    X(FUSE_SETATTR, setattr, ops->setattr || ops->setattr_async, \
+      2, sizeof(struct fuse_setattr_in), 2, FUSE_COMPAT_ATTR_OUT_SIZE, 0) \
+    X(FUSE_READLINK, readlink, 1, \
+      1, 0, 2, 0, FUSE_LL_OP_MORE_OUT) \
+    X(FUSE_SYMLINK, symlink, ops->symlink, \
+      2, 2, 2, FUSE_COMPAT_ENTRY_OUT_SIZE, 0) \
+    X(FUSE_MKNOD, mknod, ops->mknod, \
+      2, FUSE_COMPAT_MKNOD_IN_SIZE + 1, 2, FUSE_COMPAT_ENTRY_OUT_SIZE, 0) \
+    X(FUSE_MKDIR, mkdir, ops->mkdir, \
+      2, sizeof(struct fuse_mkdir_in) + 1, 2, FUSE_COMPAT_ENTRY_OUT_SIZE, 0) \
+    X(FUSE_UNLINK, unlink, ops->unlink, \
+      2, 1, 1, 0, 0) \
+    X(FUSE_RMDIR, rmdir, ops->rmdir, \
+      2, 1, 1, 0, 0) \
+    X(FUSE_RENAME, rename, ops->rename, \
+      2, sizeof(struct fuse_rename_in) + 2, 1, 0, 0) \
+    X(FUSE_OPEN, open, ops->open, \
+      2, sizeof(struct fuse_open_in), 2, sizeof(struct fuse_open_out), 0) \
+    X(FUSE_READ, read, ops->read, \
+      2, FUSE_LL_COMPAT_READ_IN_SIZE, 2, 0, FUSE_LL_OP_MORE_OUT) \
+    X(FUSE_WRITE, write, ops->write, \
+      2, FUSE_COMPAT_WRITE_IN_SIZE, 2, sizeof(struct fuse_write_out), FUSE_LL_OP_MORE_IN) \
+    X(FUSE_STATFS, statfs, ops->statfs, \
+      1, 0, 2, FUSE_COMPAT_STATFS_SIZE, 0) \
+    X(FUSE_RELEASE, release, ops->release, \
+      2, sizeof(struct fuse_release_in), 1, 0, 0) \
+    X(FUSE_FSYNC, fsync, ops->fsync, \
+      2, sizeof(struct fuse_fsync_in), 1, 0, 0) \
+    X(FUSE_FLUSH, flush, ops->flush, \
+      2, sizeof(struct fuse_flush_in), 1, 0, 0) \
+    X(FUSE_INIT, init, 1, \
+      2, FUSE_LL_COMPAT_INIT_IN_SIZE, 2, FUSE_COMPAT_INIT_OUT_SIZE, FUSE_LL_OP_PREINIT) \
+    X(FUSE_OPENDIR, opendir, ops->opendir, \
+      2, sizeof(struct fuse_open_in), 2, sizeof(struct fuse_open_out), 0) \
+    X(FUSE_READDIR, readdir, ops->readdir, \
+      2, FUSE_LL_COMPAT_READ_IN_SIZE, 2, 0, FUSE_LL_OP_MORE_OUT) \
+    X(FUSE_RELEASEDIR, releasedir, ops->releasedir, \
+      2, sizeof(struct fuse_release_in), 1, 0, 0) \
+    X(FUSE_FSYNCDIR, fsyncdir, ops->fsyncdir, \
+      2, sizeof(struct fuse_fsync_in), 1, 0, 0) \
+    X(FUSE_SETLK, setlk, ops->flock, \
+      2, sizeof(struct fuse_lk_in), 1, 0, 0) \
+    X(FUSE_SETLKW, setlkw, ops->flock, \
+      2, sizeof(struct fuse_lk_in), 1, 0, 0) \
+    X(FUSE_CREATE, create, ops->create, \
+      2, sizeof(struct fuse_open_in) + 1, 2, FUSE_COMPAT_ENTRY_OUT_SIZE + sizeof(struct fuse_open_out), 0) \
+    X(FUSE_DESTROY, destroy, 1, \
+      1, 0, 1, 0, FUSE_LL_OP_PREINIT) \
+    X(FUSE_BATCH_FORGET, batch_forget, 1, \
+      1, sizeof(struct fuse_batch_forget_in), 0, 0, FUSE_LL_OP_NOREPLY | FUSE_LL_OP_PREINIT) \
+    X(FUSE_FALLOCATE, fallocate, ops->fallocate, \
+      2, sizeof(struct fuse_fallocate_in), 1, 0, 0) \
+    X(FUSE_READDIRPLUS, readdirplus, ops->readdir, \
+      2, FUSE_LL_COMPAT_READ_IN_SIZE, 2, 0, FUSE_LL_OP_MORE_OUT) \
+    X(FUSE_RENAME2, rename2, ops->rename, \
+      2, sizeof(struct fuse_rename2_in) + 2, 1, 0, 0)
+
+#endif // VIRTIOFS_EMU_FUSE_LOWLEVEL_FUSE_LL_OPCODES_H
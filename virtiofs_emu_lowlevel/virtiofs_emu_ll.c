@@ -31,59 +31,1395 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <sched.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <err.h>
 #include <string.h>
 #include <sys/errno.h>
 #include <linux/fuse.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 #include "virtio_fs_controller.h"
 #include "nvme_emu_log.h"
 #include "compiler.h"
 #include "mlnx_snap_pci_manager.h"
 #include "virtiofs_emu_ll.h"
+#include "virtiofs_emu_sw.h"
+
+// Hint to the core that we are in a spin loop
+#if defined(__aarch64__)
+#define emu_ll_pause() asm volatile("yield" ::: "memory")
+#elif defined(__x86_64__) || defined(__i386__)
+#define emu_ll_pause() asm volatile("pause" ::: "memory")
+#else
+#define emu_ll_pause() asm volatile("" ::: "memory")
+#endif
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+struct virtiofs_emu_ll;
+struct emu_ll_tdata;
+struct emu_ll_dev;
+
+// Updated by the polling thread and by whatever thread completes its async requests
+struct emu_ll_op_stats {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t errors;
+    atomic_uint_fast64_t lat_hist[VIRTIOFS_EMU_LL_LAT_BUCKETS];
+};
+
+// Sits between an async handler and SNAP, so that we know when the request is done
+struct emu_ll_req {
+    struct snap_fs_dev_io_done_ctx done_ctx; // What the handler gets
+    struct snap_fs_dev_io_done_ctx *snap_done_ctx;
+    struct emu_ll_tdata *tdata;
+    struct emu_ll_dev *dev;
+    struct fuse_out_header *out_hdr;
+    uint64_t start_ns;
+    uint32_t opcode;
+    atomic_bool in_use;
+    // start_ns once the req describes the request, 0 while it is free, see emu_ll_req_view
+    atomic_uint_fast64_t inflight_since;
+    // Watchdog only, the inflight_since it was last reported for
+    uint64_t wd_reported;
+    // On the completion queue of tdata
+    enum snap_fs_dev_op_status status;
+    struct emu_ll_req *cq_next;
+    // Kept for whichever thread dispatches it when work stealing
+    struct iovec *fuse_in_iov;
+    int in_iovcnt;
+    struct iovec *fuse_out_iov;
+    int out_iovcnt;
+    // READ/WRITE payload counted against the bulk in-flight cap, 0 for metadata
+    uint32_t bulk_bytes;
+
+    // For the trace
+    uint64_t unique;
+    uint64_t nodeid;
+    uint32_t size;
+    int32_t backend_status;
+    uint64_t t_dispatch;
+    uint64_t t_done;
+    uint16_t exec_thread;
+};
+
+// Scheduler classes
+enum emu_ll_class {
+    EMU_LL_CLASS_LAT = 0, // Metadata, latency sensitive
+    EMU_LL_CLASS_BULK,    // Data, throughput
+    EMU_LL_CLASSES
+};
+
+// Token bucket, a rate of 0 means unlimited
+struct emu_ll_bucket {
+    double rate; // Tokens per ns
+    double burst;
+    double tokens;
+    uint64_t last_ns;
+};
+
+// The QoS limits of the device or of one polling thread
+struct emu_ll_qos {
+    struct emu_ll_bucket iops;
+    struct emu_ll_bucket bytes;
+};
+
+// Harvested requests waiting for the scheduler, only touched by the owning thread
+struct emu_ll_fifo {
+    struct emu_ll_req **buf;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t mask;
+};
+
+/*
+ * Chase-Lev work-stealing deque of harvested requests, see
+ * "Correct and Efficient Work-Stealing for Weak Memory Models" (Lê et al.).
+ * The owning polling thread pushes and takes at the bottom, the other
+ * polling threads steal from the top.
+ */
+struct emu_ll_deque {
+    atomic_int_fast64_t top __attribute__((aligned(64)));
+    atomic_int_fast64_t bottom __attribute__((aligned(64)));
+    _Atomic(struct emu_ll_req *) *buf;
+    uint64_t mask;
+};
+
+// A request waiting for the end of the poll, to go to a burst handler
+struct emu_ll_pending {
+    struct virtiofs_emu_ll_req r;
+    uint32_t opcode;
+    struct emu_ll_dev *dev;
+};
+
+// Every polling thread gets its own, only that thread writes to it
+// (except for the stats and reqs[].in_use)
+struct emu_ll_tdata {
+    struct virtiofs_emu_ll *emu;
+    size_t thread_id;
+    pthread_t thread;
+    int cpu; // -1 if not pinned
+
+    // Amount of requests this thread handed to the handlers
+    uint64_t nreqs;
+
+    // Polling statistics
+    uint64_t polls_useful;
+    uint64_t polls_empty;
+    uint64_t yields;
+    uint64_t sleeps;
+
+    // Adaptive polling state
+    uint32_t idle_rounds;
+    useconds_t sleep_usec;
+
+    // Event driven mode, the doorbell of its virtqueues on every device and the
+    // eventfd that completions use to wake up the thread while it is blocked
+    int *notify_fds;
+    int wake_fd;
+    atomic_bool blocked;
+    uint64_t blocks;
+    uint64_t doorbells;
+    uint64_t cq_wakeups;
+    uint64_t blocked_ns;
+    // Wall and CPU time of the thread, set when it exits
+    uint64_t start_ns;
+    uint64_t run_ns;
+    uint64_t cpu_ns;
+
+    // Indexed by device * VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN + opcode, 64 byte aligned
+    struct emu_ll_op_stats *stats;
+    // Async requests for which there was no free req, so not in the stats
+    uint64_t untracked;
+    struct emu_ll_req *reqs;
+    uint32_t reqs_len; // Power of 2
+    uint32_t reqs_next;
+
+    // Requests for burst handlers harvested during the current poll, reqs_len long
+    struct emu_ll_pending *pending;
+    uint32_t npending;
+    // Scratch space to group the pending requests per opcode, reqs_len long
+    struct virtiofs_emu_ll_req *burst;
+    uint64_t bursts;
+    uint64_t burst_reqs;
+
+    // Per scheduler class, reqs_len long so they never fill up
+    struct emu_ll_fifo sched_q[EMU_LL_CLASSES];
+    // Payload of the bulk requests this thread dispatched that are not done yet
+    atomic_uint_fast64_t bulk_inflight;
+    // Polls in which the bulk cap held back requests
+    uint64_t bulk_capped;
+    struct emu_ll_qos qos;
+    // Polls in which the QoS limits held back requests
+    uint64_t qos_deferred;
+
+    // Admission control, how many more requests the backend takes in this poll
+    uint32_t budget;
+    // Requests the backend had no room for, in arrival order. Holds all reqs
+    // plus a batch of stolen ones, as nothing is stolen while it is not empty
+    struct emu_ll_fifo admit_q;
+    // Polls in which the full backend stopped the harvest
+    uint64_t admit_closed;
+    // Requests that had to wait for room in the backend
+    uint64_t admit_parked;
+
+    // Harvested requests that are not dispatched yet, reqs_len long so it never fills up
+    struct emu_ll_deque deque;
+    // The next thread to try to steal from
+    uint32_t victim;
+    // Requests this thread took from other threads and the other way around
+    uint64_t stolen;
+    atomic_uint_fast64_t lost;
+
+    // Elastic scaling, held by the OS thread that is polling these virtqueues
+    atomic_flag polling;
+    // Time the OS thread that started as this polling thread spent in polls that found
+    // work, and what the management thread saw of it at the last scaling decision
+    atomic_uint_fast64_t busy_ns;
+    uint64_t busy_prev;
+
+    // Trace ring, any thread that completes a request of this thread writes to it
+    struct virtiofs_emu_trace_rec *trace;
+    uint32_t trace_len; // Power of 2
+    atomic_uint_fast64_t trace_head;
+
+    // Completion queue, any thread pushes and the polling thread takes them all
+    // On its own cache line, the completing threads write to it
+    _Atomic(struct emu_ll_req *) cq_head __attribute__((aligned(64)));
+    atomic_uint cq_len;
+    // When the polling thread first saw the current batch, 0 if empty
+    uint64_t cq_since_ns __attribute__((aligned(64)));
+    uint64_t cq_batches;
+    uint64_t cq_completions;
+} __attribute__((aligned(64)));
+
+// The controller that delivers the requests, SNAP or the software stand-in
+struct emu_ll_ctrl_ops {
+    void (*progress)(void *ctrl);
+    int (*progress_io)(void *ctrl, int thread_id);
+    void (*suspend)(void *ctrl);
+    bool (*is_suspended)(void *ctrl);
+    void (*destroy)(void *ctrl);
+    // Optional doorbells, see virtiofs_emu_sw_notify_fd
+    int (*notify_fd)(void *ctrl, int thread_id);
+    bool (*notify_enable)(void *ctrl, int thread_id, bool on);
+    // Optional notification virtqueue, see virtiofs_emu_sw_send_notification
+    int (*send_notification)(void *ctrl, const struct iovec *iov, int iovcnt);
+};
+
+// A notification waiting for a buffer of the driver
+struct emu_ll_notification {
+    struct emu_ll_notification *next;
+    uint32_t len;
+    char buf[];
+};
+
+// A device and its controller, every polling thread polls its virtqueues of all devices
+struct emu_ll_dev {
+    struct virtiofs_emu_ll *emu;
+    uint32_t id;
+    char *tag;
+    void *ctrl;
+    const struct emu_ll_ctrl_ops *ctrl_ops;
+    void *user_data;
+    // Which polling thread of the controller a polling thread is, see emu_ll_dev_thread
+    uint32_t shift;
+    // The QoS device limits, shared by all polling threads
+    struct emu_ll_qos qos;
+    pthread_spinlock_t qos_lock;
+    // Notifications queued by any thread, handed to the controller with the mmio polling
+    pthread_mutex_t notification_lock;
+    struct emu_ll_notification *notification_head;
+    struct emu_ll_notification **notification_tail;
+    atomic_uint notifications_queued;
+    uint64_t notifications_sent;
+    uint64_t notifications_dropped;
+};
 
 struct virtiofs_emu_ll {
-    struct virtio_fs_ctrl *snap_ctrl;
+    // Always atleast one
+    struct emu_ll_dev *devs;
+    uint32_t ndevs;
+    bool snap_managers; // The SNAP emulation managers are up
     virtiofs_emu_ll_handler_t handlers[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN];
-    void *user_data;
+    virtiofs_emu_ll_burst_handler_t burst_handlers[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN];
     useconds_t polling_interval_usec;
     uint32_t nthreads;
 
-#ifdef DEBUG_ENABLED
-    uint32_t handlers_call_cnts[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN];
-#endif
+    bool adaptive_polling;
+    uint32_t poll_idle_threshold;
+    useconds_t poll_max_sleep_usec;
+
+    bool notify;
+    int notify_timeout_ms;
+
+    bool coalesce_completions;
+    uint32_t coalesce_count;
+    uint64_t coalesce_nsec;
+
+    bool work_stealing;
+
+    bool mgmt_thread;
+    useconds_t mgmt_interval_usec;
+
+    bool elastic;
+    uint32_t elastic_min;
+    uint64_t elastic_interval_ns;
+    uint32_t elastic_grow_pct;
+    uint32_t elastic_shrink_pct;
+    // The OS threads that started as polling thread 0..nactive-1 poll, the others are parked
+    atomic_uint nactive;
+    // Management thread only
+    uint64_t elastic_last_ns;
+    uint64_t elastic_grows;
+    uint64_t elastic_shrinks;
+
+    bool sched;
+    uint32_t sched_weight[EMU_LL_CLASSES];
+    uint64_t sched_bulk_max_inflight;
+
+    bool qos;
+
+    uint32_t (*capacity)(void *user_data, size_t thread_id);
+
+    atomic_bool trace_on;
+    char *trace_file;
+
+    // Request-age watchdog, only touched by the thread that polls mmio
+    uint64_t watchdog_ns;
+    uint64_t watchdog_last_ns;
+    uint64_t watchdog_reported;
+
+    // One for every polling thread, so always atleast one
+    struct emu_ll_tdata *tdatas;
+    uint32_t ntdatas;
 };
 
 static volatile int keep_running = 1;
+static volatile int print_stats = 0;
+static volatile int toggle_trace = 0;
 pthread_key_t virtiofs_thread_id_key;
 
-void signal_handler(int dummy)
+void signal_handler(int dummy)
+{
+    keep_running = 0;
+}
+
+void stats_signal_handler(int dummy)
+{
+    print_stats = 1;
+}
+
+void trace_signal_handler(int dummy)
+{
+    toggle_trace = 1;
+}
+
+static inline uint64_t emu_ll_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// The startup phases of the process, see virtiofs_emu_ll_startup_mark
+static struct {
+    char phase[48];
+    uint64_t ns; // Since the first mark
+    atomic_bool set;
+} startup_phases[VIRTIOFS_EMU_LL_STARTUP_PHASES];
+static atomic_uint startup_nphases;
+static atomic_uint_fast64_t startup_t0;
+static atomic_bool startup_served;
+
+void virtiofs_emu_ll_startup_mark(const char *fmt, ...)
+{
+    uint64_t now = emu_ll_now_ns();
+    uint_fast64_t t0 = 0;
+    if (atomic_compare_exchange_strong(&startup_t0, &t0, now))
+        t0 = now;
+    uint64_t ns = now > t0 ? now - t0 : 0;
+
+    char phase[sizeof(startup_phases[0].phase)];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(phase, sizeof(phase), fmt, ap);
+    va_end(ap);
+    printf("Startup: %s after %.3f ms\n", phase, ns / 1e6);
+
+    uint32_t i = atomic_fetch_add(&startup_nphases, 1);
+    if (i >= VIRTIOFS_EMU_LL_STARTUP_PHASES)
+        return;
+    memcpy(startup_phases[i].phase, phase, sizeof(phase));
+    startup_phases[i].ns = ns;
+    atomic_store_explicit(&startup_phases[i].set, true, memory_order_release);
+}
+
+void virtiofs_emu_ll_startup_print(FILE *f)
+{
+    uint32_t n = atomic_load(&startup_nphases);
+    if (n > VIRTIOFS_EMU_LL_STARTUP_PHASES)
+        n = VIRTIOFS_EMU_LL_STARTUP_PHASES;
+
+    fprintf(f, "Startup phases (ms since the start):\n");
+    for (uint32_t i = 0; i < n; i++) {
+        if (atomic_load_explicit(&startup_phases[i].set, memory_order_acquire))
+            fprintf(f, "%10.3f %s\n", startup_phases[i].ns / 1e6, startup_phases[i].phase);
+    }
+}
+
+static void emu_ll_startup_served(uint32_t opcode)
+{
+    // Only the first one, of all polling threads
+    if (!atomic_exchange(&startup_served, true))
+        virtiofs_emu_ll_startup_mark("first request served (OP %u)", opcode);
+}
+
+static inline void emu_ll_stats_record(struct emu_ll_tdata *tdata, struct emu_ll_dev *dev,
+                                       uint32_t opcode, uint64_t start_ns, bool error)
+{
+    struct emu_ll_op_stats *s = &tdata->stats[dev->id * VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN + opcode];
+    // FUSE_INIT only opens the device, the first real request marks the end of startup
+    if (unlikely(!atomic_load_explicit(&startup_served, memory_order_relaxed)) &&
+        !error && opcode != FUSE_INIT)
+        emu_ll_startup_served(opcode);
+    uint64_t lat = emu_ll_now_ns() - start_ns;
+    uint32_t bucket = lat ? 64 - __builtin_clzll(lat) : 0;
+    if (bucket >= VIRTIOFS_EMU_LL_LAT_BUCKETS)
+        bucket = VIRTIOFS_EMU_LL_LAT_BUCKETS - 1;
+
+    atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+    if (error)
+        atomic_fetch_add_explicit(&s->errors, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->lat_hist[bucket], 1, memory_order_relaxed);
+}
+
+// Owner only
+static inline void emu_ll_deque_push(struct emu_ll_deque *d, struct emu_ll_req *req)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    atomic_store_explicit(&d->buf[b & d->mask], req, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+// Owner only, returns NULL when empty
+static inline struct emu_ll_req *emu_ll_deque_take(struct emu_ll_deque *d)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    struct emu_ll_req *req = atomic_load_explicit(&d->buf[b & d->mask], memory_order_relaxed);
+    if (t == b) {
+        // The last one, race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+            req = NULL;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return req;
+}
+
+// Any thread, returns NULL when empty or when another thread got there first
+static inline struct emu_ll_req *emu_ll_deque_steal(struct emu_ll_deque *d)
+{
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+    if (t >= b)
+        return NULL;
+    struct emu_ll_req *req = atomic_load_explicit(&d->buf[t & d->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return req;
+}
+
+static inline bool emu_ll_fifo_empty(struct emu_ll_fifo *f)
+{
+    return f->head == f->tail;
+}
+
+static inline void emu_ll_fifo_push(struct emu_ll_fifo *f, struct emu_ll_req *req)
+{
+    f->buf[f->tail++ & f->mask] = req;
+}
+
+static inline struct emu_ll_req *emu_ll_fifo_peek(struct emu_ll_fifo *f)
+{
+    return f->buf[f->head & f->mask];
+}
+
+static inline void emu_ll_fifo_pop(struct emu_ll_fifo *f)
+{
+    f->head++;
+}
+
+// The payload size of READ and WRITE, 0 for everything else
+static inline uint32_t emu_ll_bulk_bytes(struct fuse_in_header *in_hdr,
+                                         struct iovec *fuse_in_iov, int in_iovcnt)
+{
+    if (in_iovcnt < 2)
+        return 0;
+    if (in_hdr->opcode == FUSE_READ && fuse_in_iov[1].iov_len >= sizeof(struct fuse_read_in))
+        return ((struct fuse_read_in *) fuse_in_iov[1].iov_base)->size;
+    if (in_hdr->opcode == FUSE_WRITE && fuse_in_iov[1].iov_len >= sizeof(struct fuse_write_in))
+        return ((struct fuse_write_in *) fuse_in_iov[1].iov_base)->size;
+    return 0;
+}
+
+static void emu_ll_bucket_init(struct emu_ll_bucket *b, uint64_t rate, uint64_t burst)
+{
+    b->rate = rate / 1e9;
+    // A tenth of a second worth by default, and room for atleast one token
+    b->burst = burst ? burst : rate / 10.0;
+    if (b->burst < 1)
+        b->burst = 1;
+    b->tokens = b->burst;
+    b->last_ns = 0;
+}
+
+// Whether n tokens can be taken, n larger than the burst needs a full bucket
+static inline bool emu_ll_bucket_ready(struct emu_ll_bucket *b, double n, uint64_t now)
+{
+    if (b->rate == 0)
+        return true;
+    b->tokens += (now - b->last_ns) * b->rate;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    b->last_ns = now;
+    return b->tokens >= MIN(n, b->burst);
+}
+
+static inline void emu_ll_bucket_take(struct emu_ll_bucket *b, double n)
+{
+    if (b->rate != 0)
+        b->tokens -= MIN(n, b->burst);
+}
+
+// Takes the tokens for a request from the thread and device buckets, or none of them
+static inline bool emu_ll_qos_admit(struct emu_ll_tdata *tdata, struct emu_ll_dev *dev, uint32_t bytes)
+{
+    uint64_t now = emu_ll_now_ns();
+
+    if (!emu_ll_bucket_ready(&tdata->qos.iops, 1, now) ||
+        !emu_ll_bucket_ready(&tdata->qos.bytes, bytes, now))
+        return false;
+
+    if (dev->qos.iops.rate || dev->qos.bytes.rate) {
+        pthread_spin_lock(&dev->qos_lock);
+        bool ok = emu_ll_bucket_ready(&dev->qos.iops, 1, now) &&
+                  emu_ll_bucket_ready(&dev->qos.bytes, bytes, now);
+        if (ok) {
+            emu_ll_bucket_take(&dev->qos.iops, 1);
+            emu_ll_bucket_take(&dev->qos.bytes, bytes);
+        }
+        pthread_spin_unlock(&dev->qos_lock);
+        if (!ok)
+            return false;
+    }
+
+    emu_ll_bucket_take(&tdata->qos.iops, 1);
+    emu_ll_bucket_take(&tdata->qos.bytes, bytes);
+    return true;
+}
+
+static inline bool emu_ll_req_failed(struct fuse_out_header *out_hdr, int status)
+{
+    return status != 0 || (out_hdr && out_hdr->error != 0);
+}
+
+// Only called by the owning polling thread
+static inline struct emu_ll_req *emu_ll_req_get(struct emu_ll_tdata *tdata)
+{
+    uint32_t mask = tdata->reqs_len - 1;
+    for (uint32_t i = 0; i < tdata->reqs_len; i++) {
+        struct emu_ll_req *req = &tdata->reqs[(tdata->reqs_next + i) & mask];
+        if (!atomic_load_explicit(&req->in_use, memory_order_acquire)) {
+            atomic_store_explicit(&req->in_use, true, memory_order_relaxed);
+            tdata->reqs_next += i + 1;
+            return req;
+        }
+    }
+    return NULL;
+}
+
+static inline void emu_ll_req_put(struct emu_ll_req *req)
+{
+    atomic_store_explicit(&req->inflight_since, 0, memory_order_relaxed);
+    atomic_store_explicit(&req->in_use, false, memory_order_release);
+}
+
+// What the gauges and the watchdog see of a req of another thread
+struct emu_ll_req_view {
+    uint64_t since;
+    uint64_t unique;
+    uint64_t nodeid;
+    uint32_t opcode;
+    uint32_t dev;
+};
+
+// Any thread, false if the req is free or was reused while we looked at it
+static bool emu_ll_req_view(struct emu_ll_req *req, struct emu_ll_req_view *v)
+{
+    v->since = atomic_load_explicit(&req->inflight_since, memory_order_acquire);
+    if (!v->since)
+        return false;
+    v->unique = req->unique;
+    v->nodeid = req->nodeid;
+    v->opcode = req->opcode;
+    v->dev = req->dev->id;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&req->inflight_since, memory_order_relaxed) == v->since;
+}
+
+static inline bool emu_ll_tracing(struct virtiofs_emu_ll *emu)
+{
+    return atomic_load_explicit(&emu->trace_on, memory_order_relaxed);
+}
+
+// Right before the request goes back to the controller, from any thread
+static void emu_ll_trace_record(struct emu_ll_req *req, enum snap_fs_dev_op_status status)
+{
+    struct emu_ll_tdata *tdata = req->tdata;
+    uint64_t idx = atomic_fetch_add_explicit(&tdata->trace_head, 1, memory_order_relaxed);
+    struct virtiofs_emu_trace_rec *rec = &tdata->trace[idx & (tdata->trace_len - 1)];
+
+    // seq is 0 while the record is being written
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    atomic_thread_fence(memory_order_release);
+    rec->unique = req->unique;
+    rec->nodeid = req->nodeid;
+    rec->t_harvest = req->start_ns;
+    rec->t_dispatch = req->t_dispatch;
+    rec->t_publish = emu_ll_now_ns();
+    rec->t_done = req->t_done ? req->t_done : rec->t_publish;
+    rec->opcode = req->opcode;
+    rec->size = req->size;
+    rec->error = req->out_hdr ? req->out_hdr->error : (status ? -EIO : 0);
+    rec->backend_status = req->backend_status;
+    rec->thread = tdata->thread_id;
+    rec->exec_thread = req->exec_thread;
+    __atomic_store_n(&rec->seq, (uint32_t) idx + 1, __ATOMIC_RELEASE);
+}
+
+static inline void emu_ll_trace_dispatch(struct virtiofs_emu_ll *emu, struct emu_ll_req *req)
+{
+    if (emu_ll_tracing(emu)) {
+        req->t_dispatch = emu_ll_now_ns();
+        req->exec_thread = (size_t) pthread_getspecific(virtiofs_thread_id_key);
+    }
+}
+
+// Wakes up a polling thread that is blocked on its doorbells
+static void emu_ll_wake(struct emu_ll_tdata *tdata)
+{
+    uint64_t one = 1;
+    if (write(tdata->wake_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        perror("virtiofs_emu_ll: wake");
+}
+
+// Can be called from any thread
+static void emu_ll_req_done(enum snap_fs_dev_op_status status, void *arg)
+{
+    struct emu_ll_req *req = arg;
+    struct emu_ll_tdata *tdata = req->tdata;
+    struct snap_fs_dev_io_done_ctx *snap_done_ctx = req->snap_done_ctx;
+
+    // Before SNAP gets the request back and the out_hdr is gone
+    emu_ll_stats_record(tdata, req->dev, req->opcode, req->start_ns,
+                        emu_ll_req_failed(req->out_hdr, status));
+    if (req->bulk_bytes)
+        atomic_fetch_sub_explicit(&tdata->bulk_inflight, req->bulk_bytes, memory_order_relaxed);
+    bool tracing = emu_ll_tracing(tdata->emu);
+
+    if (tdata->emu->coalesce_completions) {
+        if (tracing)
+            req->t_done = emu_ll_now_ns();
+        // The polling thread hands it to SNAP later on
+        req->status = status;
+        struct emu_ll_req *head = atomic_load_explicit(&tdata->cq_head, memory_order_relaxed);
+        do {
+            req->cq_next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&tdata->cq_head, &head, req,
+                    memory_order_release, memory_order_relaxed));
+        // Seq_cst with blocked, so that the thread either sees cq_len or gets woken up
+        atomic_fetch_add(&tdata->cq_len, 1);
+        if (tdata->emu->notify && atomic_load(&tdata->blocked))
+            emu_ll_wake(tdata);
+        return;
+    }
+
+    if (tracing)
+        emu_ll_trace_record(req, status);
+    emu_ll_req_put(req);
+    snap_done_ctx->cb(status, snap_done_ctx->user_arg);
+}
+
+// Hands everything on the completion queue to SNAP, oldest first
+static void virtiofs_emu_ll_cq_flush(struct emu_ll_tdata *tdata)
+{
+    struct emu_ll_req *req = atomic_exchange_explicit(&tdata->cq_head, NULL, memory_order_acquire);
+    struct emu_ll_req *oldest = NULL;
+    uint32_t n = 0;
+
+    // It's a stack, turn it around
+    while (req) {
+        struct emu_ll_req *next = req->cq_next;
+        req->cq_next = oldest;
+        oldest = req;
+        req = next;
+        n++;
+    }
+    atomic_fetch_sub_explicit(&tdata->cq_len, n, memory_order_relaxed);
+
+    bool tracing = emu_ll_tracing(tdata->emu);
+    for (req = oldest; req; ) {
+        struct emu_ll_req *next = req->cq_next;
+        struct snap_fs_dev_io_done_ctx *snap_done_ctx = req->snap_done_ctx;
+        enum snap_fs_dev_op_status status = req->status;
+        if (tracing)
+            emu_ll_trace_record(req, status);
+        emu_ll_req_put(req);
+        snap_done_ctx->cb(status, snap_done_ctx->user_arg);
+        req = next;
+    }
+
+    tdata->cq_since_ns = 0;
+    if (n) {
+        tdata->cq_batches++;
+        tdata->cq_completions += n;
+    }
+}
+
+// Flushes the completion queue when the batch is big or old enough, or when forced
+static inline void virtiofs_emu_ll_cq_poll(struct emu_ll_tdata *tdata, bool force)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    uint32_t n = atomic_load_explicit(&tdata->cq_len, memory_order_relaxed);
+
+    if (n == 0)
+        return;
+    if (force || (emu->coalesce_count == 0 && emu->coalesce_nsec == 0) ||
+        (emu->coalesce_count && n >= emu->coalesce_count)) {
+        virtiofs_emu_ll_cq_flush(tdata);
+        return;
+    }
+
+    uint64_t now = emu_ll_now_ns();
+    if (tdata->cq_since_ns == 0)
+        tdata->cq_since_ns = now;
+    else if (now - tdata->cq_since_ns >= emu->coalesce_nsec)
+        virtiofs_emu_ll_cq_flush(tdata);
+}
+
+static inline void emu_ll_admit_park(struct emu_ll_tdata *tdata, struct emu_ll_req *req);
+
+// A request that its burst handler had no room for, it waits for room like after an EBUSY
+static void emu_ll_burst_park(struct emu_ll_tdata *tdata, struct virtiofs_emu_ll_req *r)
+{
+    tdata->budget = 0;
+    // The reqs cover every request on the thread's virtqueues, see virtiofs_emu_ll_new
+    assert(r->cb->cb == emu_ll_req_done);
+    emu_ll_admit_park(tdata, r->cb->user_arg);
+}
+
+// Hands the pending requests of dev to the burst handlers, grouped per opcode
+static void virtiofs_emu_ll_flush_bursts_dev(struct emu_ll_tdata *tdata, struct emu_ll_dev *dev)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    uint32_t start[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN + 1];
+    bool all = emu->ndevs == 1;
+    uint32_t n = 0;
+
+    // Counting sort on the opcode, keeps the arrival order within an opcode
+    memset(start, 0, sizeof(start));
+    for (uint32_t i = 0; i < tdata->npending; i++) {
+        if (all || tdata->pending[i].dev == dev) {
+            start[tdata->pending[i].opcode + 1]++;
+            n++;
+        }
+    }
+    if (n == 0)
+        return;
+    for (uint32_t op = 1; op <= VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN; op++)
+        start[op] += start[op - 1];
+    for (uint32_t i = 0; i < tdata->npending; i++) {
+        if (all || tdata->pending[i].dev == dev)
+            tdata->burst[start[tdata->pending[i].opcode]++] = tdata->pending[i].r;
+    }
+
+    if (emu_ll_tracing(emu)) {
+        for (uint32_t i = 0; i < start[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN - 1]; i++) {
+            struct snap_fs_dev_io_done_ctx *cb = tdata->burst[i].cb;
+            if (cb->cb == emu_ll_req_done)
+                emu_ll_trace_dispatch(emu, cb->user_arg);
+        }
+    }
+
+    // start[op] now points at the end of the requests of op
+    uint32_t begin = 0;
+    for (uint32_t op = 0; op < VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN; op++) {
+        for (uint32_t i = begin; i < start[op]; i += VIRTIOFS_EMU_LL_MAX_BURST) {
+            uint32_t n = MIN(start[op] - i, VIRTIOFS_EMU_LL_MAX_BURST);
+            uint32_t took = emu->burst_handlers[op](dev->user_data, op, &tdata->burst[i], n);
+            for (uint32_t j = i + took; j < i + n; j++)
+                emu_ll_burst_park(tdata, &tdata->burst[j]);
+            tdata->bursts++;
+        }
+        begin = start[op];
+    }
+}
+
+// A burst handler only gets the requests of one device, those of its user_data
+static void virtiofs_emu_ll_flush_bursts(struct emu_ll_tdata *tdata)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+
+    for (uint32_t d = 0; d < emu->ndevs; d++)
+        virtiofs_emu_ll_flush_bursts_dev(tdata, &emu->devs[d]);
+    tdata->burst_reqs += tdata->npending;
+    tdata->npending = 0;
+}
+
+// What the backends can take in this poll, UINT32_MAX without a capacity hook.
+// The budget of a thread is shared by its devices, so the fullest backend decides
+static inline void emu_ll_admit_refresh(struct emu_ll_tdata *tdata)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    tdata->budget = UINT32_MAX;
+    if (!emu->capacity)
+        return;
+    for (uint32_t d = 0; d < emu->ndevs; d++) {
+        uint32_t room = emu->capacity(emu->devs[d].user_data, tdata->thread_id);
+        if (room < tdata->budget)
+            tdata->budget = room;
+    }
+}
+
+// Whether a new request can go to the backend, the ones waiting go first
+static inline bool emu_ll_admit_open(struct emu_ll_tdata *tdata)
+{
+    return tdata->budget && emu_ll_fifo_empty(&tdata->admit_q);
+}
+
+static inline void emu_ll_admit_park(struct emu_ll_tdata *tdata, struct emu_ll_req *req)
+{
+    emu_ll_fifo_push(&tdata->admit_q, req);
+    tdata->admit_parked++;
+}
+
+// Calls the handler of a request that was harvested earlier, possibly by another thread
+// returns false if the backend had no room for it
+static bool emu_ll_call(struct emu_ll_tdata *tdata, struct emu_ll_req *req)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    virtiofs_emu_ll_handler_t h = emu->handlers[req->opcode];
+
+    emu_ll_trace_dispatch(emu, req);
+    int ret = h(req->dev->user_data, req->fuse_in_iov, req->in_iovcnt,
+                req->fuse_out_iov, req->out_iovcnt, &req->done_ctx);
+    if (ret == EBUSY) {
+        tdata->budget = 0;
+        return false;
+    }
+    // SNAP was already told to wait, so done_ctx it is
+    if (ret != EWOULDBLOCK)
+        emu_ll_req_done(ret == 0 ? SNAP_FS_DEV_OP_SUCCESS : SNAP_FS_DEV_OP_IO_ERROR, req);
+    else if (tdata->budget != UINT32_MAX)
+        tdata->budget--;
+    return true;
+}
+
+static void virtiofs_emu_ll_dispatch(struct emu_ll_tdata *tdata, struct emu_ll_req *req)
+{
+    if (!emu_ll_admit_open(tdata) || !emu_ll_call(tdata, req))
+        emu_ll_admit_park(tdata, req);
+}
+
+// Hands the requests that waited for room to the backend again, oldest first
+static uint32_t emu_ll_admit_drain(struct emu_ll_tdata *tdata)
+{
+    uint32_t n = 0;
+
+    while (tdata->budget && !emu_ll_fifo_empty(&tdata->admit_q)) {
+        if (!emu_ll_call(tdata, emu_ll_fifo_peek(&tdata->admit_q)))
+            break;
+        emu_ll_fifo_pop(&tdata->admit_q);
+        n++;
+    }
+    return n;
+}
+
+// Tries the other threads in turn, returns the number of requests that were stolen
+static uint32_t virtiofs_emu_ll_steal(struct emu_ll_tdata *tdata)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    uint32_t stolen = 0;
+
+    // Whatever we steal must fit in our backend
+    if (!emu_ll_admit_open(tdata))
+        return 0;
+    for (uint32_t i = 0; i < emu->ntdatas - 1 && stolen < VIRTIOFS_EMU_LL_STEAL_BATCH; i++) {
+        tdata->victim = (tdata->victim + 1) % emu->ntdatas;
+        if (tdata->victim == tdata->thread_id)
+            tdata->victim = (tdata->victim + 1) % emu->ntdatas;
+        struct emu_ll_tdata *victim = &emu->tdatas[tdata->victim];
+
+        struct emu_ll_req *req;
+        while (stolen < VIRTIOFS_EMU_LL_STEAL_BATCH && stolen < tdata->budget &&
+               (req = emu_ll_deque_steal(&victim->deque)) != NULL) {
+            atomic_fetch_add_explicit(&victim->lost, 1, memory_order_relaxed);
+            // On this thread, so the handler uses our backend resources
+            virtiofs_emu_ll_dispatch(tdata, req);
+            stolen++;
+        }
+    }
+    tdata->stolen += stolen;
+    return stolen;
+}
+
+/*
+ * Weighted round robin over the scheduler classes: every round up to
+ * sched_weight[class] requests of each class are dispatched, so metadata
+ * doesn't queue up behind a batch of large READs and WRITEs. Bulk requests
+ * are held back while sched_bulk_max_inflight bytes are in flight
+ * (except for the first one, so that large requests can't get stuck).
+ * With QoS limits, requests also wait for their tokens and for room in the
+ * backend. Waiting requests stay in their FIFO until a later poll, nothing is rejected.
+ * Returns the number of dispatched requests.
+ */
+static uint32_t virtiofs_emu_ll_sched_dispatch(struct emu_ll_tdata *tdata)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    uint32_t dispatched = 0;
+    bool capped = false;
+    bool deferred = false;
+    uint32_t n;
+
+    do {
+        n = 0;
+        for (int c = 0; c < EMU_LL_CLASSES; c++) {
+            struct emu_ll_fifo *q = &tdata->sched_q[c];
+            for (uint32_t i = 0; i < emu->sched_weight[c] && !emu_ll_fifo_empty(q); i++) {
+                if (!emu_ll_admit_open(tdata))
+                    break;
+                struct emu_ll_req *req = emu_ll_fifo_peek(q);
+                if (req->bulk_bytes) {
+                    uint64_t inflight = atomic_load_explicit(&tdata->bulk_inflight, memory_order_relaxed);
+                    if (inflight && inflight + req->bulk_bytes > emu->sched_bulk_max_inflight) {
+                        capped = true;
+                        break;
+                    }
+                }
+                if (emu->qos && !emu_ll_qos_admit(tdata, req->dev, req->bulk_bytes)) {
+                    deferred = true;
+                    break;
+                }
+                if (req->bulk_bytes)
+                    atomic_fetch_add_explicit(&tdata->bulk_inflight, req->bulk_bytes, memory_order_relaxed);
+                emu_ll_fifo_pop(q);
+                if (emu->work_stealing)
+                    emu_ll_deque_push(&tdata->deque, req);
+                else
+                    virtiofs_emu_ll_dispatch(tdata, req);
+                n++;
+            }
+        }
+        dispatched += n;
+    } while (n);
+
+    if (capped)
+        tdata->bulk_capped++;
+    if (deferred)
+        tdata->qos_deferred++;
+    return dispatched;
+}
+
+// The polling thread of the controller of dev that polling thread thread_id is.
+// The controllers put queue q on their thread q % nthreads, rotating that
+// by the device spreads the first queues of the devices over the threads.
+static inline int emu_ll_dev_thread(struct emu_ll_dev *dev, size_t thread_id)
+{
+    uint32_t n = dev->emu->ntdatas;
+    return (thread_id + n - dev->shift) % n;
+}
+
+// Hands the queued notifications of dev to its controller in order, until the driver
+// has no buffer left. Called with the mmio polling, so by one thread only.
+static void emu_ll_notifications_flush(struct emu_ll_dev *dev)
+{
+    if (!atomic_load_explicit(&dev->notifications_queued, memory_order_relaxed))
+        return;
+
+    pthread_mutex_lock(&dev->notification_lock);
+    struct emu_ll_notification *n;
+    while ((n = dev->notification_head) != NULL) {
+        struct iovec iov = { .iov_base = n->buf, .iov_len = n->len };
+        int ret = dev->ctrl_ops->send_notification(dev->ctrl, &iov, 1);
+        if (ret == -EAGAIN)
+            break;
+        // E.g. the driver did not negotiate the notification queue, nothing to retry
+        if (ret)
+            dev->notifications_dropped++;
+        else
+            dev->notifications_sent++;
+        dev->notification_head = n->next;
+        if (!dev->notification_head)
+            dev->notification_tail = &dev->notification_head;
+        atomic_fetch_sub_explicit(&dev->notifications_queued, 1, memory_order_relaxed);
+        free(n);
+    }
+    pthread_mutex_unlock(&dev->notification_lock);
+}
+
+static void emu_ll_devs_progress(struct virtiofs_emu_ll *emu)
+{
+    for (uint32_t d = 0; d < emu->ndevs; d++) {
+        emu->devs[d].ctrl_ops->progress(emu->devs[d].ctrl);
+        if (emu->devs[d].ctrl_ops->send_notification)
+            emu_ll_notifications_flush(&emu->devs[d]);
+    }
+}
+
+static void emu_ll_devs_suspend(struct virtiofs_emu_ll *emu)
+{
+    for (uint32_t d = 0; d < emu->ndevs; d++)
+        emu->devs[d].ctrl_ops->suspend(emu->devs[d].ctrl);
+}
+
+static bool emu_ll_devs_suspended(struct virtiofs_emu_ll *emu)
+{
+    for (uint32_t d = 0; d < emu->ndevs; d++) {
+        if (!emu->devs[d].ctrl_ops->is_suspended(emu->devs[d].ctrl))
+            return false;
+    }
+    return true;
+}
+
+// Returns true if the poll resulted in atleast one request being handled
+static inline bool virtiofs_emu_ll_poll_io(struct emu_ll_tdata *tdata)
+{
+    uint64_t nreqs = tdata->nreqs;
+
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    bool stole = false;
+    bool scheduled = false;
+    // Requests that wait for the backend count as useful too, it can have room any moment.
+    // Spinning on them, instead of backing off, is what keeps the thread from sleeping on work.
+    emu_ll_admit_refresh(tdata);
+    bool admitted = emu_ll_admit_drain(tdata) > 0 || !emu_ll_fifo_empty(&tdata->admit_q);
+    // Without room the descriptors stay in the rings, that is the backpressure the guest sees
+    if (tdata->budget) {
+        for (uint32_t d = 0; d < emu->ndevs; d++) {
+            struct emu_ll_dev *dev = &emu->devs[d];
+            dev->ctrl_ops->progress_io(dev->ctrl, emu_ll_dev_thread(dev, tdata->thread_id));
+        }
+    } else {
+        tdata->admit_closed++;
+    }
+    // Held back requests count as useful, the cap can lift any moment
+    if (emu->sched)
+        scheduled = virtiofs_emu_ll_sched_dispatch(tdata) > 0;
+    if (emu->work_stealing) {
+        struct emu_ll_req *req;
+        // Oldest first when the scheduler picked the order, what does not fit stays for thieves
+        while (emu_ll_admit_open(tdata) &&
+               (req = emu->sched ? emu_ll_deque_steal(&tdata->deque) :
+                                   emu_ll_deque_take(&tdata->deque)) != NULL)
+            virtiofs_emu_ll_dispatch(tdata, req);
+        // Nothing of our own, help out the others
+        if (tdata->nreqs == nreqs)
+            stole = virtiofs_emu_ll_steal(tdata) > 0;
+    }
+    if (tdata->npending)
+        virtiofs_emu_ll_flush_bursts(tdata);
+    // While suspending SNAP waits for the requests, so don't hold them back
+    if (emu->coalesce_completions)
+        virtiofs_emu_ll_cq_poll(tdata, !keep_running);
+
+    if (tdata->nreqs != nreqs || stole || scheduled || admitted) {
+        tdata->polls_useful++;
+        return true;
+    }
+    tdata->polls_empty++;
+    return false;
+}
+
+// Harvested requests of a polling thread that are not dispatched yet, racy
+static uint64_t emu_ll_tdata_backlog(struct emu_ll_tdata *tdata)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    uint64_t n = 0;
+
+    if (emu->work_stealing) {
+        int64_t d = atomic_load_explicit(&tdata->deque.bottom, memory_order_relaxed) -
+                    atomic_load_explicit(&tdata->deque.top, memory_order_relaxed);
+        if (d > 0)
+            n += d;
+    }
+    if (emu->sched) {
+        for (int c = 0; c < EMU_LL_CLASSES; c++)
+            n += (uint32_t) (tdata->sched_q[c].tail - tdata->sched_q[c].head);
+    }
+    n += (uint32_t) (tdata->admit_q.tail - tdata->admit_q.head);
+    return n;
+}
+
+// Turns the doorbells of the virtqueues of tdata on all devices on or off
+// returns true if requests came in that were not polled yet
+static bool emu_ll_notify_enable(struct emu_ll_tdata *tdata, bool on)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    bool pending = false;
+
+    for (uint32_t d = 0; d < emu->ndevs; d++) {
+        struct emu_ll_dev *dev = &emu->devs[d];
+        pending |= dev->ctrl_ops->notify_enable(dev->ctrl, emu_ll_dev_thread(dev, tdata->thread_id), on);
+    }
+    return pending;
+}
+
+/*
+ * Turns on the doorbells of the virtqueues of tdata and blocks until one rings,
+ * a coalesced completion comes in or notify_timeout_ms passed.
+ * Returns true if the thread blocked.
+ */
+static bool virtiofs_emu_ll_poll_block(struct emu_ll_tdata *tdata)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+
+    // Requests that wait for the scheduler don't ring any doorbell
+    if (emu_ll_tdata_backlog(tdata))
+        return false;
+    if (emu->coalesce_completions)
+        virtiofs_emu_ll_cq_poll(tdata, true);
+
+    atomic_store(&tdata->blocked, true);
+    // Whatever came in before the doorbells were on has to be polled
+    bool pending = emu_ll_notify_enable(tdata, true);
+    if (pending || atomic_load(&tdata->cq_len)) {
+        emu_ll_notify_enable(tdata, false);
+        atomic_store(&tdata->blocked, false);
+        return false;
+    }
+
+    // The wake_fd and then the doorbells of every device
+    struct pollfd fds[1 + emu->ndevs];
+    fds[0].fd = tdata->wake_fd;
+    fds[0].events = POLLIN;
+    for (uint32_t d = 0; d < emu->ndevs; d++) {
+        fds[1 + d].fd = tdata->notify_fds[d];
+        fds[1 + d].events = POLLIN;
+    }
+    uint64_t start = emu_ll_now_ns();
+    int ret = poll(fds, 1 + emu->ndevs, emu->notify_timeout_ms);
+    tdata->blocked_ns += emu_ll_now_ns() - start;
+    tdata->blocks++;
+
+    emu_ll_notify_enable(tdata, false);
+    atomic_store(&tdata->blocked, false);
+
+    uint64_t v;
+    for (uint32_t d = 0; ret > 0 && d < emu->ndevs; d++) {
+        if ((fds[1 + d].revents & POLLIN) && read(fds[1 + d].fd, &v, sizeof(v)) == sizeof(v))
+            tdata->doorbells++;
+    }
+    if (ret > 0 && (fds[0].revents & POLLIN) && read(tdata->wake_fd, &v, sizeof(v)) == sizeof(v))
+        tdata->cq_wakeups++;
+    // Traffic again, busy-poll. After a timeout the next empty poll blocks right away.
+    if (ret > 0)
+        tdata->idle_rounds = 0;
+    return true;
+}
+
+/*
+ * Called after every poll in adaptive mode. While requests keep coming in
+ * we spin, after poll_idle_threshold empty polls we start pausing,
+ * then yielding the core and finally sleeping for exponentially longer
+ * (up to poll_max_sleep_usec).
+ * Returns true if the thread slept.
+ */
+static inline bool virtiofs_emu_ll_poll_backoff(struct emu_ll_tdata *tdata, bool useful)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    uint32_t threshold = emu->poll_idle_threshold;
+
+    if (useful) {
+        tdata->idle_rounds = 0;
+        tdata->sleep_usec = 0;
+        return false;
+    }
+
+    if (tdata->idle_rounds < 4 * threshold)
+        tdata->idle_rounds++;
+
+    if (tdata->idle_rounds < threshold) {
+        return false;
+    } else if (emu->notify) {
+        return virtiofs_emu_ll_poll_block(tdata);
+    } else if (tdata->idle_rounds < 2 * threshold) {
+        emu_ll_pause();
+        return false;
+    } else if (tdata->idle_rounds < 4 * threshold) {
+        sched_yield();
+        tdata->yields++;
+        return false;
+    }
+
+    tdata->sleep_usec = tdata->sleep_usec ?
+        MIN(tdata->sleep_usec * 2, emu->poll_max_sleep_usec) : 1;
+    // Elastic threads don't own a completion queue, there the batch waits out the sleep
+    if (emu->coalesce_completions && !emu->elastic)
+        virtiofs_emu_ll_cq_poll(tdata, true);
+    usleep(tdata->sleep_usec);
+    tdata->sleeps++;
+    return true;
+}
+
+static void virtiofs_emu_ll_thread_setup(struct emu_ll_tdata *tdata)
+{
+    // Store the thread_id in thread local storage so that the FUSE implementation
+    // knows what thread number its in when called with a request
+    pthread_setspecific(virtiofs_thread_id_key, (void *) tdata->thread_id);
+    tdata->start_ns = emu_ll_now_ns();
+
+    if (tdata->cpu < 0)
+        return;
+    int ret = virtiofs_emu_pin_thread(pthread_self(), tdata->cpu);
+    if (ret < 0)
+        fprintf(stderr, "Failed to pin polling thread %lu to CPU %d: %s\n",
+                tdata->thread_id, tdata->cpu, strerror(-ret));
+    else
+        printf("Polling thread %lu pinned to CPU %d\n", tdata->thread_id, tdata->cpu);
+}
+
+// How much of its time the thread was running, for the low load modes
+static void virtiofs_emu_ll_thread_exit(struct emu_ll_tdata *tdata)
 {
-    keep_running = 0;
+    struct timespec ts;
+    tdata->run_ns = emu_ll_now_ns() - tdata->start_ns;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        tdata->cpu_ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
 }
 
-static void virtiofs_emu_ll_loop_singlethreaded(struct virtio_fs_ctrl *ctrl, useconds_t interval, int thread_id)
+static void virtiofs_emu_ll_signals_setup(void)
 {
-    // Only one thread, thread_id=0
-    pthread_setspecific(virtiofs_thread_id_key, (void *) 0);
-
     struct sigaction act;
     memset(&act, 0, sizeof(act));
     act.sa_handler = signal_handler;
     sigaction(SIGINT, &act, 0);
     sigaction(SIGPIPE, &act, 0);
     sigaction(SIGTERM, &act, 0);
+    act.sa_handler = stats_signal_handler;
+    sigaction(SIGUSR1, &act, 0);
+    act.sa_handler = trace_signal_handler;
+    sigaction(SIGUSR2, &act, 0);
+}
+
+// What the signal handlers asked for
+static void virtiofs_emu_ll_signal_work(struct virtiofs_emu_ll *emu)
+{
+    if (unlikely(print_stats)) {
+        print_stats = 0;
+        virtiofs_emu_ll_stats_print(emu, stdout);
+    }
+
+    if (unlikely(toggle_trace)) {
+        toggle_trace = 0;
+        if (emu_ll_tracing(emu)) {
+            virtiofs_emu_ll_trace_enable(emu, false);
+            virtiofs_emu_ll_trace_dump(emu, emu->trace_file);
+        } else {
+            virtiofs_emu_ll_trace_enable(emu, true);
+            printf("Tracing requests, send SIGUSR2 again to stop and write %s\n", emu->trace_file);
+        }
+    }
+}
+
+// Adds or retires one OS polling thread every elastic interval, management thread only
+static void virtiofs_emu_ll_elastic_scale(struct virtiofs_emu_ll *emu)
+{
+    uint64_t now = emu_ll_now_ns();
+    uint64_t elapsed = now - emu->elastic_last_ns;
+    if (elapsed < emu->elastic_interval_ns)
+        return;
+    emu->elastic_last_ns = now;
+
+    uint32_t nactive = atomic_load_explicit(&emu->nactive, memory_order_relaxed);
+    uint64_t busy = 0;
+    uint64_t backlog = 0;
+    for (uint32_t i = 0; i < emu->ntdatas; i++) {
+        struct emu_ll_tdata *tdata = &emu->tdatas[i];
+        uint64_t b = atomic_load_explicit(&tdata->busy_ns, memory_order_relaxed);
+        busy += b - tdata->busy_prev;
+        tdata->busy_prev = b;
+        backlog += emu_ll_tdata_backlog(tdata);
+    }
+    uint32_t busy_pct = busy * 100 / (elapsed * nactive);
+
+    if ((busy_pct >= emu->elastic_grow_pct || backlog >= VIRTIOFS_EMU_LL_ELASTIC_BACKLOG) &&
+        nactive < emu->ntdatas) {
+        nactive++;
+        emu->elastic_grows++;
+    // Only when the remaining threads stay below the grow threshold, so that it doesn't flap
+    } else if (busy_pct <= emu->elastic_shrink_pct && backlog == 0 && nactive > emu->elastic_min &&
+               busy_pct * nactive / (nactive - 1) < emu->elastic_grow_pct) {
+        nactive--;
+        emu->elastic_shrinks++;
+    } else {
+        return;
+    }
+    atomic_store_explicit(&emu->nactive, nactive, memory_order_release);
+    printf("Elastic polling: %u of %u threads active (were %u%% busy, %lu requests waiting)\n",
+           nactive, emu->ntdatas, busy_pct, backlog);
+}
+
+// Logs the requests that are in flight for longer than the threshold, once each.
+// Called with the mmio polling, so by one thread only, it checks twice per threshold.
+static void virtiofs_emu_ll_watchdog(struct virtiofs_emu_ll *emu)
+{
+    uint64_t now = emu_ll_now_ns();
+    if (now - emu->watchdog_last_ns < emu->watchdog_ns / 2)
+        return;
+    emu->watchdog_last_ns = now;
+
+    uint32_t reported = 0;
+    for (uint32_t t = 0; t < emu->ntdatas; t++) {
+        struct emu_ll_tdata *tdata = &emu->tdatas[t];
+        for (uint32_t j = 0; j < tdata->reqs_len; j++) {
+            struct emu_ll_req *req = &tdata->reqs[j];
+            struct emu_ll_req_view v;
+            if (!emu_ll_req_view(req, &v) || v.since > now || now - v.since < emu->watchdog_ns ||
+                req->wd_reported == v.since)
+                continue;
+            req->wd_reported = v.since;
+            emu->watchdog_reported++;
+            if (reported++ < VIRTIOFS_EMU_LL_WATCHDOG_LOG)
+                fprintf(stderr, "Watchdog: request %lu (OP %u, nodeid %lu) of device %s on thread %u "
+                        "is in flight for %lu ms\n", v.unique, v.opcode, v.nodeid,
+                        emu->devs[v.dev].tag, t, (now - v.since) / 1000000);
+        }
+    }
+    if (reported > VIRTIOFS_EMU_LL_WATCHDOG_LOG)
+        fprintf(stderr, "Watchdog: and %u more requests in flight for over %lu ms\n",
+                reported - VIRTIOFS_EMU_LL_WATCHDOG_LOG, emu->watchdog_ns / 1000000);
+}
+
+// mmio, suspend and signal handling, so that all the polling threads only do io
+static void virtiofs_emu_ll_loop_mgmt(struct virtiofs_emu_ll *emu)
+{
+    bool suspending = false;
+
+    virtiofs_emu_ll_signals_setup();
+    emu->elastic_last_ns = emu_ll_now_ns();
+
+    while (keep_running || !emu_ll_devs_suspended(emu)) {
+        usleep(emu->mgmt_interval_usec);
+        emu_ll_devs_progress(emu);
+        virtiofs_emu_ll_watchdog(emu);
+
+        virtiofs_emu_ll_signal_work(emu);
+        if (emu->elastic)
+            virtiofs_emu_ll_elastic_scale(emu);
+
+        if (unlikely(!keep_running && !suspending)) {
+            emu_ll_devs_suspend(emu);
+            suspending = true;
+        }
+    }
+}
+
+static void virtiofs_emu_ll_loop_singlethreaded(struct emu_ll_tdata *tdata)
+{
+    struct virtiofs_emu_ll *emu = tdata->emu;
+    useconds_t interval = emu->polling_interval_usec;
+
+    // Only one thread, thread_id=0
+    virtiofs_emu_ll_thread_setup(tdata);
+    virtiofs_emu_ll_signals_setup();
 
     bool suspending = false;
     uint32_t count = 0;
 
-    while (keep_running || !virtio_fs_ctrl_is_suspended(ctrl)) {
+    while (keep_running || !emu_ll_devs_suspended(emu)) {
         /*
          * don't call usleep(0) because it adds a huge overhead
          * to polling.
@@ -91,86 +1427,140 @@ static void virtiofs_emu_ll_loop_singlethreaded(struct virtio_fs_ctrl *ctrl, use
         if (interval > 0) {
             usleep(interval);
             // actual io
-            virtio_fs_ctrl_progress_io(ctrl, thread_id);
+            virtiofs_emu_ll_poll_io(tdata);
             // This is for mmio (management io)
-            virtio_fs_ctrl_progress(ctrl);
+            emu_ll_devs_progress(emu);
+            virtiofs_emu_ll_watchdog(emu);
+        } else if (emu->adaptive_polling) {
+            bool useful = virtiofs_emu_ll_poll_io(tdata);
+            // When we are sleeping anyway, mmio polling is free
+            if (virtiofs_emu_ll_poll_backoff(tdata, useful) || count++ % 10000 == 0) {
+                emu_ll_devs_progress(emu);
+                virtiofs_emu_ll_watchdog(emu);
+            }
         } else {
             /*
              * poll submission queues as fast as we can
              * but don't spend resources on polling mmio
              */
-            virtio_fs_ctrl_progress_io(ctrl, thread_id);
+            virtiofs_emu_ll_poll_io(tdata);
             if (count++ % 10000 == 0) {
-                virtio_fs_ctrl_progress(ctrl);
+                emu_ll_devs_progress(emu);
+                virtiofs_emu_ll_watchdog(emu);
             }
         }
 
+        virtiofs_emu_ll_signal_work(emu);
+
         if (unlikely(!keep_running && !suspending)) {
-            virtio_fs_ctrl_suspend(ctrl);
+            emu_ll_devs_suspend(emu);
             suspending = true;
         }
     }
+    virtiofs_emu_ll_thread_exit(tdata);
 }
 
-struct emu_ll_tdata {
-    size_t thread_id;
-    struct virtio_fs_ctrl *ctrl;
-    useconds_t interval;
-    pthread_t thread;
-};
+/*
+ * The OS thread that started as polling thread self polls the virtqueues of
+ * polling threads self, self + nactive, self + 2 * nactive... and is parked when
+ * self >= nactive. Right after nactive changed two OS threads can think they
+ * should poll the same virtqueues, the polling flag lets only one of them in.
+ */
+static void virtiofs_emu_ll_loop_elastic(struct emu_ll_tdata *self)
+{
+    struct virtiofs_emu_ll *emu = self->emu;
+    size_t current = self->thread_id;
+
+    while (keep_running || !emu_ll_devs_suspended(emu)) {
+        uint32_t nactive = atomic_load_explicit(&emu->nactive, memory_order_acquire);
+        if (self->thread_id >= nactive) {
+            usleep(emu->mgmt_interval_usec);
+            continue;
+        }
+
+        uint64_t start = emu_ll_now_ns();
+        bool useful = false;
+        for (size_t i = self->thread_id; i < emu->ntdatas; i += nactive) {
+            struct emu_ll_tdata *tdata = &emu->tdatas[i];
+            if (atomic_flag_test_and_set_explicit(&tdata->polling, memory_order_acquire))
+                continue;
+            // The handlers use the resources of the virtqueues' own polling thread
+            if (current != i) {
+                pthread_setspecific(virtiofs_thread_id_key, (void *) i);
+                current = i;
+            }
+            useful |= virtiofs_emu_ll_poll_io(tdata);
+            atomic_flag_clear_explicit(&tdata->polling, memory_order_release);
+        }
+        if (useful)
+            atomic_fetch_add_explicit(&self->busy_ns, emu_ll_now_ns() - start, memory_order_relaxed);
+        if (emu->adaptive_polling)
+            virtiofs_emu_ll_poll_backoff(self, useful);
+    }
+}
 
 static void *virtiofs_emu_ll_loop_thread(void *arg)
 {
     struct emu_ll_tdata *tdata = (struct emu_ll_tdata *)arg;
+    struct virtiofs_emu_ll *emu = tdata->emu;
 
-    // Store the thread_id in thread local storage so that the FUSE implementation
-    // knows what thread number its in when called with a request
-    pthread_setspecific(virtiofs_thread_id_key, (void *) tdata->thread_id);
+    virtiofs_emu_ll_thread_setup(tdata);
+    if (emu->elastic) {
+        virtiofs_emu_ll_loop_elastic(tdata);
+        virtiofs_emu_ll_thread_exit(tdata);
+        return NULL;
+    }
 
     // poll as fast as we can! Someone else is doing mmio polling
-    while (keep_running || !virtio_fs_ctrl_is_suspended(tdata->ctrl))
-        virtio_fs_ctrl_progress_io(tdata->ctrl, tdata->thread_id);
+    while (keep_running || !emu_ll_devs_suspended(emu)) {
+        bool useful = virtiofs_emu_ll_poll_io(tdata);
+        if (emu->adaptive_polling)
+            virtiofs_emu_ll_poll_backoff(tdata, useful);
+    }
+    virtiofs_emu_ll_thread_exit(tdata);
 
     return NULL;
 }
 
-static void virtiofs_emu_ll_loop_multithreaded(struct virtio_fs_ctrl *ctrl,
-                               int nthreads, useconds_t interval)
+static void virtiofs_emu_ll_loop_multithreaded(struct virtiofs_emu_ll *emu)
 {
-    struct emu_ll_tdata tdatas[nthreads];
+    struct emu_ll_tdata *tdatas = emu->tdatas;
+    // With a management thread, thread 0 is a plain io thread too
+    int first = emu->mgmt_thread ? 0 : 1;
 
-    for (int i = 1; i < nthreads; i++) {
-        tdatas[i].thread_id = i;
-        tdatas[i].ctrl = ctrl;
+    for (int i = first; i < emu->ntdatas; i++) {
         // Only the first thread does mmio polling (sometimes)
         if (pthread_create(&tdatas[i].thread, NULL, virtiofs_emu_ll_loop_thread, &tdatas[i])) {
             warn("Failed to create thread for io %d", i);
-            for (int j = i - 1; j >= 0; j--) {
+            for (int j = i - 1; j >= first; j--) {
                 pthread_cancel(tdatas[j].thread);
                 pthread_join(tdatas[j].thread, NULL);
             }
+            return;
         }
     }
 
-    // The main thread also does mmio polling and signal handling
-    virtiofs_emu_ll_loop_singlethreaded(ctrl, interval, 0);
+    // The main thread does the mmio polling and signal handling, and io unless
+    // that is left to the others
+    if (emu->mgmt_thread)
+        virtiofs_emu_ll_loop_mgmt(emu);
+    else
+        virtiofs_emu_ll_loop_singlethreaded(&tdatas[0]);
 
     // The main thread exited, the other threads should exit soon
     // let's wait for them
-    for (int i = 1; i < nthreads; i++) {
+    for (int i = first; i < emu->ntdatas; i++) {
         pthread_join(tdatas[i].thread, NULL);
     }
 }
 
 void virtiofs_emu_ll_loop(struct virtiofs_emu_ll *emu)
 {
-    struct virtio_fs_ctrl *ctrl = emu->snap_ctrl;
-    useconds_t interval = emu->polling_interval_usec;
-    
-    if (emu->nthreads <= 1)
-        virtiofs_emu_ll_loop_singlethreaded(ctrl, interval, 0);
+    virtiofs_emu_ll_startup_mark("polling");
+    if (emu->nthreads <= 1 && !emu->mgmt_thread)
+        virtiofs_emu_ll_loop_singlethreaded(&emu->tdatas[0]);
     else { // Multithreaded mode
-        virtiofs_emu_ll_loop_multithreaded(ctrl, emu->nthreads, interval);
+        virtiofs_emu_ll_loop_multithreaded(emu);
     }
 }
 
@@ -189,13 +1579,16 @@ static int virtiofs_emu_ll_fuse_unknown(void *user_data,
     return 0;
 }
 
-static int virtiofs_emu_ll_handle_fuse_req(struct virtio_fs_ctrl *ctrl,
+static int virtiofs_emu_ll_handle_fuse_req(struct emu_ll_dev *dev,
                             struct iovec *fuse_in_iov, int in_iovcnt,
                             struct iovec *fuse_out_iov, int out_iovcnt,
                             struct snap_fs_dev_io_done_ctx *done_ctx) {
-    struct virtiofs_emu_ll *emu = ctrl->virtiofs_emu;
+    struct virtiofs_emu_ll *emu = dev->emu;
+    size_t thread_id = (size_t) pthread_getspecific(virtiofs_thread_id_key);
+    struct emu_ll_tdata *tdata = &emu->tdatas[thread_id];
+    tdata->nreqs++;
 
-    if (in_iovcnt < 1 || in_iovcnt < 1) {
+    if (in_iovcnt < 1 || out_iovcnt < 1) {
         fprintf(stderr, "virtiofs_emu_ll_handle_fuse_req: iovecs in and out don't both atleast one iovec\n");
         return -EINVAL;
     }
@@ -207,19 +1600,98 @@ static int virtiofs_emu_ll_handle_fuse_req(struct virtio_fs_ctrl *ctrl,
         return -EINVAL;
     } else {
         virtiofs_emu_ll_handler_t h = emu->handlers[in_hdr->opcode];
-        if (h == NULL) {
-            h = virtiofs_emu_ll_fuse_unknown;
+        virtiofs_emu_ll_burst_handler_t bh = emu->burst_handlers[in_hdr->opcode];
+
+        uint64_t start_ns = emu_ll_now_ns();
+        struct fuse_out_header *out_hdr = NULL;
+        if (out_iovcnt > 0 && fuse_out_iov[0].iov_len >= sizeof(struct fuse_out_header))
+            out_hdr = (struct fuse_out_header *) fuse_out_iov[0].iov_base;
+        // Wrap done_ctx so that we see when async requests finish
+        struct emu_ll_req *req = emu_ll_req_get(tdata);
+        if (req) {
+            req->snap_done_ctx = done_ctx;
+            req->dev = dev;
+            req->out_hdr = out_hdr;
+            req->start_ns = start_ns;
+            req->opcode = in_hdr->opcode;
+            req->done_ctx.cb = emu_ll_req_done;
+            req->done_ctx.user_arg = req;
+            req->fuse_in_iov = fuse_in_iov;
+            req->in_iovcnt = in_iovcnt;
+            req->fuse_out_iov = fuse_out_iov;
+            req->out_iovcnt = out_iovcnt;
+            req->bulk_bytes = 0;
+            req->unique = in_hdr->unique;
+            req->nodeid = in_hdr->nodeid;
+            req->size = emu_ll_bulk_bytes(in_hdr, fuse_in_iov, in_iovcnt);
+            req->backend_status = 0;
+            req->t_dispatch = 0;
+            req->t_done = 0;
+            atomic_store_explicit(&req->inflight_since, start_ns, memory_order_release);
+        }
+
+        // The backend is full, wait for room without bothering the handler
+        // (the scheduler and the deque hold requests back themselves)
+        if (req && !emu_ll_admit_open(tdata) && (bh || (!emu->sched && !emu->work_stealing))) {
+            emu_ll_admit_park(tdata, req);
+            return EWOULDBLOCK;
+        }
+
+        // Held back until the poll is over, so that the burst handler sees all of them
+        if (bh) {
+            if (req && tdata->budget != UINT32_MAX)
+                tdata->budget--;
+            if (tdata->npending == tdata->reqs_len)
+                virtiofs_emu_ll_flush_bursts(tdata);
+            struct emu_ll_pending *p = &tdata->pending[tdata->npending++];
+            p->r.fuse_in_iov = fuse_in_iov;
+            p->r.in_iovcnt = in_iovcnt;
+            p->r.fuse_out_iov = fuse_out_iov;
+            p->r.out_iovcnt = out_iovcnt;
+            p->r.cb = req ? &req->done_ctx : done_ctx;
+            p->opcode = in_hdr->opcode;
+            p->dev = dev;
+            if (!req)
+                tdata->untracked++;
+            return EWOULDBLOCK;
+        }
+
+        // Dispatched after the poll, by us or by a thread that has nothing to do
+        if (emu->work_stealing && !emu->sched && req) {
+            emu_ll_deque_push(&tdata->deque, req);
+            return EWOULDBLOCK;
+        }
+        // Or first through the scheduler
+        if (emu->sched && req) {
+            req->bulk_bytes = req->size;
+            emu_ll_fifo_push(&tdata->sched_q[req->bulk_bytes ? EMU_LL_CLASS_BULK : EMU_LL_CLASS_LAT], req);
+            return EWOULDBLOCK;
         }
+
         // Actually call the handler that was provided
-        int ret = h(emu->user_data, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt, done_ctx);
-#ifdef DEBUG_ENABLED
-        // Only log the number of calls with single threading, not thread safe
-        if (emu->nthreads <= 1) {
-            if (in_hdr->opcode == FUSE_INIT) {
-                memset(&emu->handlers_call_cnts, 0, sizeof(emu->handlers_call_cnts));
-            }
-            emu->handlers_call_cnts[in_hdr->opcode]++;
+        if (req)
+            emu_ll_trace_dispatch(emu, req);
+        int ret = h(dev->user_data, fuse_in_iov, in_iovcnt, fuse_out_iov, out_iovcnt,
+                    req ? &req->done_ctx : done_ctx);
+        if (ret == EBUSY) {
+            // The reqs cover every request on the thread's virtqueues, see virtiofs_emu_ll_new
+            assert(req);
+            tdata->budget = 0;
+            emu_ll_admit_park(tdata, req);
+            return EWOULDBLOCK;
+        } else if (ret == EWOULDBLOCK && tdata->budget != UINT32_MAX) {
+            tdata->budget--;
+        }
+        if (ret != EWOULDBLOCK) {
+            emu_ll_stats_record(tdata, dev, in_hdr->opcode, start_ns, emu_ll_req_failed(out_hdr, ret));
+            if (req && emu_ll_tracing(emu))
+                emu_ll_trace_record(req, ret ? SNAP_FS_DEV_OP_IO_ERROR : SNAP_FS_DEV_OP_SUCCESS);
+            if (req)
+                emu_ll_req_put(req);
+        } else if (!req) {
+            tdata->untracked++;
         }
+#ifdef DEBUG_ENABLED
         if (ret == 0 && out_iovcnt > 0 &&
             fuse_out_iov[0].iov_len >= sizeof(struct fuse_out_header))
         {
@@ -233,101 +1705,834 @@ static int virtiofs_emu_ll_handle_fuse_req(struct virtio_fs_ctrl *ctrl,
     }
 }
 
-struct virtiofs_emu_ll *virtiofs_emu_ll_new(struct virtiofs_emu_ll_params *params) {
-    struct virtiofs_emu_params emu_params = params->emu_params;
-    if (emu_params.emu_manager == NULL) {
-        fprintf(stderr, "virtiofs_emu_new: emu_manager is required!");
-        fprintf(stderr, "Enable virtiofs emulation in the firmware (see docs) and"
-                        "run `sudo spdk_rpc.py list_emulation_managers` to find"
-                        "out what emulation manager name to supply.");
-        return NULL;
+int virtiofs_emu_parse_cpu_list(const char *list, int **cpus) {
+    int *out = NULL;
+    int n = 0;
+    const char *s = list;
+
+    while (*s) {
+        char *end;
+        long first = strtol(s, &end, 10);
+        if (end == s)
+            goto inval;
+        long last = first;
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s)
+                goto inval;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            goto inval;
+
+        int *tmp = realloc(out, (n + last - first + 1) * sizeof(int));
+        if (!tmp) {
+            free(out);
+            return -ENOMEM;
+        }
+        out = tmp;
+        for (long cpu = first; cpu <= last; cpu++)
+            out[n++] = cpu;
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            goto inval;
+        s = end;
     }
-    if (emu_params.pf_id < 0) {
-        fprintf(stderr, "virtiofs_emu_new: pf_id requires a value >=0!");
-        // TODO add print that tells you how to figure out the pf_id
-        return NULL;
+    if (n == 0)
+        goto inval;
+
+    *cpus = out;
+    return n;
+inval:
+    free(out);
+    return -EINVAL;
+}
+
+int virtiofs_emu_parse_qos(const char *spec, struct virtiofs_emu_params *params) {
+    uint64_t v[4] = { 0 };
+    const char *s = spec;
+
+    for (int i = 0; i < 4; i++) {
+        char *end;
+        v[i] = strtoull(s, &end, 10);
+        if (end == s)
+            return -EINVAL;
+        if (*end == '\0')
+            break;
+        if (*end != ':' || i == 3)
+            return -EINVAL;
+        s = end + 1;
     }
-    if (emu_params.vf_id < -1) {
-        fprintf(stderr, "virtiofs_emu_new: vf_id requires a value >=-1!");
-        return NULL;
+
+    params->qos_dev.iops = v[0];
+    params->qos_dev.bps = v[1] << 20;
+    params->qos_thread.iops = v[2];
+    params->qos_thread.bps = v[3] << 20;
+    return 0;
+}
+
+int virtiofs_emu_parse_devs(const char *spec, const char *tag, struct virtiofs_emu_params *params) {
+    struct virtiofs_emu_dev *devs = NULL;
+    uint32_t n = 0;
+    const char *s = spec;
+
+    while (*s) {
+        struct virtiofs_emu_dev *tmp = realloc(devs, (n + 1) * sizeof(*devs));
+        if (!tmp)
+            goto nomem;
+        devs = tmp;
+        struct virtiofs_emu_dev *dev = &devs[n];
+        memset(dev, 0, sizeof(*dev));
+
+        char *end;
+        dev->pf_id = strtol(s, &end, 10);
+        if (end == s || *end != ':')
+            goto inval;
+        s = end + 1;
+        dev->vf_id = strtol(s, &end, 10);
+        if (end == s)
+            goto inval;
+        n++;
+        s = end;
+        if (*s == ':') {
+            s++;
+            size_t len = strcspn(s, ",");
+            if (len == 0)
+                goto inval;
+            dev->tag = strndup(s, len);
+            s += len;
+        } else if (asprintf(&dev->tag, "%s-%u", tag ? tag : "virtiofs", n - 1) < 0) {
+            dev->tag = NULL;
+        }
+        if (!dev->tag)
+            goto nomem;
+        if (*s == ',')
+            s++;
+        else if (*s != '\0')
+            goto inval;
     }
-    struct virtiofs_emu_ll *emu = calloc(sizeof(struct virtiofs_emu_ll), 1);
+    if (n == 0)
+        return -EINVAL;
 
-    emu->polling_interval_usec = emu_params.polling_interval_usec;
-    emu->user_data = params->user_data;
-    memcpy(emu->handlers, params->fuse_handlers, sizeof(params->fuse_handlers));
-    emu->nthreads = emu_params.nthreads;
+    params->devs = devs;
+    params->ndevs = n;
+    return 0;
+inval:
+    for (uint32_t d = 0; d < n; d++)
+        free(devs[d].tag);
+    free(devs);
+    return -EINVAL;
+nomem:
+    for (uint32_t d = 0; d < n; d++)
+        free(devs[d].tag);
+    free(devs);
+    return -ENOMEM;
+}
+
+int virtiofs_emu_pin_thread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return -pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+static int virtiofs_emu_ll_snap_handle_fuse_req(struct virtio_fs_ctrl *ctrl,
+                            struct iovec *fuse_in_iov, int in_iovcnt,
+                            struct iovec *fuse_out_iov, int out_iovcnt,
+                            struct snap_fs_dev_io_done_ctx *done_ctx) {
+    // virtiofs_emu is the device, see virtiofs_emu_ll_snap_init
+    return virtiofs_emu_ll_handle_fuse_req(ctrl->virtiofs_emu, fuse_in_iov, in_iovcnt,
+                                           fuse_out_iov, out_iovcnt, done_ctx);
+}
 
+static void virtiofs_emu_ll_snap_destroy(struct virtio_fs_ctrl *ctrl) {
+    printf("VirtIO-FS destroy controller %s\n", ctrl->sctx->context->device->name);
+    virtio_fs_ctrl_destroy(ctrl);
+}
+
+static const struct emu_ll_ctrl_ops virtiofs_emu_ll_snap_ops = {
+    .progress = (void (*)(void *)) virtio_fs_ctrl_progress,
+    .progress_io = (int (*)(void *, int)) virtio_fs_ctrl_progress_io,
+    .suspend = (void (*)(void *)) virtio_fs_ctrl_suspend,
+    .is_suspended = (bool (*)(void *)) virtio_fs_ctrl_is_suspended,
+    .destroy = (void (*)(void *)) virtiofs_emu_ll_snap_destroy,
+};
+
+static const struct emu_ll_ctrl_ops virtiofs_emu_ll_sw_ops = {
+    .progress = (void (*)(void *)) virtiofs_emu_sw_progress,
+    .progress_io = (int (*)(void *, int)) virtiofs_emu_sw_progress_io,
+    .suspend = (void (*)(void *)) virtiofs_emu_sw_suspend,
+    .is_suspended = (bool (*)(void *)) virtiofs_emu_sw_is_suspended,
+    .destroy = (void (*)(void *)) virtiofs_emu_sw_destroy,
+    .notify_fd = (int (*)(void *, int)) virtiofs_emu_sw_notify_fd,
+    .notify_enable = (bool (*)(void *, int, bool)) virtiofs_emu_sw_notify_enable,
+    .send_notification = (int (*)(void *, const struct iovec *, int)) virtiofs_emu_sw_send_notification,
+};
+
+static int virtiofs_emu_ll_snap_init(struct virtiofs_emu_ll *emu, struct emu_ll_dev *dev,
+                                     struct virtiofs_emu_dev *dev_params,
+                                     struct virtiofs_emu_params *emu_params) {
     struct virtio_fs_ctrl_init_attr param;
-    param.emu_manager_name = emu_params.emu_manager;
-    param.nthreads = emu_params.nthreads;
-    param.tag = emu_params.tag;
-    param.pf_id = emu_params.pf_id;
-    param.vf_id = emu_params.vf_id;
+    param.emu_manager_name = emu_params->emu_manager;
+    param.nthreads = emu_params->nthreads;
+    param.tag = dev_params->tag;
+    param.pf_id = dev_params->pf_id;
+    param.vf_id = dev_params->vf_id;
 
     param.dev_type = "virtiofs_emu";
-    param.num_queues = 64;
-    param.queue_depth = 64;
+    param.num_queues = emu_params->num_queues;
+    param.queue_depth = emu_params->queue_depth;
     param.force_in_order = false;
     // See snap_virtio_fs_ctrl.c:811, if enabled this controller is
     // supposed to be recovered from the dead
-    param.recover = false;
+    param.recover = emu_params->recover;
     param.suspended = false;
-    param.virtiofs_emu_handle_req = virtiofs_emu_ll_handle_fuse_req;
+    param.virtiofs_emu_handle_req = virtiofs_emu_ll_snap_handle_fuse_req;
     param.vf_change_cb = NULL;
     param.vf_change_cb_arg = NULL;
 
-    param.virtiofs_emu = emu;
+    param.virtiofs_emu = dev;
 
-    // Yes I know, we don't do NVMe here
-    // But snap uses this nvme logger everywhere so 💁
-    if (nvme_init_logger()) {
-        goto out;
+    // The devices share the logger and the emulation managers
+    if (!emu->snap_managers) {
+        // Yes I know, we don't do NVMe here
+        // But snap uses this nvme logger everywhere so 💁
+        if (nvme_init_logger()) {
+            return -1;
+        }
+        virtiofs_emu_ll_startup_mark("SNAP logger");
+
+        if (mlnx_snap_pci_manager_init()) {
+            fprintf(stderr, "Failed to init emulation managers list\n");
+            return -1;
+        };
+        emu->snap_managers = true;
+        virtiofs_emu_ll_startup_mark("emulation managers");
     }
 
-    if (mlnx_snap_pci_manager_init()) {
-        fprintf(stderr, "Failed to init emulation managers list\n");
-        goto out;
+    dev->ctrl = virtio_fs_ctrl_init(&param);
+    if (!dev->ctrl) {
+        fprintf(stderr, "failed to initialize VirtIO-FS controller %s\n", param.tag);
+        return -1;
+    }
+    dev->ctrl_ops = &virtiofs_emu_ll_snap_ops;
+    virtiofs_emu_ll_startup_mark("VirtIO-FS controller %s", param.tag);
+
+    printf("VirtIO-FS device %s (PF %d VF %d) on emulation manager %s is %s (%u queues of depth %u)\n",
+               param.tag, param.pf_id, param.vf_id, emu_params->emu_manager,
+               param.recover ? "recovered" : "ready", param.num_queues, param.queue_depth);
+    return 0;
+}
+
+static int virtiofs_emu_ll_sw_init(struct emu_ll_dev *dev,
+                                   struct virtiofs_emu_params *emu_params) {
+    struct virtiofs_emu_sw_attr attr;
+    attr.num_queues = emu_params->num_queues;
+    attr.queue_depth = emu_params->queue_depth;
+    attr.nthreads = emu_params->nthreads;
+    attr.handle_req = (virtiofs_emu_sw_handle_req_t) virtiofs_emu_ll_handle_fuse_req;
+    attr.handle_req_arg = dev;
+    attr.load_opcode = emu_params->sw_load_opcode ? emu_params->sw_load_opcode : FUSE_GETATTR;
+    attr.load_requests = emu_params->sw_load_requests;
+    attr.load_inflight = emu_params->sw_load_inflight;
+    attr.load_gap_usec = emu_params->sw_load_gap_usec;
+    attr.recover = emu_params->recover;
+
+    dev->ctrl = virtiofs_emu_sw_init(&attr);
+    if (!dev->ctrl) {
+        fprintf(stderr, "failed to initialize the software VirtIO-FS controller\n");
+        return -1;
+    }
+    dev->ctrl_ops = &virtiofs_emu_ll_sw_ops;
+    virtiofs_emu_ll_startup_mark("software VirtIO-FS controller %s", dev->tag);
+
+    printf("Software VirtIO-FS device %s is ready (%u queues of depth %u), no DPU involved\n",
+           dev->tag, attr.num_queues, attr.queue_depth);
+    return 0;
+}
+
+void virtiofs_emu_params_fill_defaults(struct virtiofs_emu_params *params) {
+    if (params->num_queues == 0)
+        params->num_queues = VIRTIOFS_EMU_LL_NUM_QUEUES;
+    if (params->queue_depth == 0)
+        params->queue_depth = VIRTIOFS_EMU_LL_QUEUE_DEPTH;
+    if (params->max_background == 0)
+        params->max_background = params->num_queues * params->queue_depth;
+}
+
+// Merges the stats of the devices first up to last
+static void emu_ll_stats_merge(struct virtiofs_emu_ll *emu, uint32_t first, uint32_t last,
+                               struct virtiofs_emu_ll_op_stats *stats) {
+    memset(stats, 0, VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN * sizeof(*stats));
+    for (uint32_t t = 0; t < emu->ntdatas; t++) {
+        for (uint32_t d = first; d <= last; d++) {
+            struct emu_ll_op_stats *dev_stats = &emu->tdatas[t].stats[d * VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN];
+            for (uint32_t op = 0; op < VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN; op++) {
+                struct emu_ll_op_stats *s = &dev_stats[op];
+                stats[op].count += atomic_load_explicit(&s->count, memory_order_relaxed);
+                stats[op].errors += atomic_load_explicit(&s->errors, memory_order_relaxed);
+                for (uint32_t b = 0; b < VIRTIOFS_EMU_LL_LAT_BUCKETS; b++)
+                    stats[op].lat_hist[b] += atomic_load_explicit(&s->lat_hist[b], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+void virtiofs_emu_ll_stats(struct virtiofs_emu_ll *emu, struct virtiofs_emu_ll_op_stats *stats) {
+    emu_ll_stats_merge(emu, 0, emu->ndevs - 1, stats);
+}
+
+void virtiofs_emu_ll_dev_stats(struct virtiofs_emu_ll *emu, uint32_t dev,
+                               struct virtiofs_emu_ll_op_stats *stats) {
+    emu_ll_stats_merge(emu, dev, dev, stats);
+}
+
+// The in-flight gauges of the devices first up to last
+static void emu_ll_inflight_merge(struct virtiofs_emu_ll *emu, uint32_t first, uint32_t last,
+                                  struct virtiofs_emu_ll_inflight *threads,
+                                  struct virtiofs_emu_ll_inflight *ops) {
+    if (threads)
+        memset(threads, 0, emu->ntdatas * sizeof(*threads));
+    if (ops)
+        memset(ops, 0, VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN * sizeof(*ops));
+    uint64_t now = emu_ll_now_ns();
+    for (uint32_t t = 0; t < emu->ntdatas; t++) {
+        struct emu_ll_tdata *tdata = &emu->tdatas[t];
+        for (uint32_t j = 0; j < tdata->reqs_len; j++) {
+            struct emu_ll_req_view v;
+            if (!emu_ll_req_view(&tdata->reqs[j], &v) || v.dev < first || v.dev > last)
+                continue;
+            uint64_t age = now > v.since ? now - v.since : 0;
+            if (threads) {
+                threads[t].count++;
+                if (age > threads[t].oldest_ns)
+                    threads[t].oldest_ns = age;
+            }
+            if (ops) {
+                ops[v.opcode].count++;
+                if (age > ops[v.opcode].oldest_ns)
+                    ops[v.opcode].oldest_ns = age;
+            }
+        }
+    }
+}
+
+void virtiofs_emu_ll_inflight(struct virtiofs_emu_ll *emu, struct virtiofs_emu_ll_inflight *threads,
+                              struct virtiofs_emu_ll_inflight *ops) {
+    emu_ll_inflight_merge(emu, 0, emu->ndevs - 1, threads, ops);
+}
+
+void virtiofs_emu_ll_dev_inflight(struct virtiofs_emu_ll *emu, uint32_t dev,
+                                  struct virtiofs_emu_ll_inflight *threads,
+                                  struct virtiofs_emu_ll_inflight *ops) {
+    emu_ll_inflight_merge(emu, dev, dev, threads, ops);
+}
+
+uint64_t virtiofs_emu_ll_stats_percentile(const struct virtiofs_emu_ll_op_stats *stats, double p) {
+    // Sum the histogram instead of using count, they can be slightly out of sync
+    uint64_t total = 0;
+    for (uint32_t b = 0; b < VIRTIOFS_EMU_LL_LAT_BUCKETS; b++)
+        total += stats->lat_hist[b];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = p * total;
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < VIRTIOFS_EMU_LL_LAT_BUCKETS; b++) {
+        seen += stats->lat_hist[b];
+        if (seen >= rank)
+            return 1UL << b;
+    }
+    return 1UL << (VIRTIOFS_EMU_LL_LAT_BUCKETS - 1);
+}
+
+static void emu_ll_stats_print_ops(const struct virtiofs_emu_ll_op_stats *stats, FILE *f) {
+    for (uint32_t op = 0; op < VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN; op++) {
+        if (!stats[op].count)
+            continue;
+        fprintf(f, "OP %u: %lu calls, %lu errors, p50 %lu, p99 %lu, p999 %lu\n",
+                op, stats[op].count, stats[op].errors,
+                virtiofs_emu_ll_stats_percentile(&stats[op], 0.5),
+                virtiofs_emu_ll_stats_percentile(&stats[op], 0.99),
+                virtiofs_emu_ll_stats_percentile(&stats[op], 0.999));
+    }
+}
+
+// Nothing, not even the title, when no request is in flight
+static void emu_ll_inflight_print(struct virtiofs_emu_ll *emu, uint32_t first, uint32_t last,
+                                  const char *title, FILE *f) {
+    struct virtiofs_emu_ll_inflight threads[emu->ntdatas];
+    struct virtiofs_emu_ll_inflight ops[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN];
+    emu_ll_inflight_merge(emu, first, last, threads, ops);
+
+    uint64_t count = 0;
+    for (uint32_t t = 0; t < emu->ntdatas; t++)
+        count += threads[t].count;
+    if (!count)
+        return;
+    fprintf(f, "%s in flight:\n", title);
+    for (uint32_t t = 0; t < emu->ntdatas; t++) {
+        if (threads[t].count)
+            fprintf(f, "Thread %u: %lu in flight, oldest %.3f ms\n", t, threads[t].count,
+                    threads[t].oldest_ns / 1e6);
+    }
+    for (uint32_t op = 0; op < VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN; op++) {
+        if (ops[op].count)
+            fprintf(f, "OP %u: %lu in flight, oldest %.3f ms\n", op, ops[op].count,
+                    ops[op].oldest_ns / 1e6);
+    }
+}
+
+void virtiofs_emu_ll_stats_print(struct virtiofs_emu_ll *emu, FILE *f) {
+    struct virtiofs_emu_ll_op_stats stats[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN];
+    virtiofs_emu_ll_stats(emu, stats);
+
+    virtiofs_emu_ll_startup_print(f);
+    fprintf(f, "Opcode stats (latency upper bounds in ns):\n");
+    emu_ll_stats_print_ops(stats, f);
+    for (uint32_t d = 0; emu->ndevs > 1 && d < emu->ndevs; d++) {
+        virtiofs_emu_ll_dev_stats(emu, d, stats);
+        fprintf(f, "Device %s:\n", emu->devs[d].tag);
+        emu_ll_stats_print_ops(stats, f);
+    }
+    emu_ll_inflight_print(emu, 0, emu->ndevs - 1, "Requests", f);
+    for (uint32_t d = 0; emu->ndevs > 1 && d < emu->ndevs; d++) {
+        char title[strlen(emu->devs[d].tag) + 8];
+        snprintf(title, sizeof(title), "Device %s", emu->devs[d].tag);
+        emu_ll_inflight_print(emu, d, d, title, f);
+    }
+    for (uint32_t d = 0; d < emu->ndevs; d++) {
+        struct emu_ll_dev *dev = &emu->devs[d];
+        uint32_t queued = atomic_load_explicit(&dev->notifications_queued, memory_order_relaxed);
+        if (dev->notifications_sent || dev->notifications_dropped || queued)
+            fprintf(f, "Notifications of device %s: %lu sent, %u waiting for a buffer, %lu dropped\n",
+                    dev->tag, dev->notifications_sent, queued, dev->notifications_dropped);
+    }
+    if (emu->watchdog_reported)
+        fprintf(f, "Watchdog: %lu requests were in flight for over %lu ms\n",
+                emu->watchdog_reported, emu->watchdog_ns / 1000000);
+    if (emu->elastic)
+        fprintf(f, "Elastic polling: %u of %u threads active, added %lu and retired %lu times\n",
+                atomic_load(&emu->nactive), emu->ntdatas, emu->elastic_grows, emu->elastic_shrinks);
+    for (uint32_t t = 0; t < emu->ntdatas; t++) {
+        if (emu->tdatas[t].untracked)
+            fprintf(f, "Thread %u: %lu async requests not in the stats, all reqs were in use\n",
+                    t, emu->tdatas[t].untracked);
+    }
+}
+
+static void virtiofs_emu_ll_free_tdatas(struct virtiofs_emu_ll *emu) {
+    for (uint32_t i = 0; i < emu->ntdatas; i++) {
+        free(emu->tdatas[i].stats);
+        free(emu->tdatas[i].reqs);
+        free(emu->tdatas[i].pending);
+        free(emu->tdatas[i].burst);
+        free(emu->tdatas[i].deque.buf);
+        free(emu->tdatas[i].trace);
+        free(emu->tdatas[i].notify_fds);
+        free(emu->tdatas[i].admit_q.buf);
+        if (emu->tdatas[i].wake_fd >= 0)
+            close(emu->tdatas[i].wake_fd);
+        for (int c = 0; c < EMU_LL_CLASSES; c++)
+            free(emu->tdatas[i].sched_q[c].buf);
+    }
+    free(emu->tdatas);
+}
+
+static void virtiofs_emu_ll_free_devs(struct virtiofs_emu_ll *emu) {
+    for (uint32_t d = 0; d < emu->ndevs; d++) {
+        if (emu->devs[d].ctrl)
+            emu->devs[d].ctrl_ops->destroy(emu->devs[d].ctrl);
+        pthread_spin_destroy(&emu->devs[d].qos_lock);
+        struct emu_ll_notification *n = emu->devs[d].notification_head;
+        while (n) {
+            struct emu_ll_notification *next = n->next;
+            free(n);
+            n = next;
+        }
+        pthread_mutex_destroy(&emu->devs[d].notification_lock);
+    }
+    if (emu->snap_managers)
+        mlnx_snap_pci_manager_clear();
+    free(emu->devs);
+}
+
+struct virtiofs_emu_ll *virtiofs_emu_ll_new(struct virtiofs_emu_ll_params *params) {
+    struct virtiofs_emu_params emu_params = params->emu_params;
+    virtiofs_emu_params_fill_defaults(&emu_params);
+    // The software controller needs no hardware
+    if (!emu_params.sw_ctrl && emu_params.emu_manager == NULL) {
+        fprintf(stderr, "virtiofs_emu_new: emu_manager is required!");
+        fprintf(stderr, "Enable virtiofs emulation in the firmware (see docs) and"
+                        "run `sudo spdk_rpc.py list_emulation_managers` to find"
+                        "out what emulation manager name to supply.");
+        return NULL;
+    }
+    // Without a list of devices there is the one of pf_id, vf_id and tag
+    struct virtiofs_emu_dev single = {
+        .pf_id = emu_params.pf_id,
+        .vf_id = emu_params.vf_id,
+        .tag = emu_params.tag,
     };
+    struct virtiofs_emu_dev *dev_params = emu_params.ndevs ? emu_params.devs : &single;
+    uint32_t ndevs = emu_params.ndevs ? emu_params.ndevs : 1;
+    for (uint32_t d = 0; d < ndevs && !emu_params.sw_ctrl; d++) {
+        if (dev_params[d].pf_id < 0) {
+            fprintf(stderr, "virtiofs_emu_new: pf_id requires a value >=0!");
+            // TODO add print that tells you how to figure out the pf_id
+            return NULL;
+        }
+        if (dev_params[d].vf_id < -1) {
+            fprintf(stderr, "virtiofs_emu_new: vf_id requires a value >=-1!");
+            return NULL;
+        }
+    }
+    if (ndevs > 1 && emu_params.recover) {
+        fprintf(stderr, "virtiofs_emu_new: only a single device can be recovered!");
+        return NULL;
+    }
+    if (emu_params.queue_depth & (emu_params.queue_depth - 1)) {
+        fprintf(stderr, "virtiofs_emu_new: queue_depth must be a power of 2!");
+        return NULL;
+    }
+    struct virtiofs_emu_ll *emu = calloc(sizeof(struct virtiofs_emu_ll), 1);
+    if (!emu) {
+        fprintf(stderr, "virtiofs_emu_new: failed to allocate the emulator\n");
+        return NULL;
+    }
+
+    emu->polling_interval_usec = emu_params.polling_interval_usec;
+    memcpy(emu->handlers, params->fuse_handlers, sizeof(params->fuse_handlers));
+    // So that dispatching never has to check
+    for (int op = 0; op < VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN; op++) {
+        if (emu->handlers[op] == NULL)
+            emu->handlers[op] = virtiofs_emu_ll_fuse_unknown;
+    }
+    memcpy(emu->burst_handlers, params->burst_handlers, sizeof(params->burst_handlers));
+    emu->capacity = params->capacity;
+    emu->nthreads = emu_params.nthreads;
+    emu->adaptive_polling = emu_params.adaptive_polling;
+    emu->poll_idle_threshold = emu_params.poll_idle_threshold ?
+        emu_params.poll_idle_threshold : VIRTIOFS_EMU_LL_POLL_IDLE_THRESHOLD;
+    emu->poll_max_sleep_usec = emu_params.poll_max_sleep_usec ?
+        emu_params.poll_max_sleep_usec : VIRTIOFS_EMU_LL_POLL_MAX_SLEEP_USEC;
+    // The idle detection of adaptive polling decides when to block
+    emu->notify = emu_params.notify && !emu_params.elastic;
+    emu->adaptive_polling |= emu->notify;
+    emu->notify_timeout_ms = ((emu_params.notify_timeout_usec ? emu_params.notify_timeout_usec :
+        VIRTIOFS_EMU_LL_NOTIFY_TIMEOUT_USEC) + 999) / 1000;
+    emu->coalesce_completions = emu_params.coalesce_completions;
+    emu->coalesce_count = emu_params.coalesce_count;
+    emu->coalesce_nsec = emu_params.coalesce_usec * 1000UL;
+    if (emu->coalesce_count && !emu->coalesce_nsec)
+        emu->coalesce_nsec = VIRTIOFS_EMU_LL_COALESCE_USEC * 1000UL;
 
-    emu->snap_ctrl = virtio_fs_ctrl_init(&param);
-    if (!emu->snap_ctrl) {
-        fprintf(stderr, "failed to initialize VirtIO-FS controller\n");
-        goto clear_pci_list;
+    emu->ntdatas = emu->nthreads > 1 ? emu->nthreads : 1;
+    emu->mgmt_thread = emu_params.mgmt_thread;
+    emu->mgmt_interval_usec = emu_params.mgmt_interval_usec ?
+        emu_params.mgmt_interval_usec : VIRTIOFS_EMU_LL_MGMT_INTERVAL_USEC;
+    // The management thread makes the scaling decisions
+    emu->elastic = emu_params.elastic && emu->ntdatas > 1;
+    if (emu->elastic && !emu->mgmt_thread) {
+        printf("Elastic polling threads need the management thread, turning it on\n");
+        emu->mgmt_thread = true;
+    }
+    emu->elastic_min = emu_params.elastic_min_threads ? MIN(emu_params.elastic_min_threads, emu->ntdatas) : 1;
+    emu->elastic_interval_ns = (emu_params.elastic_interval_usec ?
+        emu_params.elastic_interval_usec : VIRTIOFS_EMU_LL_ELASTIC_INTERVAL_USEC) * 1000UL;
+    emu->elastic_grow_pct = emu_params.elastic_grow_pct ?
+        emu_params.elastic_grow_pct : VIRTIOFS_EMU_LL_ELASTIC_GROW_PCT;
+    emu->elastic_shrink_pct = emu_params.elastic_shrink_pct ?
+        emu_params.elastic_shrink_pct : VIRTIOFS_EMU_LL_ELASTIC_SHRINK_PCT;
+    // Start with all of them, the scaler retires what is not needed
+    atomic_init(&emu->nactive, emu->ntdatas);
+    // The QoS limits are enforced by the scheduler
+    emu->qos = emu_params.qos_dev.iops || emu_params.qos_dev.bps ||
+               emu_params.qos_thread.iops || emu_params.qos_thread.bps;
+    emu->sched = emu_params.sched || emu->qos;
+    atomic_init(&emu->trace_on, emu_params.trace);
+    emu->watchdog_ns = (emu_params.watchdog_msec ? emu_params.watchdog_msec :
+        VIRTIOFS_EMU_LL_WATCHDOG_MSEC) * 1000000UL;
+    emu->watchdog_last_ns = emu_ll_now_ns();
+    emu->trace_file = emu_params.trace_file ? emu_params.trace_file : VIRTIOFS_EMU_LL_TRACE_FILE;
+    uint32_t trace_len = 1;
+    while (trace_len < (emu_params.trace_entries ? emu_params.trace_entries : VIRTIOFS_EMU_LL_TRACE_ENTRIES))
+        trace_len <<= 1;
+    emu->sched_weight[EMU_LL_CLASS_LAT] = emu_params.sched_lat_weight ?
+        emu_params.sched_lat_weight : VIRTIOFS_EMU_LL_SCHED_LAT_WEIGHT;
+    emu->sched_weight[EMU_LL_CLASS_BULK] = emu_params.sched_bulk_weight ?
+        emu_params.sched_bulk_weight : VIRTIOFS_EMU_LL_SCHED_BULK_WEIGHT;
+    emu->sched_bulk_max_inflight = emu_params.sched_bulk_max_inflight ?
+        emu_params.sched_bulk_max_inflight : VIRTIOFS_EMU_LL_SCHED_BULK_MAX_INFLIGHT;
+    // Nobody to steal from with one thread
+    emu->work_stealing = emu_params.work_stealing && emu->ntdatas > 1;
+    emu->devs = calloc(ndevs, sizeof(struct emu_ll_dev));
+    if (!emu->devs) {
+        fprintf(stderr, "virtiofs_emu_new: failed to allocate the devices\n");
+        free(emu);
+        return NULL;
+    }
+    emu->ndevs = ndevs;
+    for (uint32_t d = 0; d < ndevs; d++) {
+        struct emu_ll_dev *dev = &emu->devs[d];
+        dev->emu = emu;
+        dev->id = d;
+        dev->tag = dev_params[d].tag ? dev_params[d].tag : "virtiofs";
+        dev->user_data = dev_params[d].user_data ? dev_params[d].user_data : params->user_data;
+        dev->shift = d % emu->ntdatas;
+        emu_ll_bucket_init(&dev->qos.iops, emu_params.qos_dev.iops, emu_params.qos_dev.iops_burst);
+        emu_ll_bucket_init(&dev->qos.bytes, emu_params.qos_dev.bps, emu_params.qos_dev.bps_burst);
+        pthread_spin_init(&dev->qos_lock, PTHREAD_PROCESS_PRIVATE);
+        pthread_mutex_init(&dev->notification_lock, NULL);
+        dev->notification_tail = &dev->notification_head;
+    }
+    if (posix_memalign((void **) &emu->tdatas, 64, emu->ntdatas * sizeof(struct emu_ll_tdata))) {
+        fprintf(stderr, "virtiofs_emu_new: failed to allocate the thread data\n");
+        virtiofs_emu_ll_free_devs(emu);
+        free(emu);
+        return NULL;
+    }
+    memset(emu->tdatas, 0, emu->ntdatas * sizeof(struct emu_ll_tdata));
+    for (uint32_t i = 0; i < emu->ntdatas; i++)
+        emu->tdatas[i].wake_fd = -1;
+    // Enough reqs for every request on the queues a thread serves, of all devices, so that
+    // a request the backend has no room for can always wait in the thread (EBUSY). An
+    // elastic thread can end up with the queues of all others
+    uint32_t queues_per_thread = emu->elastic ? ndevs * emu_params.num_queues :
+        (ndevs * emu_params.num_queues + emu->ntdatas - 1) / emu->ntdatas;
+    uint32_t reqs_len = 1;
+    while (reqs_len < queues_per_thread * emu_params.queue_depth)
+        reqs_len <<= 1;
+    uint32_t admit_len = reqs_len;
+    while (admit_len < reqs_len + VIRTIOFS_EMU_LL_STEAL_BATCH)
+        admit_len <<= 1;
+    for (uint32_t i = 0; i < emu->ntdatas; i++) {
+        struct emu_ll_tdata *tdata = &emu->tdatas[i];
+        tdata->emu = emu;
+        tdata->thread_id = i;
+        tdata->cpu = emu_params.npoll_cpus ?
+            emu_params.poll_cpus[i % emu_params.npoll_cpus] : -1;
+        tdata->reqs_len = reqs_len;
+        tdata->reqs = calloc(reqs_len, sizeof(struct emu_ll_req));
+        tdata->pending = malloc(reqs_len * sizeof(struct emu_ll_pending));
+        tdata->burst = malloc(reqs_len * sizeof(struct virtiofs_emu_ll_req));
+        // Every request in the deque holds one of the reqs
+        tdata->deque.buf = calloc(reqs_len, sizeof(*tdata->deque.buf));
+        tdata->deque.mask = reqs_len - 1;
+        bool sched_ok = true;
+        for (int c = 0; c < EMU_LL_CLASSES; c++) {
+            tdata->sched_q[c].buf = emu->sched ? malloc(reqs_len * sizeof(struct emu_ll_req *)) : NULL;
+            tdata->sched_q[c].mask = reqs_len - 1;
+            sched_ok &= !emu->sched || tdata->sched_q[c].buf;
+        }
+        tdata->admit_q.buf = malloc(admit_len * sizeof(struct emu_ll_req *));
+        tdata->admit_q.mask = admit_len - 1;
+        tdata->budget = UINT32_MAX;
+        tdata->victim = i;
+        atomic_flag_clear(&tdata->polling);
+        if (emu->notify)
+            tdata->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        tdata->trace_len = trace_len;
+        tdata->trace = calloc(trace_len, sizeof(struct virtiofs_emu_trace_rec));
+        emu_ll_bucket_init(&tdata->qos.iops, emu_params.qos_thread.iops, emu_params.qos_thread.iops_burst);
+        emu_ll_bucket_init(&tdata->qos.bytes, emu_params.qos_thread.bps, emu_params.qos_thread.bps_burst);
+        if (posix_memalign((void **) &tdata->stats, 64,
+                ndevs * VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN * sizeof(struct emu_ll_op_stats)))
+            tdata->stats = NULL;
+        tdata->notify_fds = calloc(ndevs, sizeof(int));
+        if (!tdata->reqs || !tdata->pending || !tdata->burst || !tdata->deque.buf || !sched_ok || !tdata->admit_q.buf ||
+            !tdata->trace || !tdata->stats || !tdata->notify_fds || (emu->notify && tdata->wake_fd < 0)) {
+            fprintf(stderr, "virtiofs_emu_new: failed to allocate the thread data\n");
+            virtiofs_emu_ll_free_tdatas(emu);
+            virtiofs_emu_ll_free_devs(emu);
+            free(emu);
+            return NULL;
+        }
+        memset(tdata->stats, 0, ndevs * VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN * sizeof(struct emu_ll_op_stats));
+        for (uint32_t j = 0; j < reqs_len; j++)
+            tdata->reqs[j].tdata = tdata;
     }
 
     // Initialize the thread-local key we use to tell each of the Virtio
     // polling threads, which thread id it has
     if (pthread_key_create(&virtiofs_thread_id_key, NULL)) {
         fprintf(stderr, "Failed to create thread-local key for virtiofs threadid\n");
-        goto clear_pci_list;
+        goto out;
     }
 
-    printf("VirtIO-FS device %s on emulation manager %s is ready\n",
-               param.tag, emu_params.emu_manager);
+    for (uint32_t d = 0; d < ndevs; d++) {
+        int ret = emu_params.sw_ctrl ? virtiofs_emu_ll_sw_init(&emu->devs[d], &emu_params) :
+                  virtiofs_emu_ll_snap_init(emu, &emu->devs[d], &dev_params[d], &emu_params);
+        if (ret)
+            goto delete_key;
+    }
+
+    for (uint32_t d = 0; d < ndevs; d++) {
+        if (emu->notify && !emu->devs[d].ctrl_ops->notify_fd) {
+            printf("The VirtIO-FS controller has no doorbells, idle polling threads back off instead\n");
+            emu->notify = false;
+        }
+    }
+    for (uint32_t i = 0; emu->notify && i < emu->ntdatas; i++) {
+        for (uint32_t d = 0; d < ndevs; d++) {
+            struct emu_ll_dev *dev = &emu->devs[d];
+            emu->tdatas[i].notify_fds[d] = dev->ctrl_ops->notify_fd(dev->ctrl, emu_ll_dev_thread(dev, i));
+        }
+    }
 
     return emu;
 
-clear_pci_list:
-    mlnx_snap_pci_manager_clear();
+delete_key:
+    pthread_key_delete(virtiofs_thread_id_key);
 out:
+    virtiofs_emu_ll_free_tdatas(emu);
+    virtiofs_emu_ll_free_devs(emu);
+    free(emu);
     return NULL;
 }
 
-void virtiofs_emu_ll_destroy(struct virtiofs_emu_ll *emu) {
-    printf("VirtIO-FS destroy controller %s\n", emu->snap_ctrl->sctx->context->device->name);
+bool virtiofs_emu_ll_notifications_supported(struct virtiofs_emu_ll *emu, uint32_t dev) {
+    return dev < emu->ndevs && emu->devs[dev].ctrl_ops->send_notification;
+}
 
-#ifdef DEBUG_ENABLED
-    printf("Opcode call counts:\n");
-    for (uint32_t i = 0; i < VIRTIOFS_EMU_LL_FUSE_MAX_OPCODE; i++) {
-        if (emu->handlers_call_cnts[i])
-            printf("OP %u : %u\n", i, emu->handlers_call_cnts[i]);
+int virtiofs_emu_ll_send_notification(struct virtiofs_emu_ll *emu, uint32_t dev_id,
+                                      const struct iovec *iov, int iovcnt) {
+    if (!virtiofs_emu_ll_notifications_supported(emu, dev_id))
+        return -ENOTSUP;
+    struct emu_ll_dev *dev = &emu->devs[dev_id];
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len < sizeof(struct fuse_out_header) || len > VIRTIOFS_EMU_LL_NOTIFICATION_MAX_LEN)
+        return -EINVAL;
+
+    struct emu_ll_notification *n = malloc(sizeof(*n) + len);
+    if (!n)
+        return -ENOMEM;
+    n->next = NULL;
+    n->len = len;
+    char *p = n->buf;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
     }
 
-#endif
+    pthread_mutex_lock(&dev->notification_lock);
+    if (atomic_load_explicit(&dev->notifications_queued, memory_order_relaxed) >=
+            VIRTIOFS_EMU_LL_NOTIFICATION_QUEUE) {
+        dev->notifications_dropped++;
+        pthread_mutex_unlock(&dev->notification_lock);
+        free(n);
+        return -ENOSPC;
+    }
+    *dev->notification_tail = n;
+    dev->notification_tail = &n->next;
+    atomic_fetch_add_explicit(&dev->notifications_queued, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&dev->notification_lock);
+    return 0;
+}
+
+void virtiofs_emu_ll_trace_enable(struct virtiofs_emu_ll *emu, bool on) {
+    atomic_store_explicit(&emu->trace_on, on, memory_order_relaxed);
+}
+
+void virtiofs_emu_ll_trace_status(struct snap_fs_dev_io_done_ctx *cb, int32_t status) {
+    // Untracked requests go straight to the controller
+    if (cb->cb == emu_ll_req_done)
+        ((struct emu_ll_req *) cb->user_arg)->backend_status = status;
+}
+
+int virtiofs_emu_ll_trace_dump(struct virtiofs_emu_ll *emu, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to open trace file %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    struct virtiofs_emu_trace_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, VIRTIOFS_EMU_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = VIRTIOFS_EMU_TRACE_VERSION;
+    hdr.rec_size = sizeof(struct virtiofs_emu_trace_rec);
+    hdr.nthreads = emu->ntdatas;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    uint64_t written = 0;
+    uint64_t skipped = 0;
+    for (uint32_t t = 0; t < emu->ntdatas; t++) {
+        struct emu_ll_tdata *tdata = &emu->tdatas[t];
+        uint64_t head = atomic_load_explicit(&tdata->trace_head, memory_order_acquire);
+        uint64_t first = head > tdata->trace_len ? head - tdata->trace_len : 0;
+
+        for (uint64_t idx = first; idx < head; idx++) {
+            struct virtiofs_emu_trace_rec *rec = &tdata->trace[idx & (tdata->trace_len - 1)];
+            struct virtiofs_emu_trace_rec copy;
+            uint32_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+            memcpy(&copy, rec, sizeof(copy));
+            atomic_thread_fence(memory_order_acquire);
+            // Still being written or already overwritten
+            if (seq != (uint32_t) idx + 1 || __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq) {
+                skipped++;
+                continue;
+            }
+            fwrite(&copy, sizeof(copy), 1, f);
+            written++;
+        }
+    }
+
+    int ret = ferror(f) ? -EIO : 0;
+    fclose(f);
+    printf("Trace of %lu requests written to %s (%lu skipped)\n", written, path, skipped);
+    return ret;
+}
+
+void virtiofs_emu_ll_destroy(struct virtiofs_emu_ll *emu) {
+    virtiofs_emu_ll_stats_print(emu, stdout);
+
+    bool traced = false;
+    for (uint32_t i = 0; i < emu->ntdatas; i++)
+        traced |= atomic_load(&emu->tdatas[i].trace_head) > 0;
+    if (traced)
+        virtiofs_emu_ll_trace_dump(emu, emu->trace_file);
+
+    for (uint32_t i = 0; i < emu->ntdatas; i++) {
+        struct emu_ll_tdata *tdata = &emu->tdatas[i];
+        uint64_t polls = tdata->polls_useful + tdata->polls_empty;
+        printf("Thread %u polls: %lu useful, %lu empty (%.2f%% useful), %lu yields, %lu sleeps\n",
+               i, tdata->polls_useful, tdata->polls_empty,
+               polls ? 100.0 * tdata->polls_useful / polls : 0.0,
+               tdata->yields, tdata->sleeps);
+        if (tdata->bursts)
+            printf("Thread %u bursts: %lu, %.2f requests per burst\n", i, tdata->bursts,
+                   (double) tdata->burst_reqs / tdata->bursts);
+        if (tdata->qos_deferred)
+            printf("Thread %u: the QoS limits held back requests in %lu polls\n", i, tdata->qos_deferred);
+        if (tdata->bulk_capped)
+            printf("Thread %u: the bulk cap held back requests in %lu polls\n", i, tdata->bulk_capped);
+        if (tdata->admit_parked || tdata->admit_closed)
+            printf("Thread %u: the backend was full in %lu polls, %lu requests waited for room\n",
+                   i, tdata->admit_closed, tdata->admit_parked);
+        if (emu->work_stealing)
+            printf("Thread %u stole %lu requests, %lu were stolen from it\n", i,
+                   tdata->stolen, atomic_load(&tdata->lost));
+        if (tdata->cq_batches)
+            printf("Thread %u completions: %lu in %lu batches, %.2f per batch\n", i,
+                   tdata->cq_completions, tdata->cq_batches,
+                   (double) tdata->cq_completions / tdata->cq_batches);
+        if (emu->notify)
+            printf("Thread %u: %.3fs CPU in %.3fs, blocked %lu times for %.3fs"
+                   " (woken by %lu doorbells, %lu completions)\n", i,
+                   tdata->cpu_ns / 1e9, tdata->run_ns / 1e9, tdata->blocks,
+                   tdata->blocked_ns / 1e9, tdata->doorbells, tdata->cq_wakeups);
+    }
 
-    virtio_fs_ctrl_destroy(emu->snap_ctrl);
-    mlnx_snap_pci_manager_clear();
+    virtiofs_emu_ll_free_devs(emu);
+    virtiofs_emu_ll_free_tdatas(emu);
     free(emu);
 }
 
@@ -9,52 +9,313 @@
 #define VIRTIOFS_EMU_LL_H
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <linux/fuse.h>
 #include <unistd.h>
 
 #include "virtio_fs_controller.h"
+#include "virtiofs_emu_trace.h"
 
 #define VIRTIOFS_EMU_LL_FUSE_MAX_OPCODE FUSE_REMOVEMAPPING
 // The opcodes begin at FUSE_LOOKUP = 1, so need one more array index
-#define VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN VIRTIOFS_EMU_LL_FUSE_MAX_OPCODE+1
+#define VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN (VIRTIOFS_EMU_LL_FUSE_MAX_OPCODE + 1)
+// Default virtqueue shape, see struct virtiofs_emu_params to change it
 #define VIRTIOFS_EMU_LL_NUM_QUEUES 64
 #define VIRTIOFS_EMU_LL_QUEUE_DEPTH 64
-// The maximum number of outstanding requests the virtiofs consumer is allowed to have
-#define VIRTIOFS_EMU_LL_MAX_BACKGROUND (VIRTIOFS_EMU_LL_NUM_QUEUES * VIRTIOFS_EMU_LL_QUEUE_DEPTH)
+// Adaptive polling defaults, used when the params are left at 0
+#define VIRTIOFS_EMU_LL_POLL_IDLE_THRESHOLD 1000
+#define VIRTIOFS_EMU_LL_POLL_MAX_SLEEP_USEC 64
+// Latency histogram bucket i counts the requests that took [2^(i-1), 2^i) ns
+// the last bucket also counts everything slower
+#define VIRTIOFS_EMU_LL_LAT_BUCKETS 40
+// Most requests a burst handler gets in one call
+#define VIRTIOFS_EMU_LL_MAX_BURST 64
+// Longest a coalesced completion waits when only coalesce_count is set
+#define VIRTIOFS_EMU_LL_COALESCE_USEC 32
+// Longest a polling thread blocks on its doorbells before it polls again
+#define VIRTIOFS_EMU_LL_NOTIFY_TIMEOUT_USEC 10000
+// Most requests an idle polling thread steals per poll
+#define VIRTIOFS_EMU_LL_STEAL_BATCH 8
+// Default time between two mmio polls of the management thread
+#define VIRTIOFS_EMU_LL_MGMT_INTERVAL_USEC 1000
+// Scheduler defaults, used when the params are left at 0
+#define VIRTIOFS_EMU_LL_SCHED_LAT_WEIGHT 8
+#define VIRTIOFS_EMU_LL_SCHED_BULK_WEIGHT 1
+#define VIRTIOFS_EMU_LL_SCHED_BULK_MAX_INFLIGHT (4 << 20)
+// Elastic scaling defaults, used when the params are left at 0
+#define VIRTIOFS_EMU_LL_ELASTIC_INTERVAL_USEC 100000
+#define VIRTIOFS_EMU_LL_ELASTIC_GROW_PCT 70
+#define VIRTIOFS_EMU_LL_ELASTIC_SHRINK_PCT 20
+// Harvested requests waiting to be dispatched that make the scaler add a thread
+#define VIRTIOFS_EMU_LL_ELASTIC_BACKLOG 64
+// Trace ring defaults, per polling thread
+#define VIRTIOFS_EMU_LL_TRACE_ENTRIES 16384
+#define VIRTIOFS_EMU_LL_TRACE_FILE "virtiofs_emu_trace.bin"
+// Most startup phases that are kept for virtiofs_emu_ll_startup_print
+#define VIRTIOFS_EMU_LL_STARTUP_PHASES 32
+// Default age at which the watchdog reports a request that is not done yet
+#define VIRTIOFS_EMU_LL_WATCHDOG_MSEC 5000
+// Most requests the watchdog logs one by one per check, the rest are only counted
+#define VIRTIOFS_EMU_LL_WATCHDOG_LOG 16
+// Largest notification (fuse_out_header and payload) and most that wait per device
+#define VIRTIOFS_EMU_LL_NOTIFICATION_MAX_LEN 4096
+#define VIRTIOFS_EMU_LL_NOTIFICATION_QUEUE 4096
 
 // return int EWOULDBLOCK indicates that the done_ctx callback
 // will be used to indicate when the request is fully handled
 // return int 0 indicates that the request is fully handled and
 // can be sent to the host
+// return int EBUSY indicates that the backend has no room for the request
+// right now, it is handed to the handler again later (see capacity)
 typedef int (*virtiofs_emu_ll_handler_t) (void *user_data,
                             struct iovec *fuse_in_iov, int in_iovcnt,
                             struct iovec *fuse_out_iov, int out_iovcnt,
                             struct snap_fs_dev_io_done_ctx *cb);
 
+// One request of a burst, the iovecs stay valid until cb is called
+struct virtiofs_emu_ll_req {
+    struct iovec *fuse_in_iov;
+    int in_iovcnt;
+    struct iovec *fuse_out_iov;
+    int out_iovcnt;
+    struct snap_fs_dev_io_done_ctx *cb;
+};
+
+// Gets the requests of one opcode that were harvested in the same poll, in arrival order
+// and at most VIRTIOFS_EMU_LL_MAX_BURST at a time. Unlike virtiofs_emu_ll_handler_t
+// every request it takes must be completed through its cb, also the ones that fail right away.
+// Returns how many it took. The ones it had no room for must be the last ones of reqs
+// (it may reorder reqs), they wait like after an EBUSY and go to the fuse_handler later.
+// Called on the polling thread that harvested the requests.
+typedef uint32_t (*virtiofs_emu_ll_burst_handler_t) (void *user_data, uint32_t opcode,
+                            struct virtiofs_emu_ll_req *reqs, uint32_t nreqs);
+
+// Token bucket limits, a rate of 0 is unlimited and a burst (the bucket size)
+// of 0 is a tenth of a second worth of the rate
+struct virtiofs_emu_qos_limit {
+    uint64_t iops;
+    uint64_t iops_burst;
+    uint64_t bps; // Bytes of READ/WRITE payload per second
+    uint64_t bps_burst;
+};
+
+// One of several devices served by the same polling threads, see virtiofs_emu_params.devs
+struct virtiofs_emu_dev {
+    int pf_id;
+    int vf_id;
+    char *tag;
+    // What the handlers get for the requests of this device, NULL for
+    // virtiofs_emu_ll_params.user_data
+    void *user_data;
+};
+
 struct virtiofs_emu_params {
     useconds_t polling_interval_usec; // Time between every poll
     int pf_id; // Physical function ID
     int vf_id; // Virtual function ID
     char *emu_manager; // Emulation manager
     // Amount of polling threads 0 for single threaded mode, >0 for multithreaded mode
-    // Multithreaded not supported currently!
     uint32_t nthreads;
     char *tag; // Filesystem tag (i.e. the name of the virtiofs device to mount for the host)
+    // Serve several devices (e.g. a VF per VM) instead of pf_id, vf_id and tag, with one
+    // controller each but the same polling threads. Every device has num_queues virtqueues,
+    // queue q of device d is polled by thread (q + d) % nthreads so that the first queues
+    // of the devices spread over the threads. The qos_dev limits hold for every device.
+    struct virtiofs_emu_dev *devs;
+    uint32_t ndevs;
+    // Virtqueue shape, 0 selects VIRTIOFS_EMU_LL_NUM_QUEUES and VIRTIOFS_EMU_LL_QUEUE_DEPTH
+    // queue_depth must be a power of 2
+    uint32_t num_queues;
+    uint32_t queue_depth;
+    // The maximum number of outstanding requests the virtiofs consumer is allowed to have
+    // 0 derives it from the virtqueue shape: num_queues * queue_depth
+    uint32_t max_background;
+    // Adaptive polling, only used when polling_interval_usec == 0
+    // Busy-polls while requests are arriving, and after poll_idle_threshold empty
+    // polls backs off gradually: pause, then yield, then sleeps that double up to
+    // poll_max_sleep_usec. Any request that comes in resets the poller to busy-polling.
+    bool adaptive_polling;
+    uint32_t poll_idle_threshold;
+    useconds_t poll_max_sleep_usec;
+    // Event driven low load mode, turns on adaptive_polling. After poll_idle_threshold
+    // empty polls the thread turns on the doorbells of its virtqueues and blocks until one
+    // rings, a coalesced completion comes in or notify_timeout_usec (0 =
+    // VIRTIOFS_EMU_LL_NOTIFY_TIMEOUT_USEC) passed. A doorbell puts it back to busy-polling.
+    // Needs a controller with doorbells (only sw_ctrl for now), others back off as above.
+    // Not with elastic, which parks idle threads itself.
+    bool notify;
+    useconds_t notify_timeout_usec;
+    // CPUs to pin the polling threads to, thread i runs on poll_cpus[i % npoll_cpus]
+    // NULL leaves the placement up to the scheduler
+    int *poll_cpus;
+    uint32_t npoll_cpus;
+    // Completion coalescing, the requests that handlers complete through their done_ctx
+    // are queued on the polling thread that received them, which hands them back to the
+    // controller in a batch once coalesce_count have gathered or the oldest has waited
+    // coalesce_usec. Both 0 hands them back at the end of every poll, only a count
+    // bounds the wait by VIRTIOFS_EMU_LL_COALESCE_USEC.
+    bool coalesce_completions;
+    uint32_t coalesce_count;
+    useconds_t coalesce_usec;
+    // Multithreaded mode only, the requests a polling thread harvests can be
+    // dispatched by the other polling threads when they have nothing to do themselves.
+    // Handlers then run on the stealing thread (virtiofs_thread_id_key is its id),
+    // so they must not assume a request stays on the thread of its virtqueue.
+    bool work_stealing;
+    // Poll mmio, suspend the device and handle the signals on the calling thread of
+    // virtiofs_emu_ll_loop, every mgmt_interval_usec (0 = VIRTIOFS_EMU_LL_MGMT_INTERVAL_USEC).
+    // All polling threads, thread 0 included, then only poll io.
+    bool mgmt_thread;
+    useconds_t mgmt_interval_usec;
+    // Scheduler between harvesting and the handlers. READ and WRITE are bulk requests,
+    // everything else is latency sensitive. Each round dispatches up to sched_lat_weight
+    // latency sensitive and sched_bulk_weight bulk requests, and bulk requests wait while
+    // a polling thread has sched_bulk_max_inflight bytes of them in flight.
+    bool sched;
+    uint32_t sched_lat_weight;
+    uint32_t sched_bulk_weight;
+    uint64_t sched_bulk_max_inflight;
+    // QoS limits for every device and for every polling thread (so for the
+    // virtqueues it polls). Requests over a limit wait in the scheduler, which
+    // gets turned on by any limit, they are never rejected.
+    struct virtiofs_emu_qos_limit qos_dev;
+    struct virtiofs_emu_qos_limit qos_thread;
+    // Elastic scaling, multithreaded mode only and it turns on mgmt_thread.
+    // Every polling thread keeps its virtqueues and handler state (virtiofs_thread_id_key),
+    // but between elastic_min_threads (0 = 1) and nthreads OS threads poll them. Every
+    // elastic_interval_usec the management thread retires one when they were busy less than
+    // elastic_shrink_pct of the time, or adds one above elastic_grow_pct or when
+    // VIRTIOFS_EMU_LL_ELASTIC_BACKLOG requests wait in the scheduler or the steal deques.
+    // The virtqueues of a retired thread are polled by the remaining ones, round robin.
+    bool elastic;
+    uint32_t elastic_min_threads;
+    useconds_t elastic_interval_usec;
+    uint32_t elastic_grow_pct;
+    uint32_t elastic_shrink_pct;
+    // Request tracing into a ring of the last trace_entries requests of every polling thread.
+    // trace starts with tracing on, SIGUSR2 toggles it and writes the rings to trace_file
+    // when it goes off, so does the shutdown. Decode the file with experiments/trace.
+    bool trace;
+    uint32_t trace_entries;
+    char *trace_file;
+    // Live restart, take over the device of a previous process instead of resetting it.
+    // The controller recovers the virtqueues where that process suspended them, so the guest
+    // keeps its mount and sends no FUSE_INIT, the FUSE session is restored by the user.
+    bool recover;
+    // Request-age watchdog, run with mmio polling (on thread 0 or the management thread).
+    // Every request that is in flight for longer than watchdog_msec (0 =
+    // VIRTIOFS_EMU_LL_WATCHDOG_MSEC) is logged once with its FUSE unique and opcode,
+    // e.g. an async handler that never calls its done_ctx.
+    uint32_t watchdog_msec;
+    // Use the in-process software controller instead of SNAP, for benchmarking without a DPU.
+    // Its load generator sends FUSE_INIT (not when recover) and then sw_load_requests (0 = until stopped) requests
+    // of sw_load_opcode (FUSE_GETATTR or FUSE_STATFS) on the root, with at most
+    // sw_load_inflight (0 = as many as fit) outstanding per queue.
+    // sw_load_gap_usec pauses the load generator between rounds over the queues.
+    // pf_id, vf_id and emu_manager are not needed in this mode.
+    bool sw_ctrl;
+    uint32_t sw_load_opcode;
+    uint64_t sw_load_requests;
+    uint32_t sw_load_inflight;
+    useconds_t sw_load_gap_usec;
 };
 
 struct virtiofs_emu_ll_params {
     virtiofs_emu_ll_handler_t fuse_handlers[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN];
+    // Optional, an opcode with a burst handler is not given to its fuse_handler
+    virtiofs_emu_ll_burst_handler_t burst_handlers[VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN];
     void *user_data; // Pointer to user data that gets passed with every virtiofs_emu_ll_handler
+    // Optional, how many more requests the backend can take from polling thread thread_id
+    // right now (e.g. free NFS slots and buffers), asked once per poll with the user_data
+    // of every device, the smallest answer counts for all devices of the thread.
+    // While it has no room the thread does not harvest its virtqueues, the requests stay
+    // in the rings so the guest sees the backpressure. Requests that were already
+    // harvested wait in the thread, the handlers are not called for them until there is room.
+    uint32_t (*capacity)(void *user_data, size_t thread_id);
     struct virtiofs_emu_params emu_params;
 };
 
+// Per-opcode request statistics, latency is measured from the moment
+// the handler is called until the request is done
+struct virtiofs_emu_ll_op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t lat_hist[VIRTIOFS_EMU_LL_LAT_BUCKETS];
+};
+
+// In-flight gauges, the requests that were harvested but are not done yet
+// (also the ones waiting in the scheduler), at the time they were looked at.
+// Async requests that got no req (see the untracked stats line) are not in them.
+struct virtiofs_emu_ll_inflight {
+    uint64_t count;
+    uint64_t oldest_ns; // Age of the oldest one, 0 if there are none
+};
+
 extern pthread_key_t virtiofs_thread_id_key;
 
 // Non-user accesible
 struct virtiofs_emu_ll;
 
+// Fills in the defaults of the unset params, can be called multiple times
+void virtiofs_emu_params_fill_defaults(struct virtiofs_emu_params *params);
+
+// Parses a CPU list like "0-3,6,8" into a malloc'ed array
+// returns the number of CPUs or a negative errno
+int virtiofs_emu_parse_cpu_list(const char *list, int **cpus);
+int virtiofs_emu_pin_thread(pthread_t thread, int cpu);
+// Parses "pf_id:vf_id[:tag],..." into a malloc'ed params->devs, a left out tag
+// becomes "<tag>-<index>", returns 0 or a negative errno
+int virtiofs_emu_parse_devs(const char *spec, const char *tag, struct virtiofs_emu_params *params);
+// Parses "dev_iops[:dev_mibps[:thread_iops[:thread_mibps]]]" into the QoS limits
+// of params, returns 0 or a negative errno
+int virtiofs_emu_parse_qos(const char *spec, struct virtiofs_emu_params *params);
+
 struct virtiofs_emu_ll *virtiofs_emu_ll_new(struct virtiofs_emu_ll_params *params);
 void virtiofs_emu_ll_loop(struct virtiofs_emu_ll *emu);
 void virtiofs_emu_ll_destroy(struct virtiofs_emu_ll *emu);
 
+// Merges the statistics of all the polling threads, can be called while they are running
+// stats must have room for VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN entries, indexed by opcode
+void virtiofs_emu_ll_stats(struct virtiofs_emu_ll *emu, struct virtiofs_emu_ll_op_stats *stats);
+// The same for the requests of one device, dev indexes virtiofs_emu_params.devs
+void virtiofs_emu_ll_dev_stats(struct virtiofs_emu_ll *emu, uint32_t dev,
+                               struct virtiofs_emu_ll_op_stats *stats);
+// The in-flight gauges per polling thread (so per virtqueues it polls) and per opcode, of all
+// devices or of one. threads is nthreads (atleast 1) long, ops VIRTIOFS_EMU_LL_FUSE_HANDLERS_LEN,
+// either can be NULL. Can be called while the polling threads are running.
+void virtiofs_emu_ll_inflight(struct virtiofs_emu_ll *emu, struct virtiofs_emu_ll_inflight *threads,
+                              struct virtiofs_emu_ll_inflight *ops);
+void virtiofs_emu_ll_dev_inflight(struct virtiofs_emu_ll *emu, uint32_t dev,
+                                  struct virtiofs_emu_ll_inflight *threads,
+                                  struct virtiofs_emu_ll_inflight *ops);
+// Notifications to the guest (e.g. FUSE_NOTIFY_INVAL_INODE) over the notification virtqueue
+// of device dev. iov is a fuse_out_header with unique 0 and the notify code as error,
+// followed by the payload. It is copied and queued, the thread that polls mmio hands it to
+// the controller once the driver posted a buffer, in order. Thread safe. Returns 0, -ENOTSUP
+// when the controller has no notification queue (SNAP for now), -ENOSPC when
+// VIRTIOFS_EMU_LL_NOTIFICATION_QUEUE are already waiting or -EINVAL.
+int virtiofs_emu_ll_send_notification(struct virtiofs_emu_ll *emu, uint32_t dev,
+                                      const struct iovec *iov, int iovcnt);
+bool virtiofs_emu_ll_notifications_supported(struct virtiofs_emu_ll *emu, uint32_t dev);
+// Returns the upper bound (ns) of the bucket that percentile p (0 < p <= 1) falls in
+uint64_t virtiofs_emu_ll_stats_percentile(const struct virtiofs_emu_ll_op_stats *stats, double p);
+void virtiofs_emu_ll_stats_print(struct virtiofs_emu_ll *emu, FILE *f);
+
+void virtiofs_emu_ll_trace_enable(struct virtiofs_emu_ll *emu, bool on);
+// Writes the trace rings to path, can be called while the polling threads are running
+// returns 0 or a negative errno
+int virtiofs_emu_ll_trace_dump(struct virtiofs_emu_ll *emu, const char *path);
+// Handlers can attach their backend status (e.g. the NFS status) to the trace
+// record of the request, cb being the done_ctx the handler got
+void virtiofs_emu_ll_trace_status(struct snap_fs_dev_io_done_ctx *cb, int32_t status);
+
+// Marks the end of a startup phase, printed with the ms since the first mark of the
+// process, so that should be the start of main. Thread safe, the controller bring-up
+// marks its own phases and the first request that is served.
+void virtiofs_emu_ll_startup_mark(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+// Prints all startup phases so far, virtiofs_emu_ll_stats_print includes them
+void virtiofs_emu_ll_startup_print(FILE *f);
+
 #endif // VIRTIOFS_EMU_LL_H
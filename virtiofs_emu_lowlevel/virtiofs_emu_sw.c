@@ -0,0 +1,662 @@
+/*
+#
+# Copyright 2022- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/fuse.h>
+#include <linux/virtio_ring.h>
+
+#include "virtiofs_emu_sw.h"
+
+#define SW_VQ_ALIGN 4096
+// Every request is a chain of at most 4 descriptors: in_hdr, in_arg, out_hdr, out_arg
+// Request slot s always uses the descriptors starting at s * SW_DESCS_PER_REQ
+#define SW_DESCS_PER_REQ 4
+// The notification virtqueue, a single descriptor per buffer
+#define SW_NOTIFY_DEPTH 64
+#define SW_NOTIFY_BUF_SIZE 4096
+
+// The buffers of one request, these live in the shared memory behind the vring
+struct sw_req_buf {
+    struct fuse_in_header in_hdr;
+    union {
+        struct fuse_init_in init;
+        struct fuse_getattr_in getattr;
+    } in_arg;
+    struct fuse_out_header out_hdr;
+    union {
+        struct fuse_init_out init;
+        struct fuse_attr_out attr;
+        struct fuse_statfs_out statfs;
+    } out_arg;
+};
+
+struct sw_vq;
+
+// Load generators of all the software devices that did not finish yet
+static atomic_uint sw_load_running;
+
+// The device side of a request that is being handled
+struct sw_dev_req {
+    struct snap_fs_dev_io_done_ctx done_ctx;
+    struct sw_vq *vq;
+    uint16_t head;
+    int in_iovcnt;
+    int out_iovcnt;
+    struct iovec iov[SW_DESCS_PER_REQ];
+};
+
+struct sw_vq {
+    struct virtiofs_emu_sw *sw;
+    struct vring vr;
+    void *mem;
+    size_t mem_len;
+    struct sw_req_buf *bufs;
+    uint32_t nslots;
+
+    // Device side
+    uint16_t last_avail_idx; // Only touched by the polling thread of this queue
+    pthread_spinlock_t used_lock; // Requests can be completed from any thread
+    struct sw_dev_req *dev_reqs; // Indexed by descriptor head
+
+    uint32_t thread; // The polling thread of this queue
+
+    // Driver side, only touched by the load generator
+    uint16_t avail_idx;
+    uint16_t last_used_idx;
+    uint32_t *free_slots;
+    uint32_t nfree;
+    // When the request in a slot was submitted and if it needed a doorbell,
+    // the device sets when it was done before it puts it on the used ring
+    uint64_t *slot_ns;
+    bool *slot_kicked;
+    uint64_t *slot_done_ns;
+};
+
+// Notifications go from the device to the driver, the other way around than requests
+struct sw_notify_vq {
+    struct vring vr;
+    void *mem;
+    size_t mem_len;
+    char *bufs;
+    uint16_t last_avail_idx; // Device side
+    // Driver side, only touched by the load generator
+    uint16_t avail_idx;
+    uint16_t last_used_idx;
+};
+
+struct virtiofs_emu_sw {
+    struct virtiofs_emu_sw_attr attr;
+    struct sw_vq *vqs;
+    struct sw_notify_vq nvq;
+    // Doorbell of every polling thread
+    int *notify_fds;
+    uint32_t nthreads;
+
+    volatile bool suspended;
+    atomic_int inflight; // Requests the device is handling
+
+    // Load generator
+    pthread_t load_thread;
+    bool load_thread_running;
+    volatile bool load_stop;
+    bool init_done;
+    uint64_t unique;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t busy;
+    // Round trips of the requests that found the device polling and that rang its doorbell
+    uint64_t polled_reqs;
+    uint64_t polled_ns;
+    uint64_t kicked_reqs;
+    uint64_t kicked_ns;
+    // Notifications the driver got per notify code, the last counts the malformed ones
+    uint64_t notified[FUSE_NOTIFY_CODE_MAX + 1];
+};
+
+static uint64_t sw_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int sw_vq_init(struct virtiofs_emu_sw *sw, struct sw_vq *vq, uint32_t depth, uint32_t thread)
+{
+    size_t ring_len = (vring_size(depth, SW_VQ_ALIGN) + SW_VQ_ALIGN - 1) & ~(SW_VQ_ALIGN - 1);
+
+    vq->sw = sw;
+    vq->nslots = depth / SW_DESCS_PER_REQ;
+    vq->mem_len = ring_len + vq->nslots * sizeof(struct sw_req_buf);
+    // Shared, just like the memory of a real virtqueue
+    vq->mem = mmap(NULL, vq->mem_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (vq->mem == MAP_FAILED) {
+        vq->mem = NULL;
+        return -ENOMEM;
+    }
+    vring_init(&vq->vr, depth, vq->mem, SW_VQ_ALIGN);
+    vq->bufs = (struct sw_req_buf *) ((char *) vq->mem + ring_len);
+    // The device polls until it asks for doorbells
+    vq->vr.used->flags = VRING_USED_F_NO_NOTIFY;
+    vq->thread = thread;
+
+    vq->dev_reqs = calloc(depth, sizeof(struct sw_dev_req));
+    vq->free_slots = calloc(vq->nslots, sizeof(uint32_t));
+    vq->slot_ns = calloc(vq->nslots, sizeof(uint64_t));
+    vq->slot_kicked = calloc(vq->nslots, sizeof(bool));
+    vq->slot_done_ns = calloc(vq->nslots, sizeof(uint64_t));
+    if (!vq->dev_reqs || !vq->free_slots || !vq->slot_ns || !vq->slot_kicked || !vq->slot_done_ns)
+        return -ENOMEM;
+    for (uint32_t i = 0; i < vq->nslots; i++)
+        vq->free_slots[vq->nfree++] = vq->nslots - i - 1;
+
+    pthread_spin_init(&vq->used_lock, PTHREAD_PROCESS_PRIVATE);
+    return 0;
+}
+
+static int sw_notify_vq_init(struct sw_notify_vq *nvq)
+{
+    size_t ring_len = (vring_size(SW_NOTIFY_DEPTH, SW_VQ_ALIGN) + SW_VQ_ALIGN - 1) & ~(SW_VQ_ALIGN - 1);
+
+    nvq->mem_len = ring_len + SW_NOTIFY_DEPTH * SW_NOTIFY_BUF_SIZE;
+    nvq->mem = mmap(NULL, nvq->mem_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (nvq->mem == MAP_FAILED) {
+        nvq->mem = NULL;
+        return -ENOMEM;
+    }
+    vring_init(&nvq->vr, SW_NOTIFY_DEPTH, nvq->mem, SW_VQ_ALIGN);
+    nvq->bufs = (char *) nvq->mem + ring_len;
+    // The driver never waits for notifications
+    nvq->vr.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    return 0;
+}
+
+static void sw_vq_destroy(struct sw_vq *vq)
+{
+    if (vq->mem)
+        munmap(vq->mem, vq->mem_len);
+    free(vq->dev_reqs);
+    free(vq->free_slots);
+    free(vq->slot_ns);
+    free(vq->slot_kicked);
+    free(vq->slot_done_ns);
+    pthread_spin_destroy(&vq->used_lock);
+}
+
+/*
+ * Device side
+ */
+
+// Can be called from any thread
+static void sw_req_done(enum snap_fs_dev_op_status status, void *arg)
+{
+    struct sw_dev_req *req = arg;
+    struct sw_vq *vq = req->vq;
+    struct virtiofs_emu_sw *sw = vq->sw;
+    uint16_t num = vq->vr.num;
+
+    uint32_t len = 0;
+    if (status == SNAP_FS_DEV_OP_SUCCESS && req->out_iovcnt > 0)
+        len = ((struct fuse_out_header *) req->iov[req->in_iovcnt].iov_base)->len;
+    vq->slot_done_ns[req->head / SW_DESCS_PER_REQ] = sw_now_ns();
+
+    pthread_spin_lock(&vq->used_lock);
+    uint16_t idx = vq->vr.used->idx;
+    vq->vr.used->ring[idx & (num - 1)].id = req->head;
+    vq->vr.used->ring[idx & (num - 1)].len = len;
+    __atomic_store_n(&vq->vr.used->idx, idx + 1, __ATOMIC_RELEASE);
+    pthread_spin_unlock(&vq->used_lock);
+
+    atomic_fetch_sub_explicit(&sw->inflight, 1, memory_order_release);
+}
+
+static void sw_handle_req(struct virtiofs_emu_sw *sw, struct sw_vq *vq, uint16_t head)
+{
+    struct sw_dev_req *req = &vq->dev_reqs[head];
+    int n = 0;
+    int in_iovcnt = 0;
+
+    // The device-readable descriptors always come before the device-writable ones
+    for (uint16_t d = head; n < SW_DESCS_PER_REQ; d = vq->vr.desc[d].next) {
+        struct vring_desc *desc = &vq->vr.desc[d];
+        req->iov[n].iov_base = (void *) (uintptr_t) desc->addr;
+        req->iov[n].iov_len = desc->len;
+        n++;
+        if (!(desc->flags & VRING_DESC_F_WRITE))
+            in_iovcnt++;
+        if (!(desc->flags & VRING_DESC_F_NEXT))
+            break;
+    }
+    req->vq = vq;
+    req->head = head;
+    req->in_iovcnt = in_iovcnt;
+    req->out_iovcnt = n - in_iovcnt;
+    req->done_ctx.cb = sw_req_done;
+    req->done_ctx.user_arg = req;
+
+    atomic_fetch_add_explicit(&sw->inflight, 1, memory_order_relaxed);
+    int ret = sw->attr.handle_req(sw->attr.handle_req_arg, req->iov, req->in_iovcnt,
+                                  req->iov + req->in_iovcnt, req->out_iovcnt, &req->done_ctx);
+    if (ret != EWOULDBLOCK)
+        sw_req_done(ret ? SNAP_FS_DEV_OP_IO_ERROR : SNAP_FS_DEV_OP_SUCCESS, req);
+}
+
+int virtiofs_emu_sw_progress_io(struct virtiofs_emu_sw *sw, int thread_id)
+{
+    int handled = 0;
+
+    if (sw->suspended)
+        return 0;
+
+    for (uint32_t q = thread_id; q < sw->attr.num_queues; q += sw->nthreads) {
+        struct sw_vq *vq = &sw->vqs[q];
+        uint16_t avail_idx = __atomic_load_n(&vq->vr.avail->idx, __ATOMIC_ACQUIRE);
+        while (vq->last_avail_idx != avail_idx) {
+            uint16_t head = vq->vr.avail->ring[vq->last_avail_idx & (vq->vr.num - 1)];
+            vq->last_avail_idx++;
+            sw_handle_req(sw, vq, head);
+            handled++;
+        }
+    }
+    return handled;
+}
+
+void virtiofs_emu_sw_progress(struct virtiofs_emu_sw *sw)
+{
+}
+
+int virtiofs_emu_sw_send_notification(struct virtiofs_emu_sw *sw, const struct iovec *iov, int iovcnt)
+{
+    struct sw_notify_vq *nvq = &sw->nvq;
+    uint16_t num = nvq->vr.num;
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len > SW_NOTIFY_BUF_SIZE)
+        return -EMSGSIZE;
+
+    uint16_t avail_idx = __atomic_load_n(&nvq->vr.avail->idx, __ATOMIC_ACQUIRE);
+    if (nvq->last_avail_idx == avail_idx)
+        return -EAGAIN;
+    uint16_t head = nvq->vr.avail->ring[nvq->last_avail_idx & (num - 1)];
+    nvq->last_avail_idx++;
+
+    struct vring_desc *desc = &nvq->vr.desc[head];
+    char *p = (char *) (uintptr_t) desc->addr;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    uint16_t idx = nvq->vr.used->idx;
+    nvq->vr.used->ring[idx & (num - 1)].id = head;
+    nvq->vr.used->ring[idx & (num - 1)].len = len;
+    __atomic_store_n(&nvq->vr.used->idx, idx + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int virtiofs_emu_sw_notify_fd(struct virtiofs_emu_sw *sw, int thread_id)
+{
+    return sw->notify_fds[thread_id];
+}
+
+bool virtiofs_emu_sw_notify_enable(struct virtiofs_emu_sw *sw, int thread_id, bool on)
+{
+    bool pending = false;
+
+    for (uint32_t q = thread_id; q < sw->attr.num_queues; q += sw->nthreads) {
+        struct sw_vq *vq = &sw->vqs[q];
+        __atomic_store_n(&vq->vr.used->flags, on ? 0 : VRING_USED_F_NO_NOTIFY, __ATOMIC_RELAXED);
+    }
+    if (!on)
+        return false;
+
+    // Pairs with the fence in sw_load_kick, either the driver sees the flag
+    // or we see its request
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (uint32_t q = thread_id; q < sw->attr.num_queues; q += sw->nthreads) {
+        struct sw_vq *vq = &sw->vqs[q];
+        pending |= __atomic_load_n(&vq->vr.avail->idx, __ATOMIC_ACQUIRE) != vq->last_avail_idx;
+    }
+    return pending;
+}
+
+/*
+ * Driver side, i.e. the load generator
+ */
+
+static void sw_desc_set(struct vring_desc *desc, void *addr, uint32_t len, uint16_t flags)
+{
+    desc->addr = (uintptr_t) addr;
+    desc->len = len;
+    desc->flags = flags;
+}
+
+// Rings the doorbell of the polling thread of vq when it asked for it, returns true if it did
+static bool sw_load_kick(struct virtiofs_emu_sw *sw, struct sw_vq *vq)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&vq->vr.used->flags, __ATOMIC_RELAXED) & VRING_USED_F_NO_NOTIFY)
+        return false;
+
+    uint64_t one = 1;
+    if (write(sw->notify_fds[vq->thread], &one, sizeof(one)) != sizeof(one))
+        perror("virtiofs_emu_sw: doorbell");
+    return true;
+}
+
+static void sw_load_submit(struct virtiofs_emu_sw *sw, struct sw_vq *vq, uint32_t opcode)
+{
+    uint32_t slot = vq->free_slots[--vq->nfree];
+    struct sw_req_buf *buf = &vq->bufs[slot];
+    struct vring_desc *desc = vq->vr.desc;
+    uint16_t head = slot * SW_DESCS_PER_REQ;
+    uint32_t in_arg_len = 0;
+    uint32_t out_arg_len = 0;
+
+    memset(buf, 0, sizeof(*buf));
+    switch (opcode) {
+        case FUSE_INIT:
+            buf->in_arg.init.major = FUSE_KERNEL_VERSION;
+            buf->in_arg.init.minor = FUSE_KERNEL_MINOR_VERSION;
+            buf->in_arg.init.max_readahead = 128 * 1024;
+            in_arg_len = sizeof(buf->in_arg.init);
+            out_arg_len = sizeof(buf->out_arg.init);
+            break;
+        case FUSE_GETATTR:
+            in_arg_len = sizeof(buf->in_arg.getattr);
+            out_arg_len = sizeof(buf->out_arg.attr);
+            break;
+        case FUSE_STATFS:
+            out_arg_len = sizeof(buf->out_arg.statfs);
+            break;
+    }
+    buf->in_hdr.len = sizeof(buf->in_hdr) + in_arg_len;
+    buf->in_hdr.opcode = opcode;
+    buf->in_hdr.unique = ++sw->unique;
+    buf->in_hdr.nodeid = FUSE_ROOT_ID;
+
+    uint16_t d = head;
+    sw_desc_set(&desc[d], &buf->in_hdr, sizeof(buf->in_hdr), VRING_DESC_F_NEXT);
+    if (in_arg_len) {
+        desc[d].next = head + 1;
+        d = head + 1;
+        sw_desc_set(&desc[d], &buf->in_arg, in_arg_len, VRING_DESC_F_NEXT);
+    }
+    desc[d].next = head + 2;
+    sw_desc_set(&desc[head + 2], &buf->out_hdr, sizeof(buf->out_hdr),
+                VRING_DESC_F_WRITE | VRING_DESC_F_NEXT);
+    desc[head + 2].next = head + 3;
+    sw_desc_set(&desc[head + 3], &buf->out_arg, out_arg_len, VRING_DESC_F_WRITE);
+
+    vq->vr.avail->ring[vq->avail_idx & (vq->vr.num - 1)] = head;
+    vq->avail_idx++;
+    vq->slot_ns[slot] = sw_now_ns();
+    __atomic_store_n(&vq->vr.avail->idx, vq->avail_idx, __ATOMIC_RELEASE);
+    vq->slot_kicked[slot] = sw_load_kick(sw, vq);
+}
+
+// Hands buffer d (again) to the device
+static void sw_load_notify_post(struct sw_notify_vq *nvq, uint16_t d)
+{
+    sw_desc_set(&nvq->vr.desc[d], nvq->bufs + d * SW_NOTIFY_BUF_SIZE, SW_NOTIFY_BUF_SIZE,
+                VRING_DESC_F_WRITE);
+    nvq->vr.avail->ring[nvq->avail_idx & (nvq->vr.num - 1)] = d;
+    nvq->avail_idx++;
+    __atomic_store_n(&nvq->vr.avail->idx, nvq->avail_idx, __ATOMIC_RELEASE);
+}
+
+// Counts the notifications the device wrote and posts their buffers again
+static void sw_load_notify_reap(struct virtiofs_emu_sw *sw)
+{
+    struct sw_notify_vq *nvq = &sw->nvq;
+    uint16_t used_idx = __atomic_load_n(&nvq->vr.used->idx, __ATOMIC_ACQUIRE);
+
+    while (nvq->last_used_idx != used_idx) {
+        struct vring_used_elem *e = &nvq->vr.used->ring[nvq->last_used_idx & (nvq->vr.num - 1)];
+        nvq->last_used_idx++;
+        struct fuse_out_header *hdr = (struct fuse_out_header *) (nvq->bufs + e->id * SW_NOTIFY_BUF_SIZE);
+        if (e->len < sizeof(*hdr) || hdr->len != e->len || hdr->unique != 0 ||
+            hdr->error <= 0 || hdr->error >= FUSE_NOTIFY_CODE_MAX)
+            sw->notified[FUSE_NOTIFY_CODE_MAX]++;
+        else
+            sw->notified[hdr->error]++;
+        sw_load_notify_post(nvq, e->id);
+    }
+}
+
+// Returns true if one of the requests has to be retried because the filesystem was not ready
+static bool sw_load_reap(struct virtiofs_emu_sw *sw, struct sw_vq *vq, struct timespec *start)
+{
+    uint16_t used_idx = __atomic_load_n(&vq->vr.used->idx, __ATOMIC_ACQUIRE);
+    bool busy = false;
+
+    while (vq->last_used_idx != used_idx) {
+        struct vring_used_elem *e = &vq->vr.used->ring[vq->last_used_idx & (vq->vr.num - 1)];
+        vq->last_used_idx++;
+        uint32_t slot = e->id / SW_DESCS_PER_REQ;
+        struct sw_req_buf *buf = &vq->bufs[slot];
+        vq->free_slots[vq->nfree++] = slot;
+
+        bool failed = e->len == 0 || buf->out_hdr.error != 0;
+        if (buf->in_hdr.opcode == FUSE_INIT) {
+            if (failed) {
+                fprintf(stderr, "virtiofs_emu_sw: FUSE_INIT failed (error=%d), stopping the load\n",
+                        buf->out_hdr.error);
+                sw->load_stop = true;
+            } else {
+                sw->init_done = true;
+                clock_gettime(CLOCK_MONOTONIC, start);
+            }
+            continue;
+        }
+        // E.g. virtionfs is still connecting to the NFS server
+        if (e->len != 0 && buf->out_hdr.error == -EBUSY) {
+            sw->busy++;
+            sw->submitted--;
+            busy = true;
+            continue;
+        }
+        sw->completed++;
+        if (failed)
+            sw->errors++;
+        uint64_t rtt = vq->slot_done_ns[slot] - vq->slot_ns[slot];
+        if (vq->slot_kicked[slot]) {
+            sw->kicked_reqs++;
+            sw->kicked_ns += rtt;
+        } else {
+            sw->polled_reqs++;
+            sw->polled_ns += rtt;
+        }
+    }
+    return busy;
+}
+
+static void *sw_load_thread(void *arg)
+{
+    struct virtiofs_emu_sw *sw = arg;
+    struct virtiofs_emu_sw_attr *attr = &sw->attr;
+    uint32_t inflight = sw->vqs[0].nslots;
+    if (attr->load_inflight && attr->load_inflight < inflight)
+        inflight = attr->load_inflight;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint16_t d = 0; d < sw->nvq.vr.num; d++)
+        sw_load_notify_post(&sw->nvq, d);
+
+    // Every other request waits for the reply of FUSE_INIT
+    if (attr->recover)
+        sw->init_done = true;
+    else
+        sw_load_submit(sw, &sw->vqs[0], FUSE_INIT);
+
+    while (!sw->load_stop) {
+        if (attr->load_requests && sw->completed >= attr->load_requests)
+            break;
+
+        bool busy = false;
+        uint64_t submitted = sw->submitted;
+        sw_load_notify_reap(sw);
+        for (uint32_t q = 0; q < attr->num_queues; q++) {
+            struct sw_vq *vq = &sw->vqs[q];
+            busy |= sw_load_reap(sw, vq, &start);
+
+            while (sw->init_done && vq->nslots - vq->nfree < inflight &&
+                   (!attr->load_requests || sw->submitted < attr->load_requests)) {
+                sw_load_submit(sw, vq, attr->load_opcode);
+                sw->submitted++;
+            }
+        }
+        if (busy)
+            usleep(1000);
+        else if (attr->load_gap_usec)
+            usleep(attr->load_gap_usec);
+        else if (sw->submitted == submitted)
+            // Everything is in flight, give the pollers the core if we share it
+            sched_yield();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sw_load_notify_reap(sw);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("virtiofs_emu_sw: %lu requests of OP %u (%lu errors) in %.3fs: %.0f requests/s,"
+           " %lu retried because the filesystem was busy\n",
+           sw->completed, attr->load_opcode, sw->errors, secs,
+           secs > 0 ? sw->completed / secs : 0.0, sw->busy);
+    if (sw->kicked_reqs)
+        printf("virtiofs_emu_sw: submit to done %.1f us for %lu requests that found the device polling,"
+               " %.1f us for %lu that rang its doorbell\n",
+               sw->polled_reqs ? sw->polled_ns / 1e3 / sw->polled_reqs : 0.0, sw->polled_reqs,
+               sw->kicked_ns / 1e3 / sw->kicked_reqs, sw->kicked_reqs);
+    uint64_t notified = 0;
+    for (int c = 0; c <= FUSE_NOTIFY_CODE_MAX; c++)
+        notified += sw->notified[c];
+    if (notified)
+        printf("virtiofs_emu_sw: %lu notifications: %lu INVAL_INODE, %lu INVAL_ENTRY, %lu DELETE,"
+               " %lu other and %lu malformed\n", notified, sw->notified[FUSE_NOTIFY_INVAL_INODE],
+               sw->notified[FUSE_NOTIFY_INVAL_ENTRY], sw->notified[FUSE_NOTIFY_DELETE],
+               notified - sw->notified[FUSE_NOTIFY_INVAL_INODE] - sw->notified[FUSE_NOTIFY_INVAL_ENTRY] -
+               sw->notified[FUSE_NOTIFY_DELETE] - sw->notified[FUSE_NOTIFY_CODE_MAX],
+               sw->notified[FUSE_NOTIFY_CODE_MAX]);
+
+    // Done, let the emulation loop shut down the same way as on ctrl-c,
+    // once the load generators of the other devices are done too
+    bool last = atomic_fetch_sub(&sw_load_running, 1) == 1;
+    if (attr->load_requests && sw->completed >= attr->load_requests && last)
+        kill(getpid(), SIGTERM);
+
+    return NULL;
+}
+
+void virtiofs_emu_sw_suspend(struct virtiofs_emu_sw *sw)
+{
+    sw->suspended = true;
+    sw->load_stop = true;
+}
+
+bool virtiofs_emu_sw_is_suspended(struct virtiofs_emu_sw *sw)
+{
+    return sw->suspended && atomic_load_explicit(&sw->inflight, memory_order_acquire) == 0;
+}
+
+struct virtiofs_emu_sw *virtiofs_emu_sw_init(const struct virtiofs_emu_sw_attr *attr)
+{
+    if (attr->queue_depth < SW_DESCS_PER_REQ || attr->queue_depth > 32768 ||
+        (attr->queue_depth & (attr->queue_depth - 1))) {
+        fprintf(stderr, "virtiofs_emu_sw: queue_depth must be a power of 2 between %u and 32768\n",
+                SW_DESCS_PER_REQ);
+        return NULL;
+    }
+    if (attr->load_opcode != FUSE_GETATTR && attr->load_opcode != FUSE_STATFS) {
+        fprintf(stderr, "virtiofs_emu_sw: only FUSE_GETATTR and FUSE_STATFS load is supported\n");
+        return NULL;
+    }
+
+    struct virtiofs_emu_sw *sw = calloc(1, sizeof(struct virtiofs_emu_sw));
+    if (!sw)
+        return NULL;
+    sw->attr = *attr;
+    sw->nthreads = attr->nthreads > 1 ? attr->nthreads : 1;
+
+    sw->notify_fds = malloc(sw->nthreads * sizeof(int));
+    if (!sw->notify_fds)
+        goto err;
+    for (uint32_t t = 0; t < sw->nthreads; t++)
+        sw->notify_fds[t] = -1;
+    for (uint32_t t = 0; t < sw->nthreads; t++) {
+        sw->notify_fds[t] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (sw->notify_fds[t] < 0) {
+            perror("virtiofs_emu_sw: eventfd");
+            goto err;
+        }
+    }
+
+    if (sw_notify_vq_init(&sw->nvq)) {
+        fprintf(stderr, "virtiofs_emu_sw: failed to allocate the notification virtqueue\n");
+        goto err;
+    }
+
+    sw->vqs = calloc(attr->num_queues, sizeof(struct sw_vq));
+    if (!sw->vqs)
+        goto err;
+    for (uint32_t q = 0; q < attr->num_queues; q++) {
+        if (sw_vq_init(sw, &sw->vqs[q], attr->queue_depth, q % sw->nthreads)) {
+            fprintf(stderr, "virtiofs_emu_sw: failed to allocate virtqueue %u\n", q);
+            goto err;
+        }
+    }
+
+    atomic_fetch_add(&sw_load_running, 1);
+    if (pthread_create(&sw->load_thread, NULL, sw_load_thread, sw)) {
+        atomic_fetch_sub(&sw_load_running, 1);
+        fprintf(stderr, "virtiofs_emu_sw: failed to start the load generator\n");
+        goto err;
+    }
+    sw->load_thread_running = true;
+
+    return sw;
+err:
+    virtiofs_emu_sw_destroy(sw);
+    return NULL;
+}
+
+void virtiofs_emu_sw_destroy(struct virtiofs_emu_sw *sw)
+{
+    if (sw->load_thread_running) {
+        sw->load_stop = true;
+        pthread_join(sw->load_thread, NULL);
+    }
+    if (sw->vqs) {
+        for (uint32_t q = 0; q < sw->attr.num_queues; q++)
+            sw_vq_destroy(&sw->vqs[q]);
+    }
+    free(sw->vqs);
+    if (sw->nvq.mem)
+        munmap(sw->nvq.mem, sw->nvq.mem_len);
+    if (sw->notify_fds) {
+        for (uint32_t t = 0; t < sw->nthreads; t++) {
+            if (sw->notify_fds[t] >= 0)
+                close(sw->notify_fds[t]);
+        }
+    }
+    free(sw->notify_fds);
+    free(sw);
+}
@@ -0,0 +1,71 @@
+/*
+#
+# Copyright 2022- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef VIRTIOFS_EMU_SW_H
+#define VIRTIOFS_EMU_SW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "virtio_fs_controller.h"
+
+/*
+ * A software stand-in for the SNAP virtio_fs_ctrl, so that everything above
+ * virtiofs_emu_ll can run and be benchmarked without a DPU.
+ * The requests travel over split vrings in shared memory, like they would from the host,
+ * and are produced by a load generator thread that plays the virtiofs driver.
+ */
+
+// Same contract as virtiofs_emu_handle_req of SNAP
+typedef int (*virtiofs_emu_sw_handle_req_t) (void *arg,
+                            struct iovec *fuse_in_iov, int in_iovcnt,
+                            struct iovec *fuse_out_iov, int out_iovcnt,
+                            struct snap_fs_dev_io_done_ctx *done_ctx);
+
+struct virtiofs_emu_sw_attr {
+    uint32_t num_queues;
+    uint32_t queue_depth; // Power of 2
+    // Queue q is polled by thread q % nthreads
+    uint32_t nthreads;
+    virtiofs_emu_sw_handle_req_t handle_req;
+    void *handle_req_arg;
+
+    // The load generator, sends FUSE_INIT and then load_requests (0 = until suspended)
+    // requests of load_opcode (FUSE_GETATTR or FUSE_STATFS) for the root
+    uint32_t load_opcode;
+    uint64_t load_requests;
+    uint32_t load_inflight; // Per queue, 0 = as many as fit
+    useconds_t load_gap_usec; // Pause between two rounds over the queues, for a light load
+    bool recover; // The guest already did FUSE_INIT with a previous process, skip it
+};
+
+struct virtiofs_emu_sw;
+
+struct virtiofs_emu_sw *virtiofs_emu_sw_init(const struct virtiofs_emu_sw_attr *attr);
+void virtiofs_emu_sw_destroy(struct virtiofs_emu_sw *sw);
+// Nothing to do, there is no management io in software
+void virtiofs_emu_sw_progress(struct virtiofs_emu_sw *sw);
+// Returns the number of requests that were handed to handle_req
+int virtiofs_emu_sw_progress_io(struct virtiofs_emu_sw *sw, int thread_id);
+// Stops the load generator, suspended once all the requests are done
+void virtiofs_emu_sw_suspend(struct virtiofs_emu_sw *sw);
+bool virtiofs_emu_sw_is_suspended(struct virtiofs_emu_sw *sw);
+// Doorbells, like the kick eventfds of vhost. The eventfd of a polling thread is written
+// when the driver adds a request to one of its queues while their notifications are on
+// (they start off, VRING_USED_F_NO_NOTIFY). Turning them on returns true when requests
+// came in that progress_io did not see yet, then the thread should not wait for the eventfd.
+int virtiofs_emu_sw_notify_fd(struct virtiofs_emu_sw *sw, int thread_id);
+bool virtiofs_emu_sw_notify_enable(struct virtiofs_emu_sw *sw, int thread_id, bool on);
+// The notification virtqueue (VIRTIO_FS_F_NOTIFICATION), which the load generator keeps
+// filled with empty buffers. Copies a notification into the next one, by one thread at a time.
+// Returns 0, -EAGAIN when the driver has no buffer posted right now or -EMSGSIZE.
+// The load generator counts what it gets per notify code and prints that when it is done.
+int virtiofs_emu_sw_send_notification(struct virtiofs_emu_sw *sw, const struct iovec *iov, int iovcnt);
+
+#endif // VIRTIOFS_EMU_SW_H
@@ -0,0 +1,50 @@
+/*
+#
+# Copyright 2022- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef VIRTIOFS_EMU_TRACE_H
+#define VIRTIOFS_EMU_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * The request trace file of virtiofs_emu_ll, see virtiofs_emu_ll_trace_dump().
+ * It is a virtiofs_emu_trace_hdr followed by virtiofs_emu_trace_recs until the end
+ * of the file, in host byte order. Only depends on stdint.h so that offline tools
+ * can decode it without SNAP.
+ */
+
+#define VIRTIOFS_EMU_TRACE_MAGIC "VFSTRACE"
+#define VIRTIOFS_EMU_TRACE_VERSION 1
+
+struct virtiofs_emu_trace_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+    uint32_t nthreads;
+    uint32_t reserved;
+};
+
+// One request, the timestamps are CLOCK_MONOTONIC ns and 0 when the stage was not seen
+struct virtiofs_emu_trace_rec {
+    uint64_t unique;
+    uint64_t nodeid;
+    uint64_t t_harvest;  // Handed to virtiofs_emu_ll by the controller
+    uint64_t t_dispatch; // Handed to the handler, after scheduling, stealing or bursting
+    uint64_t t_done;     // Completed by the handler
+    uint64_t t_publish;  // Handed back to the controller, after completion coalescing
+    uint32_t opcode;
+    uint32_t size;       // READ/WRITE payload, 0 for everything else
+    int32_t error;       // FUSE error of the reply
+    int32_t backend_status; // e.g. the NFS status, see virtiofs_emu_ll_trace_status()
+    uint16_t thread;     // The polling thread that harvested it, which polls its virtqueue
+    uint16_t exec_thread; // The thread that dispatched it
+    uint32_t seq;        // Internal, to skip records that were being written during the dump
+};
+
+_Static_assert(sizeof(struct virtiofs_emu_trace_rec) == 72, "the trace record layout is the file format");
+
+#endif // VIRTIOFS_EMU_TRACE_H
@@ -31,6 +31,9 @@ void usage()
 
 int main(int argc, char **argv)
 {
+    // Everything in the startup profile is relative to this
+    virtiofs_emu_ll_startup_mark("main");
+
     int pf = -1;
     int vf = -1;
     char *emu_manager = NULL; // the rdma device name which supports being an emulation manager and virtio_fs emu
@@ -158,7 +158,8 @@ static void maximize_fd_limit() {
         warn("WARNING: setrlimit() failed with");
 }
 
-int fuser_main(bool debug, char *source, bool cached, struct virtiofs_emu_params *emu_params) {
+int fuser_main(bool debug, char *source, bool cached, const struct fuse_ll_direct_io *direct_io,
+               struct virtiofs_emu_params *emu_params) {
     struct fuser *f = calloc(1, sizeof(struct fuser));
     if (f == NULL)
         err(1, "ERROR: Could not allocate memory for struct fuser");
@@ -166,6 +167,8 @@ int fuser_main(bool debug, char *source, bool cached, struct virtiofs_emu_params
     f->debug = debug;
     f->source = strdup(source);
     f->timeout = cached ? 84600.0 : 0; // 24 hours
+    if (direct_io)
+        f->direct_io = *direct_io;
 
     struct stat s;
     int ret = lstat(f->source, &s);
@@ -199,5 +202,8 @@ int fuser_main(bool debug, char *source, bool cached, struct virtiofs_emu_params
 
     virtiofs_emu_fuse_ll_main(&ops, emu_params, f, debug);
 
+    fuse_ll_direct_io_free(&f->direct_io);
+    free(f);
+
     return 0;
 }
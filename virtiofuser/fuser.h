@@ -30,6 +30,10 @@ struct inode {
     int generation;
     uint64_t nopen;
     uint64_t nlookup;
+    // The file at the last open, to keep the guest's page cache when it did not change
+    struct timespec open_ctime;
+    off_t open_size;
+    bool direct_io_name; // The name matched a direct_io pattern at lookup
     pthread_mutex_t m;
 
     struct inode *next;
@@ -70,13 +74,16 @@ struct fuser {
     char *source;
     // size_t blocksize;
     dev_t src_dev; // gets set to the dev of the source
+    // Files opened with FOPEN_DIRECT_IO
+    struct fuse_ll_direct_io direct_io;
     // bool nocache;
 };
 
 struct inode *ino_to_inodeptr(struct fuser *, fuse_ino_t);
 int ino_to_fd(struct fuser *, fuse_ino_t);
 
-int fuser_main(bool debug, char *source, bool cached,
+// direct_io (NULL for none) is taken over
+int fuser_main(bool debug, char *source, bool cached, const struct fuse_ll_direct_io *direct_io,
                struct virtiofs_emu_params *emu_params);
 
 #endif // FUSER_H
\ No newline at end of file
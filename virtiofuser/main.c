@@ -11,18 +11,56 @@
 
 void usage()
 {
-    printf("virtiofuser [-p pf_id] [-v vf_id ] [-e emulation_manager_name] [-d dir_mirror_path]\n");
+    printf("virtiofuser [-p pf_id] [-v vf_id ] [-e emulation_manager_name] [-d dir_mirror_path]\n"
+           "          [-n num_queues] [-q queue_depth] [-b max_background] [-c poll_cpu_list]\n"
+           "          [-k coalesce_count[,usec]] [-m] [-P bulk_inflight_kib]\n"
+           "          [-Q dev_iops[:dev_mibps[:thread_iops[:thread_mibps]]]] [-T trace_file] [-w sw_load_requests]\n"
+           "          [-O direct_io_mib[,pattern,...]]\n"
+           "-w runs on an in-process software virtio-fs device with a FUSE_GETATTR load instead of the DPU,\n"
+           "it stops after sw_load_requests requests (0 runs until stopped) and -p/-e are not needed\n"
+           "-k hands completions back to the host in batches of coalesce_count, or after usec\n"
+           "-m moves mmio polling and signal handling off the pollers onto the main thread\n"
+           "-P dispatches metadata before READ/WRITE and caps the READ/WRITE bytes in flight (0 = 4096)\n"
+           "-Q limits the requests and READ/WRITE MiB per second of the device and of every poller, 0 = no limit\n"
+           "-T traces every request from the start into trace_file, SIGUSR2 toggles tracing (default file %s)\n"
+           "-O opens files of at least direct_io_mib MiB (0 = no limit) or whose name matches one of the\n"
+           "patterns with direct io, bypassing the guest's page cache, e.g. -O 1024,*.mp4,*.ckpt\n",
+           VIRTIOFS_EMU_LL_TRACE_FILE);
 }
 
 int main(int argc, char **argv)
 {
+    // Everything in the startup profile is relative to this
+    virtiofs_emu_ll_startup_mark("main");
+
     int pf = -1;
     int vf = -1;
     char *emu_manager = NULL; // the rdma device name which supports being an emulation manager and virtio_fs emu
     char *dir = NULL; // the directory that will be mirrored
+    // 0 means the default virtqueue shape
+    uint32_t num_queues = 0;
+    uint32_t queue_depth = 0;
+    uint32_t max_background = 0;
+    // NULL means no pinning
+    int *poll_cpus = NULL;
+    int npoll_cpus = 0;
+    // Completion coalescing, off by default
+    bool coalesce = false;
+    uint32_t coalesce_count = 0;
+    uint32_t coalesce_usec = 0;
+    bool mgmt_thread = false;
+    // Priority scheduling of metadata over data, off by default
+    bool sched = false;
+    uint64_t sched_bulk_inflight_kib = 0;
+    char *qos = NULL;
+    char *trace_file = NULL;
+    // Software virtio-fs device instead of the DPU
+    bool sw_ctrl = false;
+    uint64_t sw_load_requests = 0;
+    struct fuse_ll_direct_io direct_io = { 0 };
 
     int opt;
-    while ((opt = getopt(argc, argv, "p:v:e:d:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:v:e:d:n:q:b:c:k:mP:Q:T:w:O:")) != -1) {
         switch (opt) {
             case 'p':
                 pf = atoi(optarg);
@@ -36,6 +74,54 @@ int main(int argc, char **argv)
             case 'd':
                 dir = optarg;
                 break;
+            case 'n':
+                num_queues = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                queue_depth = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                max_background = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                npoll_cpus = virtiofs_emu_parse_cpu_list(optarg, &poll_cpus);
+                if (npoll_cpus < 0) {
+                    fprintf(stderr, "Invalid poll CPU list \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'k': {
+                char *end;
+                coalesce = true;
+                coalesce_count = strtoul(optarg, &end, 10);
+                if (*end == ',')
+                    coalesce_usec = strtoul(end + 1, NULL, 10);
+                break;
+            }
+            case 'm':
+                mgmt_thread = true;
+                break;
+            case 'P':
+                sched = true;
+                sched_bulk_inflight_kib = strtoull(optarg, NULL, 10);
+                break;
+            case 'Q':
+                qos = optarg;
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'w':
+                sw_ctrl = true;
+                sw_load_requests = strtoull(optarg, NULL, 10);
+                break;
+            case 'O':
+                fuse_ll_direct_io_free(&direct_io);
+                if (fuse_ll_direct_io_parse(optarg, &direct_io)) {
+                    fprintf(stderr, "Invalid direct io files \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
             default: /* '?' */
                 usage();
                 exit(1);
@@ -45,10 +131,14 @@ int main(int argc, char **argv)
     struct virtiofs_emu_params emu_params;
     // just for safety
     memset(&emu_params, 0, sizeof(struct virtiofs_emu_params));
+    if (qos && virtiofs_emu_parse_qos(qos, &emu_params)) {
+        fprintf(stderr, "Invalid QoS limits \"%s\"\n", qos);
+        exit(1);
+    }
 
     if (pf >= 0)
         emu_params.pf_id = pf;
-    else {
+    else if (!sw_ctrl) {
         fprintf(stderr, "You must supply a pf with -p\n");
         usage();
         exit(1);
@@ -60,7 +150,7 @@ int main(int argc, char **argv)
     
     if (emu_manager != NULL) {
         emu_params.emu_manager = emu_manager;
-    } else {
+    } else if (!sw_ctrl) {
         fprintf(stderr, "You must supply an emu manager name with -e\n");
         usage();
         exit(1);
@@ -81,9 +171,26 @@ int main(int argc, char **argv)
 
     emu_params.polling_interval_usec = 0;
     emu_params.nthreads = 0;
+    emu_params.num_queues = num_queues;
+    emu_params.queue_depth = queue_depth;
+    emu_params.max_background = max_background;
+    emu_params.poll_cpus = poll_cpus;
+    emu_params.npoll_cpus = npoll_cpus;
+    emu_params.coalesce_completions = coalesce;
+    emu_params.coalesce_count = coalesce_count;
+    emu_params.coalesce_usec = coalesce_usec;
+    emu_params.mgmt_thread = mgmt_thread;
+    emu_params.sched = sched;
+    emu_params.sched_bulk_max_inflight = sched_bulk_inflight_kib * 1024;
+    emu_params.trace = trace_file != NULL;
+    emu_params.trace_file = trace_file;
+    emu_params.sw_ctrl = sw_ctrl;
+    emu_params.sw_load_requests = sw_load_requests;
     emu_params.tag = "virtiofuser";
 
-    fuser_main(false, dir, false, &emu_params);
+    fuser_main(false, dir, false, &direct_io, &emu_params);
+
+    free(poll_cpus);
 
     return 0;
 }
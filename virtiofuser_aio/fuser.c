@@ -188,7 +188,8 @@ static void *fuser_io_poll_thread(struct fuser *f) {
 }
 
 // todo proper error handling
-int fuser_main(bool debug, char *source, bool cached, struct virtiofs_emu_params *emu_params) {
+int fuser_main(bool debug, char *source, bool cached, const struct fuse_ll_direct_io *direct_io,
+               struct virtiofs_emu_params *emu_params) {
     struct fuser *f = calloc(1, sizeof(struct fuser));
     if (f == NULL)
         err(1, "ERROR: Could not allocate memory for struct fuser");
@@ -196,6 +197,8 @@ int fuser_main(bool debug, char *source, bool cached, struct virtiofs_emu_params
     f->debug = debug;
     f->source = strdup(source);
     f->timeout = cached ? 84600.0 : 0; // 24 hours
+    if (direct_io)
+        f->direct_io = *direct_io;
 
     struct stat s;
     int ret = lstat(f->source, &s);
@@ -224,13 +227,16 @@ int fuser_main(bool debug, char *source, bool cached, struct virtiofs_emu_params
     if (ret == -1)
         err(1, "ERROR: Failed to init inode_table f->inodes");
 
-    if (io_setup(10, &f->aio_ctx) != 0)
+    // Every request the host can have in flight might need an aio slot
+    virtiofs_emu_params_fill_defaults(emu_params);
+    if (io_setup(emu_params->max_background, &f->aio_ctx) != 0)
         err(1, "ERROR: Failed to init Linux aio");
 
     struct fuse_ll_operations ops;
     fuser_mirror_assign_ops(&ops);
 
-    mpool_init(f->cb_data_pool, 100, sizeof(struct fuser_rw_cb_data), 10);
+    mpool_init(f->cb_data_pool, emu_params->max_background,
+            sizeof(struct fuser_rw_cb_data), 10);
     pthread_t poll_thread;
     pthread_create(&poll_thread, NULL, (void *(*)(void *))fuser_io_poll_thread, f);
 
@@ -240,6 +246,7 @@ int fuser_main(bool debug, char *source, bool cached, struct virtiofs_emu_params
     pthread_join(poll_thread, NULL);
     mpool_destroy(f->cb_data_pool);
     // destroy inode table
+    fuse_ll_direct_io_free(&f->direct_io);
     free(f);
 
     return 0;
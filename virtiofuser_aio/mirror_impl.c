@@ -122,6 +122,7 @@ static int do_lookup(struct fuser *f, fuse_ino_t parent, const char *name,
     memset(e, 0, sizeof(*e));
     e->attr_timeout = f->timeout;
     e->entry_timeout = f->timeout;
+    bool direct_io = fuse_ll_direct_io_name(&f->direct_io, name);
 
     int newfd = openat(ino_to_fd(f, parent), name, O_PATH | O_NOFOLLOW);
     if (newfd == -1)
@@ -166,6 +167,7 @@ static int do_lookup(struct fuser *f, fuse_ino_t parent, const char *name,
         pthread_mutex_lock(&i->m);
 
         i->nlookup++;
+        i->direct_io_name |= direct_io;
         if (f->debug)
             printf("DEBUG:%s:%d inode %ld count %ld\n", __func__, __LINE__, i->src_ino, i->nlookup);
 
@@ -181,6 +183,7 @@ static int do_lookup(struct fuser *f, fuse_ino_t parent, const char *name,
         i->src_dev = e->attr.st_dev;
 
         i->nlookup++;
+        i->direct_io_name |= direct_io;
         if (f->debug)
             printf("DEBUG:%s:%d inode %ld count %ld\n", __func__, __LINE__, i->src_ino, i->nlookup);
 
@@ -456,6 +459,7 @@ int fuser_mirror_open(struct fuse_session *se, struct fuser *f,
                       struct fuse_out_header *out_hdr, struct fuse_open_out *out_open)
 {
     struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
     fi.flags = in_open->flags;
 
     struct inode *i = ino_to_inodeptr(f, in_hdr->nodeid);
@@ -493,10 +497,20 @@ int fuser_mirror_open(struct fuse_session *se, struct fuser *f,
         return 0;
     }
 
+    struct stat s;
+    bool stat_ok = fstat(fd, &s) == 0;
     pthread_mutex_lock(&i->m);
     i->nopen++;
+    // Close-to-open like NFS: what the guest cached is still good if the file
+    // did not change since the last open
+    bool unchanged = stat_ok && i->open_size == s.st_size &&
+                     i->open_ctime.tv_sec == s.st_ctim.tv_sec &&
+                     i->open_ctime.tv_nsec == s.st_ctim.tv_nsec;
+    i->open_ctime = stat_ok ? s.st_ctim : (struct timespec) { 0 };
+    i->open_size = stat_ok ? s.st_size : 0;
+    fi.direct_io = i->direct_io_name || (stat_ok && fuse_ll_direct_io_size(&f->direct_io, s.st_size));
     pthread_mutex_unlock(&i->m);
-    fi.keep_cache = (f->timeout != 0);
+    fi.keep_cache = !fi.direct_io && (f->timeout != 0 || unchanged);
     fi.noflush = (f->timeout == 0 && (fi.flags & O_ACCMODE) == O_RDONLY);
     fi.fh = fd;
 
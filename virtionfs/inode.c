@@ -29,11 +29,13 @@ struct inode *inode_new(fattr4_fileid fileid)
 
     i->fileid = fileid;
     // We keep the fh at 0, aka no fh
+    pthread_spin_init(&i->open_lock, PTHREAD_PROCESS_PRIVATE);
 
     return i;
 }
 
 void inode_destroy(struct inode *i) {
+    pthread_spin_destroy(&i->open_lock);
     free(i);
 }
 
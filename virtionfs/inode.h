@@ -17,6 +17,8 @@
 
 #include "nfs_v4.h"
 
+struct read_cb_data;
+
 struct inode {
     // We return the fileid as fuse_ino_t
     // This is only possible under the assumption that FUSE_ROOT_ID (=1)
@@ -38,6 +40,23 @@ struct inode {
     atomic_size_t nlookup;
     atomic_size_t nopen;
 
+    // Adaptive attribute timeout, see vnfs_attr_timeout
+    atomic_uint_fast64_t change;
+    atomic_uint ttl_ms;
+    atomic_uint_fast64_t ttl_since_ms; // When ttl_ms was set
+
+    // Page cache policy of the opens, see vopen_keep_cache
+    pthread_spinlock_t open_lock;
+    uint64_t open_change; // The change attribute at the last OPEN, 0 for none
+    uint64_t open_devs;   // Bit d: the guest of device d opened the file at open_change
+    bool direct_io_name;              // The name matched a direct_io pattern at LOOKUP
+
+    // Open-less I/O, see vnfs_io_start
+    atomic_bool opening; // A compound that OPENs the file is out
+    // READs that wait with their slot for that OPEN, see vread_again
+    _Atomic(struct read_cb_data *) io_waiters;
+    atomic_bool open_wanted; // The server refused a READ with the anonymous stateid
+
     struct inode *next;
 };
 
@@ -5,26 +5,100 @@
 #
 */
 
+#define _GNU_SOURCE
 #include <getopt.h>
 #include "virtiofs_emu_ll.h"
 #include "virtionfs.h"
 
 void usage()
 {
-    printf("virtionfs [-p pf_id] [-v vf_id ] [-e emulation_manager_name] [-s server_ip] [-x export_path] \n");
+    printf("virtionfs [-p pf_id] [-v vf_id ] [-e emulation_manager_name] [-s server_ip] [-x export_path] \n"
+           "          [-t nthreads] [-S] [-E min_threads] [-a adaptive_poll_idle_threshold] [-N]\n"
+           "          [-n num_queues] [-q queue_depth] [-b max_background]\n"
+           "          [-c poll_cpu_list] [-C nfs_cpu_list] [-k coalesce_count[,usec]] [-m] [-P bulk_inflight_kib]\n"
+           "          [-Q dev_iops[:dev_mibps[:thread_iops[:thread_mibps]]]] [-T trace_file] [-w sw_load_requests[,gap_usec]]\n"
+           "          [-H handoff_file] [-R handoff_file] [-D pf_id:vf_id[:tag],...] [-W watchdog_msec]\n"
+           "          [-A acmin[,acmax]] [-O direct_io_mib[,pattern,...]] [-L]\n"
+           "Thread i and its NFS connection run on the i-th CPU of each list, e.g. -c 0-3 -C 4-7\n"
+           "-S lets idle threads steal requests from the queues of busy threads\n"
+           "-E runs between min_threads and nthreads polling threads depending on the load, implies -m\n"
+           "-w runs on an in-process software virtio-fs device with a FUSE_GETATTR load instead of the DPU,\n"
+           "it stops after sw_load_requests requests (0 runs until stopped) and -p/-e are not needed,\n"
+           "gap_usec pauses the load between rounds over the queues\n"
+           "-N blocks idle threads on the doorbells of their queues after the -a threshold (default 1000)\n"
+           "-k hands completions back to the host in batches of coalesce_count, or after usec\n"
+           "-m moves mmio polling and signal handling off the pollers onto the main thread\n"
+           "-P dispatches metadata before READ/WRITE and caps the READ/WRITE bytes in flight (0 = 4096)\n"
+           "-Q limits the requests and READ/WRITE MiB per second of the device and of every poller, 0 = no limit\n"
+           "-T traces every request from the start into trace_file, SIGUSR2 toggles tracing (default file %s)\n"
+           "-H saves the inodes and open files to handoff_file on exit, -R takes over the device and\n"
+           "the state of the process that wrote it (live restart)\n"
+           "-D serves several devices with the same pollers and NFS connections instead of -p/-v,\n"
+           "the tags default to virtionfs-<index>, with -w it is the number of software devices that counts\n"
+           "-W logs the requests that are not done after watchdog_msec (default %u)\n"
+           "-A lets the guest cache attributes and names for acmin seconds after they changed, doubling\n"
+           "up to acmax (default %d) while they stay the same, without -A the guest asks every time\n"
+           "-O opens files of at least direct_io_mib MiB (0 = no limit) or whose name matches one of the\n"
+           "patterns with direct io, bypassing the guest's page cache, e.g. -O 1024,*.mp4,*.ckpt\n"
+           "-L open-less I/O: the guest sends no FUSE_OPEN/RELEASE, READs use the anonymous stateid\n"
+           "and the first WRITE OPENs the file in its own compound, -O has no effect then\n",
+           VIRTIOFS_EMU_LL_TRACE_FILE, VIRTIOFS_EMU_LL_WATCHDOG_MSEC, VNFS_ACMAX_SEC);
 }
 
 int main(int argc, char **argv)
 {
+    // Everything in the startup profile is relative to this
+    virtiofs_emu_ll_startup_mark("main");
+
     int pf = -1;
     int vf = -1;
     char *emu_manager = NULL; // the rdma device name which supports being an emulation manager and virtio_fs emu
     char *server = NULL;
     char *export = NULL;
     uint32_t nthreads = 1;
+    bool work_stealing = false;
+    // 0 means a fixed number of polling threads
+    uint32_t elastic_min_threads = 0;
+    // 0 means busy polling
+    uint32_t poll_idle_threshold = 0;
+    bool notify = false;
+    // 0 means the default virtqueue shape
+    uint32_t num_queues = 0;
+    uint32_t queue_depth = 0;
+    uint32_t max_background = 0;
+    // NULL means no pinning
+    int *poll_cpus = NULL;
+    int npoll_cpus = 0;
+    // Completion coalescing, off by default
+    bool coalesce = false;
+    uint32_t coalesce_count = 0;
+    uint32_t coalesce_usec = 0;
+    bool mgmt_thread = false;
+    // Priority scheduling of metadata over data, off by default
+    bool sched = false;
+    uint64_t sched_bulk_inflight_kib = 0;
+    char *qos = NULL;
+    char *trace_file = NULL;
+    // Software virtio-fs device instead of the DPU
+    bool sw_ctrl = false;
+    uint64_t sw_load_requests = 0;
+    uint32_t sw_load_gap_usec = 0;
+    int *nfs_cpus = NULL;
+    int nnfs_cpus = 0;
+    // Live restart
+    char *handoff_file = NULL;
+    char *recover_file = NULL;
+    char *devs = NULL;
+    // 0 means the default watchdog threshold
+    uint32_t watchdog_msec = 0;
+    // Attribute timeouts in seconds, 0 means no caching in the guest
+    double acmin = 0;
+    double acmax = 0;
+    struct fuse_ll_direct_io direct_io = { 0 };
+    bool no_open = false;
 
     int opt;
-    while ((opt = getopt(argc, argv, "p:v:e:s:x:t:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:v:e:s:x:t:SE:a:Nn:q:b:c:C:k:mP:Q:T:w:H:R:D:W:A:O:L")) != -1) {
         switch (opt) {
             case 'p':
                 pf = atoi(optarg);
@@ -44,6 +118,102 @@ int main(int argc, char **argv)
             case 't':
                 nthreads = strtoul(optarg, NULL, 10);
                 break;
+            case 'S':
+                work_stealing = true;
+                break;
+            case 'E':
+                elastic_min_threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'a':
+                poll_idle_threshold = strtoul(optarg, NULL, 10);
+                break;
+            case 'N':
+                notify = true;
+                break;
+            case 'n':
+                num_queues = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                queue_depth = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                max_background = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                npoll_cpus = virtiofs_emu_parse_cpu_list(optarg, &poll_cpus);
+                if (npoll_cpus < 0) {
+                    fprintf(stderr, "Invalid poll CPU list \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                nnfs_cpus = virtiofs_emu_parse_cpu_list(optarg, &nfs_cpus);
+                if (nnfs_cpus < 0) {
+                    fprintf(stderr, "Invalid NFS CPU list \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'k': {
+                char *end;
+                coalesce = true;
+                coalesce_count = strtoul(optarg, &end, 10);
+                if (*end == ',')
+                    coalesce_usec = strtoul(end + 1, NULL, 10);
+                break;
+            }
+            case 'm':
+                mgmt_thread = true;
+                break;
+            case 'P':
+                sched = true;
+                sched_bulk_inflight_kib = strtoull(optarg, NULL, 10);
+                break;
+            case 'Q':
+                qos = optarg;
+                break;
+            case 'T':
+                trace_file = optarg;
+                break;
+            case 'w': {
+                char *end;
+                sw_ctrl = true;
+                sw_load_requests = strtoull(optarg, &end, 10);
+                if (*end == ',')
+                    sw_load_gap_usec = strtoul(end + 1, NULL, 10);
+                break;
+            }
+            case 'H':
+                handoff_file = optarg;
+                break;
+            case 'R':
+                recover_file = optarg;
+                break;
+            case 'D':
+                devs = optarg;
+                break;
+            case 'W':
+                watchdog_msec = strtoul(optarg, NULL, 10);
+                break;
+            case 'A': {
+                char *end;
+                acmin = strtod(optarg, &end);
+                acmax = *end == ',' ? strtod(end + 1, NULL) : VNFS_ACMAX_SEC;
+                if (acmin <= 0 || acmax < acmin) {
+                    fprintf(stderr, "Invalid attribute timeouts \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            }
+            case 'O':
+                fuse_ll_direct_io_free(&direct_io);
+                if (fuse_ll_direct_io_parse(optarg, &direct_io)) {
+                    fprintf(stderr, "Invalid direct io files \"%s\"\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'L':
+                no_open = true;
+                break;
             default: /* '?' */
                 usage();
                 exit(1);
@@ -53,10 +223,23 @@ int main(int argc, char **argv)
     struct virtiofs_emu_params emu_params;
     // just for safety
     memset(&emu_params, 0, sizeof(struct virtiofs_emu_params));
+    if (qos && virtiofs_emu_parse_qos(qos, &emu_params)) {
+        fprintf(stderr, "Invalid QoS limits \"%s\"\n", qos);
+        exit(1);
+    }
+
+    if (devs && virtiofs_emu_parse_devs(devs, "virtionfs", &emu_params)) {
+        fprintf(stderr, "Invalid device list \"%s\"\n", devs);
+        exit(1);
+    }
+    if (emu_params.ndevs > 1 && (handoff_file || recover_file)) {
+        fprintf(stderr, "Live restart (-H/-R) only works with a single device\n");
+        exit(1);
+    }
 
     if (pf >= 0)
         emu_params.pf_id = pf;
-    else {
+    else if (!sw_ctrl && !devs) {
         fprintf(stderr, "You must supply a pf with -p\n");
         usage();
         exit(1);
@@ -68,7 +251,7 @@ int main(int argc, char **argv)
     
     if (emu_manager != NULL) {
         emu_params.emu_manager = emu_manager;
-    } else {
+    } else if (!sw_ctrl) {
         fprintf(stderr, "You must supply an emu manager name with -e\n");
         usage();
         exit(1);
@@ -88,9 +271,40 @@ int main(int argc, char **argv)
 
     emu_params.polling_interval_usec = 0;
     emu_params.nthreads = nthreads;
+    emu_params.work_stealing = work_stealing;
+    emu_params.elastic = elastic_min_threads > 0;
+    emu_params.elastic_min_threads = elastic_min_threads;
+    emu_params.adaptive_polling = poll_idle_threshold > 0;
+    emu_params.poll_idle_threshold = poll_idle_threshold;
+    emu_params.notify = notify;
+    emu_params.num_queues = num_queues;
+    emu_params.queue_depth = queue_depth;
+    emu_params.max_background = max_background;
+    emu_params.poll_cpus = poll_cpus;
+    emu_params.npoll_cpus = npoll_cpus;
+    emu_params.coalesce_completions = coalesce;
+    emu_params.coalesce_count = coalesce_count;
+    emu_params.coalesce_usec = coalesce_usec;
+    emu_params.mgmt_thread = mgmt_thread;
+    emu_params.sched = sched;
+    emu_params.sched_bulk_max_inflight = sched_bulk_inflight_kib * 1024;
+    emu_params.trace = trace_file != NULL;
+    emu_params.trace_file = trace_file;
+    emu_params.sw_ctrl = sw_ctrl;
+    emu_params.sw_load_requests = sw_load_requests;
+    emu_params.sw_load_gap_usec = sw_load_gap_usec;
+    emu_params.recover = recover_file != NULL;
+    emu_params.watchdog_msec = watchdog_msec;
     emu_params.tag = "virtionfs";
 
-    virtionfs_main(server, export, false, false, nthreads, &emu_params);
+    virtionfs_main(server, export, false, acmin, acmax, &direct_io, no_open, nthreads, nfs_cpus, nnfs_cpus,
+                   handoff_file, recover_file, &emu_params);
+
+    for (uint32_t d = 0; d < emu_params.ndevs; d++)
+        free(emu_params.devs[d].tag);
+    free(emu_params.devs);
+    free(poll_cpus);
+    free(nfs_cpus);
 
     return 0;
 }
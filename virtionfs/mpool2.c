@@ -24,6 +24,10 @@ void mpool2_free(struct mpool2 *p, void *e) {
     ck_ring_enqueue_spsc(&p->ring, p->buffer, e);
 }
 
+unsigned int mpool2_available(struct mpool2 *p) {
+    return ck_ring_size(&p->ring);
+}
+
 #define MIN(x, y) x < y ? x : y
 
 // Not thread-safe!
@@ -25,6 +25,8 @@ struct mpool2 {
 
 void *mpool2_alloc(struct mpool2 *p);
 void mpool2_free(struct mpool2 *p, void *e);
+// The number of free chunks, exact only for the thread that allocs
+unsigned int mpool2_available(struct mpool2 *p);
 
 /*
  chunks = the total amount of chunks that the pool contains
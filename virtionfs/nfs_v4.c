@@ -116,7 +116,7 @@ bool nfs4_check_clientid_trunking_allowed(EXCHANGE_ID4resok *l, EXCHANGE_ID4reso
             .eir_server_scope_val, l->eir_server_scope.eir_server_scope_len) == 0;
 }
 
-int nfs4_op_createsession(nfs_argop4 *op, clientid4 clientid, sequenceid4 seqid)
+int nfs4_op_createsession(nfs_argop4 *op, clientid4 clientid, sequenceid4 seqid, count4 maxrequests)
 {
    op[0].argop = OP_CREATE_SESSION;
    CREATE_SESSION4args *arg = &op[0].nfs_argop4_u.opcreatesession;
@@ -130,9 +130,9 @@ int nfs4_op_createsession(nfs_argop4 *op, clientid4 clientid, sequenceid4 seqid)
    arg->csa_sec_parms.csa_sec_parms_len = 0;
 
    // Currently no caching support
-   arg->csa_fore_chan_attrs.ca_maxrequests = NFS4_MAX_OUTSTANDING_REQUESTS;
-   // Magic from the Linux kernel, 8 seems about right
-   arg->csa_fore_chan_attrs.ca_maxoperations = NFS4_MAX_OPS;
+   arg->csa_fore_chan_attrs.ca_maxrequests = maxrequests < NFS4_MAX_OUTSTANDING_REQUESTS ?
+       maxrequests : NFS4_MAX_OUTSTANDING_REQUESTS;
+   arg->csa_fore_chan_attrs.ca_maxoperations = NFS4_MAX_FORE_OPS;
    arg->csa_fore_chan_attrs.ca_maxresponsesize_cached = 0;
    arg->csa_fore_chan_attrs.ca_maxresponsesize = NFS4_MAXRESPONSESIZE;
    arg->csa_fore_chan_attrs.ca_maxrequestsize = NFS4_MAXREQUESTSIZE;
@@ -334,7 +334,7 @@ static int nfs_get_ugid(const char *buf, int slen, int is_user)
         return -1;                                                      \
     }
 
-int nfs_parse_attributes(struct fuse_attr *attr,
+int nfs_parse_attributes(struct fuse_attr *attr, uint64_t *change,
     const char *buf, int len)
 {
     int type, slen, pad;
@@ -344,6 +344,11 @@ int nfs_parse_attributes(struct fuse_attr *attr,
     type = ntohl(*(uint32_t *)(void *)buf);
     buf += 4;
     len -= 4;
+    /* Change */
+    CHECK_GETATTR_BUF_SPACE(len, 8);
+    *change = nfs_pntoh64((uint32_t *)(void *)buf);
+    buf += 8;
+    len -= 8;
     /* Size */
     CHECK_GETATTR_BUF_SPACE(len, 8);
     attr->size = nfs_pntoh64((uint32_t *)(void *)buf);
@@ -452,6 +457,13 @@ int nfs_parse_attributes(struct fuse_attr *attr,
     return 0;
 }
 
+int nfs_parse_change(uint64_t *change, const char *buf, int len)
+{
+    CHECK_GETATTR_BUF_SPACE(len, 8);
+    *change = nfs_pntoh64((uint32_t *)(void *)buf);
+    return 0;
+}
+
 int nfs_parse_statfs(struct fuse_kstatfs *stat, const char *buf, int len)
 {
     uint64_t u64;
@@ -515,3 +527,18 @@ int nfs_parse_fileid(uint64_t *fileid,
     return 0;
 }
 
+int nfs_parse_maxio(uint64_t *maxread, uint64_t *maxwrite,
+    const char *buf, int len)
+{
+    /* Maxread */
+    CHECK_GETATTR_BUF_SPACE(len, 8);
+    *maxread = nfs_pntoh64((uint32_t *)(void *)buf);
+    buf += 8;
+    len -= 8;
+    /* Maxwrite */
+    CHECK_GETATTR_BUF_SPACE(len, 8);
+    *maxwrite = nfs_pntoh64((uint32_t *)(void *)buf);
+
+    return 0;
+}
+
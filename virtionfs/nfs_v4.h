@@ -20,11 +20,14 @@
 // Empirically verified with Linux kernel 5.11
 #define NFS_ROOT_FILEID 2
 
+// Room for the rest of a READ/WRITE compound (SEQUENCE, PUTFH, the headers) next to the data
+#define NFS4_COMPOUND_OVERHEAD 4096
 // 1MB is max read/write size in Linux, + some overhead
-#define NFS4_MAXRESPONSESIZE (1 << 20)
-#define NFS4_MAXREQUESTSIZE (1 << 20)
+#define NFS4_MAXRESPONSESIZE ((1 << 20) + NFS4_COMPOUND_OVERHEAD)
+#define NFS4_MAXREQUESTSIZE ((1 << 20) + NFS4_COMPOUND_OVERHEAD)
 
-#define NFS4_MAX_OUTSTANDING_REQUESTS 64
+// Upper bound on the slots we ask for per session, the server might give us less
+#define NFS4_MAX_OUTSTANDING_REQUESTS 1024
 
 #define NFS4DOT1_MINOR 1
 
@@ -44,6 +47,10 @@
  * If a compound requires more operations, adjust NFS4_MAX_OPS accordingly.
  */
 #define NFS4_MAX_OPS   8
+/* The fore channel also carries the bursts of GETATTRs, which share a compound:
+ * SEQUENCE + 8 * (PUTFH + GETATTR). The server may grant fewer operations.
+ */
+#define NFS4_MAX_FORE_OPS 17
 
 /* Our NFS4 client back channel server only wants the cb_sequene and the
  * actual operation per compound
@@ -67,7 +74,7 @@ int nfs4_fill_create_attrs(struct fuse_in_header *in_hdr, uint32_t flags, fattr4
 bool nfs4_check_session_trunking_allowed(EXCHANGE_ID4resok *l, EXCHANGE_ID4resok *r);
 bool nfs4_check_clientid_trunking_allowed(EXCHANGE_ID4resok *l, EXCHANGE_ID4resok *r);
 // Supply the clientid received from EXCHANGE_ID
-int nfs4_op_createsession(nfs_argop4 *op, clientid4 clientid, sequenceid4 seqid);
+int nfs4_op_createsession(nfs_argop4 *op, clientid4 clientid, sequenceid4 seqid, count4 maxrequests);
 int nfs4_op_bindconntosession(nfs_argop4 *op, sessionid4 *sessionid, channel_dir_from_client4 channel, bool rdma);
 int nfs4_op_exchangeid(nfs_argop4 *op, verifier4 verifier, const char *client_name);
 int nfs4_op_setclientid(nfs_argop4 *op, verifier4 verifier, const char *client_name);
@@ -78,9 +85,14 @@ int nfs4_op_lookup(nfs_argop4 *op, const char *path);
 uint64_t nfs_hton64(uint64_t val);
 uint64_t nfs_ntoh64(uint64_t val);
 uint64_t nfs_pntoh64(const uint32_t *buf);
-int nfs_parse_attributes(struct fuse_attr *attr, const char *buf, int len);
+// change is the change attribute, which comes right after the type
+int nfs_parse_attributes(struct fuse_attr *attr, uint64_t *change, const char *buf, int len);
+// A GETATTR of only FATTR4_CHANGE
+int nfs_parse_change(uint64_t *change, const char *buf, int len);
 int nfs_parse_statfs(struct fuse_kstatfs *stat, const char *buf, int len);
 int nfs_parse_fileid(uint64_t *fileid, const char *buf, int len);
+// For a GETATTR of FATTR4_MAXREAD and FATTR4_MAXWRITE
+int nfs_parse_maxio(uint64_t *maxread, uint64_t *maxwrite, const char *buf, int len);
 int32_t nfs_error_to_fuse_error(nfsstat4 status);
 
 #endif // NFS_V4_H
@@ -5,6 +5,7 @@
 #
 */
 
+#define _GNU_SOURCE
 #include <sys/time.h>
 #include <nfsc/libnfs.h>
 #include <nfsc/libnfs-raw.h>
@@ -14,12 +15,14 @@
 #include <poll.h>
 #include <fcntl.h>
 #include <stdatomic.h>
+#include <assert.h>
 #include <err.h>
 
 #include "fuse_ll.h"
 #include "config.h"
 #include "virtionfs.h"
 #include "vnfs_connect.h"
+#include "vnfs_handoff.h"
 #include "mpool2.h"
 #ifdef LATENCY_MEASURING_ENABLED
 #include "ftimer.h"
@@ -38,6 +41,7 @@ static uint64_t op_calls[FUSE_REMOVEMAPPING+1];
 
 static uint32_t standard_attributes[2] = {
     (1 << FATTR4_TYPE |
+     1 << FATTR4_CHANGE |
      1 << FATTR4_SIZE |
      1 << FATTR4_FILEID),
     (1 << (FATTR4_MODE - 32) |
@@ -50,6 +54,11 @@ static uint32_t standard_attributes[2] = {
      1 << (FATTR4_TIME_MODIFY - 32))
 };
 
+// Of the parent directory in a LOOKUP, for the entry timeout
+static uint32_t change_attributes[1] = {
+    1 << FATTR4_CHANGE
+};
+
 // How statfs_attributes maps to struct fuse_kstatfs
 // blocks  = FATTR4_SPACE_TOTAL / BLOCKSIZE
 // bfree   = FATTR4_SPACE_FREE / BLOCKSIE
@@ -75,24 +84,51 @@ static uint32_t statfs_attributes[2] = {
 struct getattr_cb_data {
     struct snap_fs_dev_io_done_ctx *cb;
     struct virtionfs *vnfs;
+    // Of the device the request came from
+    struct fuse_session *se;
     struct vnfs_conn *conn;
     uint32_t slotid;
 
+    struct inode *i;
+
     struct fuse_out_header *out_hdr;
     struct fuse_attr_out *out_attr;
 };
+// Most GETATTRs of a burst that share a compound
+#define VNFS_GETATTR_BURST 8
+struct getattr_burst_cb_data {
+    struct virtionfs *vnfs;
+    struct fuse_session *se;
+    struct vnfs_conn *conn;
+    uint32_t slotid;
+    // To resend the unanswered GETATTRs on the same slot
+    SEQUENCE4args seq;
+
+    // reqs[done..nreqs) are still waiting for an answer
+    uint32_t done;
+    uint32_t nreqs;
+    struct fuse_ll_getattr_req reqs[VNFS_GETATTR_BURST];
+    struct inode *inodes[VNFS_GETATTR_BURST];
+};
 struct lookup_cb_data {
     struct snap_fs_dev_io_done_ctx *cb;
     struct virtionfs *vnfs;
+    struct fuse_session *se;
     struct vnfs_conn *conn;
     uint32_t slotid;
 
+    // The parent directory
+    struct inode *pi;
+    // The name matched a direct_io pattern
+    bool direct_io;
+
     struct fuse_out_header *out_hdr;
     struct fuse_entry_out *out_entry;
 };
 struct statfs_cb_data {
     struct snap_fs_dev_io_done_ctx *cb;
     struct virtionfs *vnfs;
+    struct fuse_session *se;
     struct vnfs_conn *conn;
     uint32_t slotid;
 
@@ -102,9 +138,12 @@ struct statfs_cb_data {
 struct setattr_cb_data {
     struct snap_fs_dev_io_done_ctx *cb;
     struct virtionfs *vnfs;
+    struct fuse_session *se;
     struct vnfs_conn *conn;
     uint32_t slotid;
 
+    struct inode *i;
+
     struct fuse_out_header *out_hdr;
     struct fuse_attr_out *out_attr;
 
@@ -114,6 +153,8 @@ struct setattr_cb_data {
 struct open_cb_data {
     struct snap_fs_dev_io_done_ctx *cb;
     struct virtionfs *vnfs;
+    // Of the device the request came from
+    struct fuse_session *se;
     struct vnfs_conn *conn;
     uint32_t slotid;
 
@@ -123,13 +164,31 @@ struct open_cb_data {
     struct fuse_open_out *out_open;
 
     uint32_t owner_val;
+    bool reopen; // The file was open already, the compound only GETATTRs
+};
+// How a READ or WRITE gets its open state, see vnfs_io_start
+enum vnfs_io {
+    VNFS_IO_OPEN,      // The inode is open, use its fh_open and open stateid
+    VNFS_IO_ANONYMOUS, // A READ with the anonymous stateid
+    VNFS_IO_LAZY_OPEN, // The compound OPENs the file first and uses the stateid of that
+    VNFS_IO_BUSY,      // Another compound is OPENing the file, try again later
 };
+
 struct read_cb_data {
     struct snap_fs_dev_io_done_ctx *cb;
     struct virtionfs *vnfs;
+    // Of the device the request came from
+    struct fuse_session *se;
     struct vnfs_conn *conn;
     uint32_t slotid;
 
+    struct inode *i;
+    enum vnfs_io io;
+    uint32_t nop; // Index of the READ in the compound
+    uint32_t owner_val;
+    struct read_cb_data *next; // On the io_waiters of the inode
+
+    struct fuse_read_in *in_read;
     struct fuse_out_header *out_hdr;
     struct iovec *out_iov;
     int out_iovcnt;
@@ -140,6 +199,11 @@ struct write_cb_data {
     struct vnfs_conn *conn;
     uint32_t slotid;
 
+    struct inode *i;
+    enum vnfs_io io;
+    uint32_t nop; // Index of the WRITE in the compound
+    uint32_t owner_val;
+
     struct fuse_write_in *in_write;
     struct iovec *in_iov;
     int *in_iovcnt;
@@ -187,6 +251,7 @@ struct create_cb_data {
 struct cb_data {
     union {
         struct getattr_cb_data getattr;
+        struct getattr_burst_cb_data getattr_burst;
         struct lookup_cb_data lookup;
         struct statfs_cb_data statfs;
         struct setattr_cb_data setattr;
@@ -211,16 +276,101 @@ struct inode *vnfs4_op_putfh(struct virtionfs *vnfs, nfs_argop4 *op, uint64_t no
     return i;
 }
 
-struct inode *vnfs4_op_putfh_open(struct virtionfs *vnfs, nfs_argop4 *op, uint64_t nodeid)
+// OPEN of the file that is the current FH, owner_val must stay alive until the compound is sent
+static void vnfs4_op_open_fh(struct virtionfs *vnfs, nfs_argop4 *op, uint32_t *owner_val)
 {
-    op->argop = OP_PUTFH;
-    struct inode *i = inode_table_get(vnfs->inodes, nodeid);
-    if (!i) {
-        return NULL;
+    op->argop = OP_OPEN;
+    memset(&op->nfs_argop4_u.opopen, 0, sizeof(OPEN4args));
+    // Windows share stuff, this means normal operation in UNIX world
+    op->nfs_argop4_u.opopen.share_access = OPEN4_SHARE_ACCESS_BOTH;
+    op->nfs_argop4_u.opopen.share_deny = OPEN4_SHARE_DENY_NONE;
+    // Don't use this because we don't do anything special with the share, so set to zero
+    op->nfs_argop4_u.opopen.seqid = 0;
+    // Set the owner with the clientid and the unique owner number (32 bit should be safe)
+    // The clientid stems from the setclientid() handshake
+    op->nfs_argop4_u.opopen.owner.clientid = vnfs->clientid;
+    *owner_val = atomic_fetch_add(&vnfs->open_owner_counter, 1);
+    op->nfs_argop4_u.opopen.owner.owner.owner_val = (char *) owner_val;
+    op->nfs_argop4_u.opopen.owner.owner.owner_len = sizeof(*owner_val);
+    // The current FH is the file itself
+    op->nfs_argop4_u.opopen.claim.claim = CLAIM_FH;
+    // FUSE:OPEN cannot create a file
+    op->nfs_argop4_u.opopen.openhow.opentype = OPEN4_NOCREATE;
+}
+
+// A guest that agreed to open-less I/O at its FUSE_INIT sends no FUSE_OPEN, so its READs go
+// out with the anonymous stateid until the server refuses that for the file. The first WRITE,
+// or the READ after a refusal, OPENs the file in its own compound, one compound per inode at
+// a time. The other guests of the same process still open their files themselves.
+static enum vnfs_io vnfs_io_start(struct virtionfs *vnfs, struct fuse_session *se,
+                                  struct inode *i, bool write)
+{
+    if (!(se->conn.want & FUSE_CAP_NO_OPEN_SUPPORT) || atomic_load(&i->nopen) > 0)
+        return VNFS_IO_OPEN;
+    if (!write && !atomic_load(&i->open_wanted)) {
+        atomic_fetch_add(&vnfs->io_anonymous, 1);
+        return VNFS_IO_ANONYMOUS;
+    }
+    bool opening = false;
+    if (!atomic_compare_exchange_strong(&i->opening, &opening, true))
+        return VNFS_IO_BUSY;
+    // The compound before us might just have OPENed it
+    if (atomic_load(&i->nopen) > 0) {
+        atomic_store(&i->opening, false);
+        return VNFS_IO_OPEN;
+    }
+    return VNFS_IO_LAZY_OPEN;
+}
+
+// PUTFH (and OPEN, GETFH) from op[1] on and the stateid for the READ or WRITE after them,
+// returns the index of that READ or WRITE
+static uint32_t vnfs4_op_io(struct virtionfs *vnfs, nfs_argop4 *op, struct inode *i,
+                            enum vnfs_io io, uint32_t *owner_val, stateid4 *stateid)
+{
+    op[1].argop = OP_PUTFH;
+    if (io == VNFS_IO_OPEN) {
+        op[1].nfs_argop4_u.opputfh.object.nfs_fh4_val = i->fh_open.val;
+        op[1].nfs_argop4_u.opputfh.object.nfs_fh4_len = i->fh_open.len;
+        *stateid = i->open_stateid;
+        return 2;
     }
-    op->nfs_argop4_u.opputfh.object.nfs_fh4_val = i->fh_open.val;
-    op->nfs_argop4_u.opputfh.object.nfs_fh4_len = i->fh_open.len;
-    return i;
+    op[1].nfs_argop4_u.opputfh.object.nfs_fh4_val = i->fh.val;
+    op[1].nfs_argop4_u.opputfh.object.nfs_fh4_len = i->fh.len;
+    memset(stateid, 0, sizeof(*stateid));
+    if (io == VNFS_IO_ANONYMOUS)
+        return 2;
+
+    vnfs4_op_open_fh(vnfs, &op[2], owner_val);
+    op[3].argop = OP_GETFH;
+    // seqid 1 with all zeros is the current stateid, so the one the OPEN just gave out
+    stateid->seqid = 1;
+    return 4;
+}
+
+static void vnfs_io_wake(struct virtionfs *vnfs, struct inode *i);
+
+// Called with the reply of a VNFS_IO_LAZY_OPEN compound, NULL if there is none.
+// There is no RELEASE to tell when to CLOSE, so the file stays open until exit.
+static void vnfs_io_opened(struct virtionfs *vnfs, struct inode *i, COMPOUND4res *res)
+{
+    if (res && res->resarray.resarray_len > 3 &&
+            res->resarray.resarray_val[3].nfs_resop4_u.opgetfh.status == NFS4_OK) {
+        nfs_fh4 *fh = &res->resarray.resarray_val[3].nfs_resop4_u.opgetfh.GETFH4res_u.resok4.object;
+        if (nfs4_clone_fh(&i->fh_open, fh) == 0) {
+            i->open_stateid = res->resarray.resarray_val[2].nfs_resop4_u.opopen.OPEN4res_u.resok4.stateid;
+            // Only now the next READs and WRITEs can use the FH and stateid
+            atomic_store(&i->nopen, 1);
+            atomic_fetch_add(&vnfs->lazy_opens, 1);
+        }
+    }
+    atomic_store(&i->opening, false);
+    vnfs_io_wake(vnfs, i);
+}
+
+// The anonymous stateid is not good enough for this file
+static inline bool vnfs_io_refused(nfsstat4 status)
+{
+    return status == NFS4ERR_BAD_STATEID || status == NFS4ERR_OPENMODE;
 }
 
 struct vnfs_conn* vnfs_get_conn(struct virtionfs *vnfs) {
@@ -228,8 +378,56 @@ struct vnfs_conn* vnfs_get_conn(struct virtionfs *vnfs) {
     return &vnfs->conns[threadid];
 }
 
-// Only called from VirtioQ poller thread
-int vnfs4_op_sequence(nfs_argop4 *op, struct vnfs_conn *conn, bool cachethis)
+// The change attribute of i moved, so what the guests cache of it is stale. Tells every
+// guest except own (the one whose request made the change, NULL for none) to drop it.
+// Guests without a notification queue (SNAP) or a full queue only have the timeouts.
+static void vnfs_inval(struct virtionfs *vnfs, struct inode *i, struct fuse_session *own)
+{
+    pthread_mutex_lock(&vnfs->handshake_lock);
+    for (uint32_t d = 0; d < vnfs->nses; d++) {
+        if (vnfs->ses[d] != own && fuse_ll_notify_inval_inode(vnfs->ses[d], i->fileid, 0, 0) == 0)
+            atomic_fetch_add(&vnfs->ac_invals, 1);
+    }
+    pthread_mutex_unlock(&vnfs->handshake_lock);
+}
+
+// Like acregmin/acregmax of the Linux NFS client: when the guest comes back after the
+// timeout of an inode ran out and its change attribute did not move, the timeout doubles
+// up to ac_max_ms. Once it moved it starts over at ac_min_ms and the guests are told,
+// see vnfs_inval. Races between the threads only cost a doubling. Returns the timeout
+// in ms for the reply.
+static uint32_t vnfs_attr_timeout(struct virtionfs *vnfs, struct inode *i, uint64_t change,
+                                  struct fuse_session *own)
+{
+    if (!vnfs->ac_max_ms || !i)
+        return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+
+    uint64_t prev = atomic_exchange(&i->change, change);
+    uint32_t ttl = atomic_load(&i->ttl_ms);
+    if (prev != change || ttl == 0) {
+        // The first time we see the inode is no change
+        if (ttl != 0) {
+            atomic_fetch_add(&vnfs->ac_changed, 1);
+            vnfs_inval(vnfs, i, own);
+        }
+        ttl = vnfs->ac_min_ms;
+        atomic_store(&i->ttl_ms, ttl);
+        atomic_store(&i->ttl_since_ms, now);
+    } else if (now - atomic_load(&i->ttl_since_ms) >= ttl) {
+        ttl = ttl > vnfs->ac_max_ms / 2 ? vnfs->ac_max_ms : ttl * 2;
+        atomic_store(&i->ttl_ms, ttl);
+        atomic_store(&i->ttl_since_ms, now);
+    }
+    atomic_fetch_add(&vnfs->ac_replies, 1);
+    return ttl;
+}
+
+// Only called from VirtioQ poller thread, after vnfs4_conn_has_room()
+uint32_t vnfs4_op_sequence(nfs_argop4 *op, struct vnfs_conn *conn, bool cachethis)
 {
     op->argop = OP_SEQUENCE;
     struct SEQUENCE4args *arg = &op[0].nfs_argop4_u.opsequence;
@@ -237,42 +435,81 @@ int vnfs4_op_sequence(nfs_argop4 *op, struct vnfs_conn *conn, bool cachethis)
     arg->sa_cachethis = cachethis;
     // sessionid
     memcpy(arg->sa_sessionid, conn->session.sessionid, sizeof(sessionid4));
-    while (true) {
-        // Determine and claim which slot we will use for this request
-        for (uint32_t i = 0; i < conn->session.nslots; i++) {
-            if (!conn->session.slots[i].in_use) {
-                // Since only one thread (the Virtq thread) per session, whom can put the in_use to true
-                // this is safe.
-                arg->sa_slotid = i;
-                conn->session.slots[i].in_use = true;
-                goto slot_found;
-            }
-        }
-        // All slots are in use, wait for a bit
-        vnfs_error("All slots for connection %u are in use, suspending the Virtio poller"
-                   "thread for a bit.\n Please performance tune (the max_background operations in FUSE"
-                   "and the Virtio queue_depth so that this never happens!\n", conn->vnfs_conn_id);
-        usleep(100);
-    }
-slot_found:
+    // Determine and claim which slot we will use for this request.
+    // Since only one thread (the Virtq thread) per session, whom can put the in_use to true,
+    // a slot that vnfs4_conn_has_room() counted as free is still free.
+    uint32_t slotid = 0;
+    while (slotid < conn->session.nslots && conn->session.slots[slotid].in_use)
+        slotid++;
+    assert(slotid < conn->session.nslots);
+    arg->sa_slotid = slotid;
+    conn->session.slots[slotid].in_use = true;
+    atomic_fetch_add_explicit(&conn->session.nused, 1, memory_order_relaxed);
+
     // Determine the highest in_use slot
-    for (int64_t i = conn->session.nslots; i >= 0; i--) {
+    arg->sa_highest_slotid = slotid;
+    for (uint32_t i = conn->session.nslots - 1; i > slotid; i--) {
         if (conn->session.slots[i].in_use) {
             arg->sa_highest_slotid = i;
+            break;
         }
     }
-    struct vnfs_slot *slot = &conn->session.slots[arg->sa_slotid];
+    struct vnfs_slot *slot = &conn->session.slots[slotid];
     arg->sa_sequenceid = ++slot->seqid;
     
-    return arg->sa_slotid;
+    return slotid;
+}
+
+// Like vnfs4_op_sequence but for a slot whose reply just came in, so that the NFS service
+// thread can send the next compound on it before vnfs4_slot_free
+static void vnfs4_op_sequence_again(nfs_argop4 *op, struct vnfs_conn *conn, uint32_t slotid)
+{
+    op->argop = OP_SEQUENCE;
+    struct SEQUENCE4args *arg = &op->nfs_argop4_u.opsequence;
+
+    arg->sa_cachethis = false;
+    memcpy(arg->sa_sessionid, conn->session.sessionid, sizeof(sessionid4));
+    arg->sa_slotid = slotid;
+    arg->sa_highest_slotid = conn->session.nslots - 1;
+    arg->sa_sequenceid = ++conn->session.slots[slotid].seqid;
+}
+
+// Called from the NFS service thread when the reply is in
+void vnfs4_slot_free(struct vnfs_conn *conn, uint32_t slotid)
+{
+    conn->session.slots[slotid].in_use = false;
+    atomic_fetch_sub_explicit(&conn->session.nused, 1, memory_order_release);
+}
+
+bool vnfs4_conn_has_room(struct vnfs_conn *conn)
+{
+    return atomic_load_explicit(&conn->session.nused, memory_order_acquire) < conn->session.nslots &&
+           mpool2_available(conn->p) > 0;
+}
+
+uint32_t vnfs_capacity(struct virtionfs *vnfs, size_t thread_id)
+{
+    struct vnfs_conn *conn = &vnfs->conns[thread_id];
+    // Until then fuse_ll answers the requests itself (not init_done), let them through
+    if (conn->state != VNFS_CONN_STATE_ESTABLISHED)
+        return UINT32_MAX;
+
+    uint32_t nused = atomic_load_explicit(&conn->session.nused, memory_order_acquire);
+    uint32_t slots = nused < conn->session.nslots ? conn->session.nslots - nused : 0;
+    uint32_t chunks = mpool2_available(conn->p);
+    return slots < chunks ? slots : chunks;
+}
+
+uint32_t vnfs_max_io_size(struct virtionfs *vnfs)
+{
+    return atomic_load_explicit(&vnfs->max_io_size, memory_order_acquire);
 }
 
 // Only called from NFS poller thread
 int vnfs4_handle_sequence(COMPOUND4res *res, struct vnfs_conn *conn)
 {
     SEQUENCE4resok *seqok = &res->resarray.resarray_val[0].nfs_resop4_u.opsequence.SEQUENCE4res_u.sr_resok4;
-    struct vnfs_slot *slot = &conn->session.slots[seqok->sr_slotid];
-    slot->in_use = false;
+    vnfs4_slot_free(conn, seqok->sr_slotid);
 
     return 0;
 }
@@ -289,13 +526,14 @@ void create_cb(struct rpc_context *rpc, int status, void *data,
     }
 #endif
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_CREATE:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     COMPOUND4res *res = data;
+    virtiofs_emu_ll_trace_status(cb_data->cb, res->status);
     if (res->status != NFS4_OK) {
         cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
         vnfs_error("FUSE_CREATE:%lu - NFS error=%d, FUSE error=%d\n",
@@ -307,7 +545,7 @@ void create_cb(struct rpc_context *rpc, int status, void *data,
 
 ret:;
     struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
-    mpool2_free(vnfs->p, cb_data);
+    mpool2_free(cb_data->conn->p, cb_data);
     cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
 }
 
@@ -318,7 +556,9 @@ int create(struct fuse_session *se, struct virtionfs *vnfs,
            struct snap_fs_dev_io_done_ctx *cb)
 {
     struct vnfs_conn *conn = vnfs_get_conn(vnfs);
-    struct create_cb_data *cb_data = mpool2_alloc(vnfs->p);
+    if (!vnfs4_conn_has_room(conn))
+        return EBUSY;
+    struct create_cb_data *cb_data = mpool2_alloc(conn->p);
     if (!cb_data) {
         out_hdr->error = -ENOMEM;
         return 0;
@@ -351,7 +591,7 @@ int create(struct fuse_session *se, struct virtionfs *vnfs,
     cb_data->i = i;
     if (!i) {
     	vnfs_error("Invalid nodeid supplied\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -ENOENT;
         return 0;
     }
@@ -399,7 +639,7 @@ int create(struct fuse_session *se, struct virtionfs *vnfs,
 
     if (rpc_nfs4_compound_async(conn->rpc, create_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send NFS:OPEN (with create) request\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
@@ -418,13 +658,14 @@ void release_cb(struct rpc_context *rpc, int status, void *data,
     }
 #endif
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_RELEASE:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     COMPOUND4res *res = data;
+    virtiofs_emu_ll_trace_status(cb_data->cb, res->status);
     if (res->status != NFS4_OK) {
         cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
         vnfs_error("FUSE_RELEASE:%lu - NFS error=%d, FUSE error=%d\n",
@@ -436,7 +677,7 @@ void release_cb(struct rpc_context *rpc, int status, void *data,
 
 ret:;
     struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
-    mpool2_free(vnfs->p, cb_data);
+    mpool2_free(cb_data->conn->p, cb_data);
     cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
 }
 
@@ -451,17 +692,21 @@ int release(struct fuse_session *se, struct virtionfs *vnfs,
         out_hdr->error = -ENOENT;
         return 0;
     }
+    // Nothing may change before this, an EBUSY hands us the same request again
+    struct vnfs_conn *conn = vnfs_get_conn(vnfs);
+    if (!vnfs4_conn_has_room(conn))
+        return EBUSY;
+    struct release_cb_data *cb_data = mpool2_alloc(conn->p);
+    if (!cb_data) {
+        out_hdr->error = -ENOMEM;
+        return 0;
+    }
+
     uint32_t old_nopen = atomic_fetch_sub(&i->nopen, 1);
     // If there are still opens out there
     if (old_nopen > 1) {
         // then we don't actually release the inode
-        return 0;
-    }
-
-    struct vnfs_conn *conn = vnfs_get_conn(vnfs);
-    struct release_cb_data *cb_data = mpool2_alloc(vnfs->p);
-    if (!cb_data) {
-        out_hdr->error = -ENOMEM;
+        mpool2_free(conn->p, cb_data);
         return 0;
     }
 
@@ -504,7 +749,7 @@ int release(struct fuse_session *se, struct virtionfs *vnfs,
 
     if (rpc_nfs4_compound_async(conn->rpc, release_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send NFS:CLOSE request\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
@@ -523,13 +768,14 @@ void vfsync_cb(struct rpc_context *rpc, int status, void *data,
     }
 #endif
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_FSYNC:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     COMPOUND4res *res = data;
+    virtiofs_emu_ll_trace_status(cb_data->cb, res->status);
     if (res->status != NFS4_OK) {
         cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
         vnfs_error("FUSE_FSYNC:%lu - NFS error=%d, FUSE error=%d\n",
@@ -539,7 +785,7 @@ void vfsync_cb(struct rpc_context *rpc, int status, void *data,
 
 ret:;
     struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
-    mpool2_free(vnfs->p, cb_data);
+    mpool2_free(cb_data->conn->p, cb_data);
     cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
 }
 
@@ -550,7 +796,9 @@ int vfsync(struct fuse_session *se, struct virtionfs *vnfs,
            struct snap_fs_dev_io_done_ctx *cb)
 {
     struct vnfs_conn *conn = vnfs_get_conn(vnfs);
-    struct fsync_cb_data *cb_data = mpool2_alloc(vnfs->p);
+    if (!vnfs4_conn_has_room(conn))
+        return EBUSY;
+    struct fsync_cb_data *cb_data = mpool2_alloc(conn->p);
     if (!cb_data) {
         out_hdr->error = -ENOMEM;
         return 0;
@@ -573,7 +821,7 @@ int vfsync(struct fuse_session *se, struct virtionfs *vnfs,
     struct inode *i = vnfs4_op_putfh(vnfs, &op[1], in_hdr->nodeid);
     if (!i) {
     	vnfs_error("Invalid nodeid supplied\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -ENOENT;
         return 0;
     }
@@ -593,7 +841,7 @@ int vfsync(struct fuse_session *se, struct virtionfs *vnfs,
 
     if (rpc_nfs4_compound_async(conn->rpc, vfsync_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send NFS:commit request\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
@@ -613,13 +861,16 @@ void vwrite_cb(struct rpc_context *rpc, int status, void *data,
     }
 #endif
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
+    if (cb_data->io == VNFS_IO_LAZY_OPEN)
+        vnfs_io_opened(vnfs, cb_data->i, status == RPC_STATUS_SUCCESS ? data : NULL);
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_WRITE:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     COMPOUND4res *res = data;
+    virtiofs_emu_ll_trace_status(cb_data->cb, res->status);
     if (res->status != NFS4_OK) {
         cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
         vnfs_error("FUSE_WRITE:%lu - NFS error=%d, FUSE error=%d\n",
@@ -627,14 +878,14 @@ void vwrite_cb(struct rpc_context *rpc, int status, void *data,
         goto ret;
     }
     
-    uint32_t written =  res->resarray.resarray_val[2].nfs_resop4_u.opwrite.WRITE4res_u.resok4.count;
+    uint32_t written =  res->resarray.resarray_val[cb_data->nop].nfs_resop4_u.opwrite.WRITE4res_u.resok4.count;
     cb_data->out_write->size = written;
 
     cb_data->out_hdr->len += sizeof(*cb_data->out_write);
 
 ret:;
     struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
-    mpool2_free(vnfs->p, cb_data);
+    mpool2_free(cb_data->conn->p, cb_data);
     cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
 }
 
@@ -654,43 +905,54 @@ int vwrite(struct fuse_session *se, struct virtionfs *vnfs,
 #endif
 
     struct vnfs_conn *conn = vnfs_get_conn(vnfs);
-    struct write_cb_data *cb_data = mpool2_alloc(vnfs->p);
+    if (!vnfs4_conn_has_room(conn))
+        return EBUSY;
+    struct inode *i = inode_table_get(vnfs->inodes, in_hdr->nodeid);
+    if (!i) {
+    	vnfs_error("Invalid nodeid supplied\n");
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+    struct write_cb_data *cb_data = mpool2_alloc(conn->p);
     if (!cb_data) {
         out_hdr->error = -ENOMEM;
         return 0;
     }
+    cb_data->io = vnfs_io_start(vnfs, se, i, true);
+    if (cb_data->io == VNFS_IO_BUSY) {
+        // Waits in the poller until the OPEN of the other compound is in
+        mpool2_free(conn->p, cb_data);
+        return EBUSY;
+    }
 
     cb_data->cb = cb;
     cb_data->vnfs = vnfs;
     cb_data->conn = conn;
+    cb_data->i = i;
     cb_data->in_write = in_write;
     cb_data->in_iov = in_iov;
     cb_data->out_hdr = out_hdr;
     cb_data->out_write = out_write;
 
     COMPOUND4args args;
-    nfs_argop4 op[3];
+    nfs_argop4 op[5];
     memset(&args.tag, 0, sizeof(args.tag));
     args.minorversion = NFS4DOT1_MINOR;
-    args.argarray.argarray_len = sizeof(op) / sizeof(nfs_argop4);
     args.argarray.argarray_val = op;
 
     cb_data->slotid = vnfs4_op_sequence(&op[0], conn, false);
-    // PUTFH
-    struct inode *i = vnfs4_op_putfh_open(vnfs, &op[1], in_hdr->nodeid);
-    if (!i) {
-    	vnfs_error("Invalid nodeid supplied\n");
-        mpool2_free(vnfs->p, cb_data);
-        out_hdr->error = -ENOENT;
-        return 0;
-    }
+    // PUTFH (OPEN, GETFH)
+    stateid4 stateid;
+    uint32_t n = vnfs4_op_io(vnfs, op, i, cb_data->io, &cb_data->owner_val, &stateid);
+    cb_data->nop = n;
+    args.argarray.argarray_len = n + 1;
     // WRITE
-    op[2].argop = OP_WRITE;
-    op[2].nfs_argop4_u.opwrite.stateid = i->open_stateid;
-    op[2].nfs_argop4_u.opwrite.offset = in_write->offset;
-    op[2].nfs_argop4_u.opwrite.stable = UNSTABLE4;
-    op[2].nfs_argop4_u.opwrite.data.data_val = in_iov->iov_base;
-    op[2].nfs_argop4_u.opwrite.data.data_len = in_iov->iov_len;
+    op[n].argop = OP_WRITE;
+    op[n].nfs_argop4_u.opwrite.stateid = stateid;
+    op[n].nfs_argop4_u.opwrite.offset = in_write->offset;
+    op[n].nfs_argop4_u.opwrite.stable = UNSTABLE4;
+    op[n].nfs_argop4_u.opwrite.data.data_val = in_iov->iov_base;
+    op[n].nfs_argop4_u.opwrite.data.data_len = in_iov->iov_len;
 
     // libnfs by default allocates a buffer for the fully encoded NFS packet (rpc_pdu)
     // of sizeof(rpc header) + sizeof(COMPOUNF4args) + ZDR_ENCODEBUF_MINSIZE + alloc_hint
@@ -710,7 +972,9 @@ int vwrite(struct fuse_session *se, struct virtionfs *vnfs,
 #endif
     if (rpc_nfs4_compound_async2(conn->rpc, vwrite_cb, &args, cb_data, alloc_hint) != 0) {
     	vnfs_error("Failed to send NFS:write request\n");
-        mpool2_free(vnfs->p, cb_data);
+        if (cb_data->io == VNFS_IO_LAZY_OPEN)
+            vnfs_io_opened(vnfs, i, NULL);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
@@ -741,19 +1005,32 @@ static size_t iovec_write_buf(struct iovec *iov, int iovcnt,
     return written;
 }
 
+static bool vread_again(struct read_cb_data *cb_data);
+
 void vread_cb(struct rpc_context *rpc, int status, void *data,
               void *private_data)
 {
     struct read_cb_data *cb_data = (struct read_cb_data *)private_data;
     struct virtionfs *vnfs = cb_data->vnfs;
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    if (cb_data->io == VNFS_IO_LAZY_OPEN)
+        vnfs_io_opened(vnfs, cb_data->i, status == RPC_STATUS_SUCCESS ? data : NULL);
+    // Send it again on the same slot, this time with open state
+    if (status == RPC_STATUS_SUCCESS && cb_data->io == VNFS_IO_ANONYMOUS &&
+            vnfs_io_refused(((COMPOUND4res *) data)->status)) {
+        atomic_store(&cb_data->i->open_wanted, true);
+        if (vread_again(cb_data))
+            return;
+    }
+
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_READ:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     COMPOUND4res *res = data;
+    virtiofs_emu_ll_trace_status(cb_data->cb, res->status);
     if (res->status != NFS4_OK) {
         cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
         vnfs_error("FUSE_READ:%lu - NFS error=%d, FUSE error=%d\n",
@@ -761,9 +1038,9 @@ void vread_cb(struct rpc_context *rpc, int status, void *data,
         goto ret;
     }
 
-    char *buf = res->resarray.resarray_val[2].nfs_resop4_u.opread.READ4res_u
+    char *buf = res->resarray.resarray_val[cb_data->nop].nfs_resop4_u.opread.READ4res_u
                 .resok4.data.data_val;
-    uint32_t len = res->resarray.resarray_val[2].nfs_resop4_u.opread.READ4res_u
+    uint32_t len = res->resarray.resarray_val[cb_data->nop].nfs_resop4_u.opread.READ4res_u
                    .resok4.data.data_len;
     // Fill the iov that we return to the host
     if (cb_data->out_iovcnt >= 1) {
@@ -773,54 +1050,121 @@ void vread_cb(struct rpc_context *rpc, int status, void *data,
 
 ret:;
     struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
-    mpool2_free(vnfs->p, cb_data);
+    mpool2_free(cb_data->conn->p, cb_data);
     cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
 }
 
+// Sends the READ of cb_data, again is for a resend on its slot from vread_cb
+static int vread_send(struct read_cb_data *cb_data, bool again)
+{
+    if (cb_data->io == VNFS_IO_BUSY)
+        return -1;
+    struct vnfs_conn *conn = cb_data->conn;
+
+    COMPOUND4args args;
+    nfs_argop4 op[5];
+    memset(&args.tag, 0, sizeof(args.tag));
+    args.minorversion = NFS4DOT1_MINOR;
+    args.argarray.argarray_val = op;
+
+    if (again)
+        vnfs4_op_sequence_again(&op[0], conn, cb_data->slotid);
+    else
+        cb_data->slotid = vnfs4_op_sequence(&op[0], conn, false);
+    // PUTFH (OPEN, GETFH)
+    stateid4 stateid;
+    uint32_t n = vnfs4_op_io(cb_data->vnfs, op, cb_data->i, cb_data->io, &cb_data->owner_val, &stateid);
+    cb_data->nop = n;
+    args.argarray.argarray_len = n + 1;
+    // READ
+    op[n].argop = OP_READ;
+    op[n].nfs_argop4_u.opread.stateid = stateid;
+    op[n].nfs_argop4_u.opread.count = cb_data->in_read->size;
+    op[n].nfs_argop4_u.opread.offset = cb_data->in_read->offset;
+
+    if (rpc_nfs4_compound_async(conn->rpc, vread_cb, &args, cb_data) != 0) {
+    	vnfs_error("Failed to send NFS:READ request\n");
+        if (cb_data->io == VNFS_IO_LAZY_OPEN)
+            vnfs_io_opened(cb_data->vnfs, cb_data->i, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+// Resends the READ of cb_data on its slot with the open state the file needs now. While
+// another compound is OPENing the file it waits on the inode until vnfs_io_opened.
+// Returns false if it could not be sent, the caller completes it then.
+static bool vread_again(struct read_cb_data *cb_data)
+{
+    struct inode *i = cb_data->i;
+    cb_data->io = vnfs_io_start(cb_data->vnfs, cb_data->se, i, false);
+    if (cb_data->io != VNFS_IO_BUSY)
+        return vread_send(cb_data, true) == 0;
+
+    cb_data->next = atomic_load(&i->io_waiters);
+    while (!atomic_compare_exchange_weak(&i->io_waiters, &cb_data->next, cb_data))
+        ;
+    // The OPEN might have finished before we were on the list
+    if (!atomic_load(&i->opening))
+        vnfs_io_wake(cb_data->vnfs, i);
+    return true;
+}
+
+// Sends the READs that waited for the OPEN of i, from whichever thread got its reply
+static void vnfs_io_wake(struct virtionfs *vnfs, struct inode *i)
+{
+    struct read_cb_data *cb_data = atomic_exchange(&i->io_waiters, NULL);
+    while (cb_data) {
+        struct read_cb_data *next = cb_data->next;
+        if (!vread_again(cb_data)) {
+            vnfs4_slot_free(cb_data->conn, cb_data->slotid);
+            cb_data->out_hdr->error = -EREMOTEIO;
+            struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
+            mpool2_free(cb_data->conn->p, cb_data);
+            cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
+        }
+        cb_data = next;
+    }
+}
+
 int vread(struct fuse_session *se, struct virtionfs *vnfs,
          struct fuse_in_header *in_hdr, struct fuse_read_in *in_read,
          struct fuse_out_header *out_hdr, struct iovec *out_iov, int out_iovcnt,
          struct snap_fs_dev_io_done_ctx *cb)
 {
     struct vnfs_conn *conn = vnfs_get_conn(vnfs);
-    struct read_cb_data *cb_data = mpool2_alloc(vnfs->p);
+    if (!vnfs4_conn_has_room(conn))
+        return EBUSY;
+    struct inode *i = inode_table_get(vnfs->inodes, in_hdr->nodeid);
+    if (!i) {
+    	vnfs_error("Invalid nodeid supplied\n");
+        out_hdr->error = -ENOENT;
+        return 0;
+    }
+    struct read_cb_data *cb_data = mpool2_alloc(conn->p);
     if (!cb_data) {
         out_hdr->error = -ENOMEM;
         return 0;
     }
+    cb_data->io = vnfs_io_start(vnfs, se, i, false);
+    if (cb_data->io == VNFS_IO_BUSY) {
+        // Waits in the poller until the OPEN of the other compound is in
+        mpool2_free(conn->p, cb_data);
+        return EBUSY;
+    }
 
     cb_data->cb = cb;
     cb_data->vnfs = vnfs;
+    cb_data->se = se;
     cb_data->conn = conn;
+    cb_data->i = i;
+    cb_data->in_read = in_read;
     cb_data->out_hdr = out_hdr;
     cb_data->out_iov = out_iov;
     cb_data->out_iovcnt = out_iovcnt;
 
-    COMPOUND4args args;
-    nfs_argop4 op[3];
-    memset(&args.tag, 0, sizeof(args.tag));
-    args.minorversion = NFS4DOT1_MINOR;
-    args.argarray.argarray_len = sizeof(op) / sizeof(nfs_argop4);
-    args.argarray.argarray_val = op;
-
-    cb_data->slotid = vnfs4_op_sequence(&op[0], conn, false);
-    // PUTFH
-    struct inode *i = vnfs4_op_putfh_open(vnfs, &op[1], in_hdr->nodeid);
-    if (!i) {
-    	vnfs_error("Invalid nodeid supplied\n");
-        mpool2_free(vnfs->p, cb_data);
-        out_hdr->error = -ENOENT;
-        return 0;
-    }
-    // OPEN
-    op[2].argop = OP_READ;
-    op[2].nfs_argop4_u.opread.stateid = i->open_stateid;
-    op[2].nfs_argop4_u.opread.count = in_read->size;
-    op[2].nfs_argop4_u.opread.offset = in_read->offset;
-
-    if (rpc_nfs4_compound_async(conn->rpc, vread_cb, &args, cb_data) != 0) {
-    	vnfs_error("Failed to send NFS:READ request\n");
-        mpool2_free(vnfs->p, cb_data);
+    if (vread_send(cb_data, false) != 0) {
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
@@ -828,6 +1172,52 @@ int vread(struct fuse_session *se, struct virtionfs *vnfs,
     return EWOULDBLOCK;
 }
 
+// Whether the guest of device dev can keep its page cache of i: it opened the file before
+// and the change attribute did not move since (close-to-open). Every guest has its own
+// page cache, so another guest's open at the new change attribute does not make it fresh.
+// The guests of devices from 64 on always drop it. A change of 0 (unknown) drops it too.
+static bool vopen_keep_cache(struct inode *i, uint32_t dev, uint64_t change)
+{
+    uint64_t bit = dev < 64 ? 1UL << dev : 0;
+    bool keep = false;
+    pthread_spin_lock(&i->open_lock);
+    if (!change) {
+        i->open_devs &= ~bit;
+    } else if (i->open_change == change) {
+        keep = i->open_devs & bit;
+        i->open_devs |= bit;
+    } else {
+        // The other guests' caches are stale now
+        i->open_change = change;
+        i->open_devs = bit;
+    }
+    pthread_spin_unlock(&i->open_lock);
+    return keep;
+}
+
+// The page cache of the guest for a file that changed since its last OPEN is stale (close-to-open),
+// otherwise it is kept. Files matching a direct_io pattern or over its size bypass it.
+static uint32_t vopen_flags(struct virtionfs *vnfs, struct fuse_session *se, struct inode *i,
+                            nfs_resop4 *getattr_res)
+{
+    attrlist4 *attrs = &getattr_res->nfs_resop4_u.opgetattr.GETATTR4res_u.resok4.obj_attributes.attr_vals;
+    struct fuse_attr attr;
+    uint64_t change;
+    uint32_t flags = 0;
+    atomic_fetch_add(&vnfs->opens, 1);
+    if (nfs_parse_attributes(&attr, &change, attrs->attrlist4_val, attrs->attrlist4_len) != 0) {
+        // Without the change attribute nothing is known, drop the cache
+        vopen_keep_cache(i, se->dev, 0);
+    } else if (i->direct_io_name || fuse_ll_direct_io_size(&vnfs->direct_io, attr.size)) {
+        flags = FOPEN_DIRECT_IO;
+        atomic_fetch_add(&vnfs->opens_direct, 1);
+    } else if (vopen_keep_cache(i, se->dev, change)) {
+        flags = FOPEN_KEEP_CACHE;
+        atomic_fetch_add(&vnfs->opens_kept, 1);
+    }
+    return flags;
+}
+
 void vopen_cb(struct rpc_context *rpc, int status, void *data,
               void *private_data)
 {
@@ -841,13 +1231,26 @@ void vopen_cb(struct rpc_context *rpc, int status, void *data,
     }
 #endif
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
+    if (cb_data->reopen) {
+        // The file is open, without attributes the guest just drops its page cache
+        COMPOUND4res *res = data;
+        memset(cb_data->out_open, 0, sizeof(*cb_data->out_open));
+        if (status == RPC_STATUS_SUCCESS && res->status == NFS4_OK)
+            cb_data->out_open->open_flags = vopen_flags(vnfs, cb_data->se, cb_data->i,
+                                                        &res->resarray.resarray_val[2]);
+        else
+            vopen_keep_cache(cb_data->i, cb_data->se->dev, 0);
+        cb_data->out_hdr->len += sizeof(*cb_data->out_open);
+        goto ret;
+    }
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_OPEN:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     COMPOUND4res *res = data;
+    virtiofs_emu_ll_trace_status(cb_data->cb, res->status);
     if (res->status != NFS4_OK) {
         cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
         vnfs_error("FUSE_OPEN:%lu - NFS error=%d, FUSE error=%d\n",
@@ -866,9 +1269,9 @@ void vopen_cb(struct rpc_context *rpc, int status, void *data,
         goto ret;
     }
 
-    // We don't use the FUSE:fh, nor do we have any open flags at the moment
-    // so set the out_open to zeros
+    // We don't use the FUSE:fh
     memset(cb_data->out_open, 0, sizeof(*cb_data->out_open));
+    cb_data->out_open->open_flags = vopen_flags(vnfs, cb_data->se, i, &res->resarray.resarray_val[4]);
     cb_data->out_hdr->len += sizeof(*cb_data->out_open);
     OPEN4resok *openok = &res->resarray.resarray_val[2].nfs_resop4_u.opopen.OPEN4res_u.resok4;
     if (openok->rflags & OPEN4_RESULT_CONFIRM) {
@@ -879,10 +1282,12 @@ void vopen_cb(struct rpc_context *rpc, int status, void *data,
     }
     // Save the stateid we were given for the opened handle
     i->open_stateid = openok->stateid;
+    // Only now the next open can use the FH and stateid
+    atomic_fetch_add(&i->nopen, 1);
 
 ret:;
     struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
-    mpool2_free(vnfs->p, cb_data);
+    mpool2_free(cb_data->conn->p, cb_data);
     cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
 }
 
@@ -898,17 +1303,10 @@ int vopen(struct fuse_session *se, struct virtionfs *vnfs,
         out_hdr->error = -ENOENT;
         return 0;
     }
-    // If the file is already opened, then just return
-    if (i->nopen > 0) {
-        atomic_fetch_add(&i->nopen, 1);
-        // We don't use the FUSE:fh, nor do we have any open flags at the moment
-        // so set the out_open to zeros
-        memset(out_open, 0, sizeof(*out_open));
-        out_hdr->len += sizeof(*out_open);
-    }
-
     struct vnfs_conn *conn = vnfs_get_conn(vnfs);
-    struct open_cb_data *cb_data = mpool2_alloc(vnfs->p);
+    if (!vnfs4_conn_has_room(conn))
+        return EBUSY;
+    struct open_cb_data *cb_data = mpool2_alloc(conn->p);
     if (!cb_data) {
         out_hdr->error = -ENOMEM;
         return 0;
@@ -916,12 +1314,13 @@ int vopen(struct fuse_session *se, struct virtionfs *vnfs,
 
     cb_data->cb = cb;
     cb_data->vnfs = vnfs;
+    cb_data->se = se;
     cb_data->conn = conn;
     cb_data->out_hdr = out_hdr;
     cb_data->out_open = out_open;
 
     COMPOUND4args args;
-    nfs_argop4 op[4];
+    nfs_argop4 op[5];
     memset(&args.tag, 0, sizeof(args.tag));
     args.minorversion = NFS4DOT1_MINOR;
     args.argarray.argarray_len = sizeof(op) / sizeof(nfs_argop4);
@@ -934,29 +1333,21 @@ int vopen(struct fuse_session *se, struct virtionfs *vnfs,
     op[1].nfs_argop4_u.opputfh.object.nfs_fh4_val = i->fh.val;
     op[1].nfs_argop4_u.opputfh.object.nfs_fh4_len = i->fh.len;
 
-    // OPEN
-    op[2].argop = OP_OPEN;
-    memset(&op[2].nfs_argop4_u.opopen, 0, sizeof(OPEN4args));
-    // Windows share stuff, this means normal operation in UNIX world
-    op[2].nfs_argop4_u.opopen.share_access = OPEN4_SHARE_ACCESS_BOTH;
-    op[2].nfs_argop4_u.opopen.share_deny = OPEN4_SHARE_DENY_NONE;
-    // Don't use this because we don't do anything special with the share, so set to zero
-    op[2].nfs_argop4_u.opopen.seqid = 0;
-    // Set the owner with the clientid and the unique owner number (32 bit should be safe)
-    // The clientid stems from the setclientid() handshake
-    op[2].nfs_argop4_u.opopen.owner.clientid = vnfs->clientid;
-    // We store this so that the reference stays alive
-    cb_data->owner_val = atomic_fetch_add(&vnfs->open_owner_counter, 1);
-    op[2].nfs_argop4_u.opopen.owner.owner.owner_val = (char *) &cb_data->owner_val;
-    op[2].nfs_argop4_u.opopen.owner.owner.owner_len = sizeof(cb_data->owner_val);
-    // Tell the server we want to open the file in the current FH dir (aka the parent dir)
-    // with the specified filename
-    op[2].nfs_argop4_u.opopen.claim.claim = CLAIM_FH;
-    // FUSE:OPEN cannot create a file
-    op[2].nfs_argop4_u.opopen.openhow.opentype = OPEN4_NOCREATE;
-
-    // GETFH
-    op[3].argop = OP_GETFH;
+    // If the file is already opened, the open is done but the guest's page cache is only
+    // as good as the change attribute says
+    cb_data->reopen = atomic_load(&i->nopen) > 0;
+    if (cb_data->reopen) {
+        atomic_fetch_add(&i->nopen, 1);
+        nfs4_op_getattr(&op[2], standard_attributes, 2);
+        args.argarray.argarray_len = 3;
+    } else {
+        // OPEN
+        vnfs4_op_open_fh(vnfs, &op[2], &cb_data->owner_val);
+        // GETFH
+        op[3].argop = OP_GETFH;
+        // GETATTR, the size and change attribute decide how the guest caches the file
+        nfs4_op_getattr(&op[4], standard_attributes, 2);
+    }
 
 #ifdef LATENCY_MEASURING_ENABLED
     if (vnfs->nthreads == 1) {
@@ -966,7 +1357,9 @@ int vopen(struct fuse_session *se, struct virtionfs *vnfs,
 #endif
     if (rpc_nfs4_compound_async(conn->rpc, vopen_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send NFS:open request\n");
-        mpool2_free(vnfs->p, cb_data);
+        if (cb_data->reopen)
+            atomic_fetch_sub(&i->nopen, 1);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
@@ -986,13 +1379,14 @@ void setattr_cb(struct rpc_context *rpc, int status, void *data,
     }
 #endif
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_SETATTR:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     COMPOUND4res *res = data;
+    virtiofs_emu_ll_trace_status(cb_data->cb, res->status);
     if (res->status != NFS4_OK) {
         cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
         vnfs_error("FUSE_SETATTR:%lu - NFS error=%d, FUSE error=%d\n",
@@ -1003,12 +1397,15 @@ void setattr_cb(struct rpc_context *rpc, int status, void *data,
     GETATTR4resok *resok = &res->resarray.resarray_val[2].nfs_resop4_u.opgetattr.GETATTR4res_u.resok4;
     char *attrs = resok->obj_attributes.attr_vals.attrlist4_val;
     u_int attrs_len = resok->obj_attributes.attr_vals.attrlist4_len;
-    if (nfs_parse_attributes(&cb_data->out_attr->attr, attrs, attrs_len) == 0) {
+    uint64_t change;
+    if (nfs_parse_attributes(&cb_data->out_attr->attr, &change, attrs, attrs_len) == 0) {
         // This is not filled in by the parse_attributes fn
         cb_data->out_attr->attr.rdev = 0;
-        cb_data->out_attr->attr_valid = 0;
-        cb_data->out_attr->attr_valid_nsec = 0;
-        cb_data->out_hdr->len += vnfs->se->conn.proto_minor < 9 ?
+        // Our own change, the guest knows about it
+        uint32_t ttl = vnfs_attr_timeout(vnfs, cb_data->i, change, cb_data->se);
+        cb_data->out_attr->attr_valid = ttl / 1000;
+        cb_data->out_attr->attr_valid_nsec = (ttl % 1000) * 1000000;
+        cb_data->out_hdr->len += cb_data->se->conn.proto_minor < 9 ?
             FUSE_COMPAT_ATTR_OUT_SIZE : sizeof(*cb_data->out_attr);
     } else {
         cb_data->out_hdr->error = -EREMOTEIO;
@@ -1018,7 +1415,7 @@ ret:;
     free(cb_data->bitmap);
     free(cb_data->attrlist);
     struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
-    mpool2_free(vnfs->p, cb_data);
+    mpool2_free(cb_data->conn->p, cb_data);
     cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
 }
 
@@ -1028,7 +1425,9 @@ int setattr(struct fuse_session *se, struct virtionfs *vnfs,
             struct snap_fs_dev_io_done_ctx *cb)
 {
     struct vnfs_conn *conn = vnfs_get_conn(vnfs);
-    struct setattr_cb_data *cb_data = mpool2_alloc(vnfs->p);
+    if (!vnfs4_conn_has_room(conn))
+        return EBUSY;
+    struct setattr_cb_data *cb_data = mpool2_alloc(conn->p);
     if (!cb_data) {
         out_hdr->error = -ENOMEM;
         return 0;
@@ -1036,6 +1435,7 @@ int setattr(struct fuse_session *se, struct virtionfs *vnfs,
 
     cb_data->cb = cb;
     cb_data->vnfs = vnfs;
+    cb_data->se = se;
     cb_data->conn = conn;
     cb_data->out_hdr = out_hdr;
     cb_data->out_attr = out_attr;
@@ -1051,10 +1451,11 @@ int setattr(struct fuse_session *se, struct virtionfs *vnfs,
     struct inode *i = vnfs4_op_putfh(vnfs, &op[1], in_hdr->nodeid);
     if (!i) {
     	vnfs_error("Invalid nodeid supplied\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -ENOENT;
         return 0;
     }
+    cb_data->i = i;
 
     /* TODO if locking is supported, put the stateid in here
      * zeroed stateid means anonymous aka
@@ -1064,7 +1465,7 @@ int setattr(struct fuse_session *se, struct virtionfs *vnfs,
     op[2].argop = OP_SETATTR;
     memset(&op[2].nfs_argop4_u.opsetattr.stateid, 0, sizeof(stateid4));
 
-    uint64_t *bitmap = mpool2_alloc(vnfs->p);
+    uint64_t *bitmap = mpool2_alloc(conn->p);
     bitmap4 attrsmask;
     attrsmask.bitmap4_len = sizeof(*bitmap);
     attrsmask.bitmap4_val = (uint32_t *) bitmap;
@@ -1104,7 +1505,7 @@ int setattr(struct fuse_session *se, struct virtionfs *vnfs,
 #endif
     if (rpc_nfs4_compound_async(conn->rpc, setattr_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send nfs4 SETATTR request\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
@@ -1123,13 +1524,14 @@ void statfs_cb(struct rpc_context *rpc, int status, void *data,
     }
 #endif
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_STATFS:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     COMPOUND4res *res = data;
+    virtiofs_emu_ll_trace_status(cb_data->cb, res->status);
     if (res->status != NFS4_OK) {
         cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
         vnfs_error("FUSE_STATFS:%lu - NFS error=%d, FUSE error=%d\n",
@@ -1143,12 +1545,12 @@ void statfs_cb(struct rpc_context *rpc, int status, void *data,
     if (nfs_parse_statfs(&cb_data->out_statfs->st, attrs, attrs_len) != 0) {
         cb_data->out_hdr->error = -EREMOTEIO;
     }
-    cb_data->out_hdr->len = vnfs->se->conn.proto_minor < 4 ?
+    cb_data->out_hdr->len = cb_data->se->conn.proto_minor < 4 ?
         FUSE_COMPAT_STATFS_SIZE : sizeof(*cb_data->out_statfs);
 
 ret:;
     struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
-    mpool2_free(vnfs->p, cb_data);
+    mpool2_free(cb_data->conn->p, cb_data);
     cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
 }
 
@@ -1159,7 +1561,9 @@ int statfs(struct fuse_session *se, struct virtionfs *vnfs,
            struct snap_fs_dev_io_done_ctx *cb)
 {
     struct vnfs_conn *conn = vnfs_get_conn(vnfs);
-    struct statfs_cb_data *cb_data = mpool2_alloc(vnfs->p);
+    if (!vnfs4_conn_has_room(conn))
+        return EBUSY;
+    struct statfs_cb_data *cb_data = mpool2_alloc(conn->p);
     if (!cb_data) {
         out_hdr->error = -ENOMEM;
         return 0;
@@ -1167,6 +1571,7 @@ int statfs(struct fuse_session *se, struct virtionfs *vnfs,
 
     cb_data->cb = cb;
     cb_data->vnfs = vnfs;
+    cb_data->se = se;
     cb_data->conn = conn;
     cb_data->out_hdr = out_hdr;
     cb_data->out_statfs = stat;
@@ -1197,7 +1602,7 @@ int statfs(struct fuse_session *se, struct virtionfs *vnfs,
 
     if (rpc_nfs4_compound_async(conn->rpc, statfs_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send FUSE:statfs request\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
@@ -1216,13 +1621,14 @@ void lookup_cb(struct rpc_context *rpc, int status, void *data,
     }
 #endif
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_LOOKUP:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     COMPOUND4res *res = data;
+    virtiofs_emu_ll_trace_status(cb_data->cb, res->status);
     if (res->status != NFS4_OK) {
         cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
         vnfs_error("FUSE_LOOKUP:%lu - NFS error=%d, FUSE error=%d\n",
@@ -1230,19 +1636,25 @@ void lookup_cb(struct rpc_context *rpc, int status, void *data,
         goto ret;
     }
 
-    char *attrs = res->resarray.resarray_val[3].nfs_resop4_u.opgetattr.GETATTR4res_u.resok4.obj_attributes.attr_vals.attrlist4_val;
-    u_int attrs_len = res->resarray.resarray_val[3].nfs_resop4_u.opgetattr.GETATTR4res_u.resok4.obj_attributes.attr_vals.attrlist4_len;
-    int ret = nfs_parse_attributes(&cb_data->out_entry->attr, attrs, attrs_len);
+    attrlist4 *pattrs = &res->resarray.resarray_val[2].nfs_resop4_u.opgetattr.GETATTR4res_u.resok4.obj_attributes.attr_vals;
+    uint64_t pchange;
+    if (nfs_parse_change(&pchange, pattrs->attrlist4_val, pattrs->attrlist4_len) != 0) {
+        cb_data->out_hdr->error = -EREMOTEIO;
+        goto ret;
+    }
+    char *attrs = res->resarray.resarray_val[4].nfs_resop4_u.opgetattr.GETATTR4res_u.resok4.obj_attributes.attr_vals.attrlist4_val;
+    u_int attrs_len = res->resarray.resarray_val[4].nfs_resop4_u.opgetattr.GETATTR4res_u.resok4.obj_attributes.attr_vals.attrlist4_len;
+    uint64_t change;
+    int ret = nfs_parse_attributes(&cb_data->out_entry->attr, &change, attrs, attrs_len);
     if (ret != 0) {
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     fattr4_fileid fileid = cb_data->out_entry->attr.ino;
-    // Finish the attr
-    cb_data->out_entry->attr_valid = 0;
-    cb_data->out_entry->attr_valid_nsec = 0;
-    cb_data->out_entry->entry_valid = 0;
-    cb_data->out_entry->entry_valid_nsec = 0;
+    // The name stays valid as long as its directory does not change
+    uint32_t ttl = vnfs_attr_timeout(vnfs, cb_data->pi, pchange, NULL);
+    cb_data->out_entry->entry_valid = ttl / 1000;
+    cb_data->out_entry->entry_valid_nsec = (ttl % 1000) * 1000000;
     // Taken from the nfs_parse_attributes
     cb_data->out_entry->nodeid = fileid;
     cb_data->out_entry->generation = 0;
@@ -1254,24 +1666,29 @@ void lookup_cb(struct rpc_context *rpc, int status, void *data,
         goto ret;
     }
     atomic_fetch_add(&i->nlookup, 1);
+    if (cb_data->direct_io)
+        i->direct_io_name = true;
     cb_data->out_entry->generation = i->generation;
+    ttl = vnfs_attr_timeout(vnfs, i, change, NULL);
+    cb_data->out_entry->attr_valid = ttl / 1000;
+    cb_data->out_entry->attr_valid_nsec = (ttl % 1000) * 1000000;
 
     if (i->fh.len == 0) {
         // Retreive the FH from the res and set it in the inode
         // it's stored in the inode for later use ex. getattr when it uses the nodeid
-        int ret = nfs4_clone_fh(&i->fh, &res->resarray.resarray_val[4].nfs_resop4_u.opgetfh.GETFH4res_u.resok4.object);
+        int ret = nfs4_clone_fh(&i->fh, &res->resarray.resarray_val[5].nfs_resop4_u.opgetfh.GETFH4res_u.resok4.object);
         if (ret < 0) {
             vnfs_error("Couldn't clone fh with fileid: %lu\n", fileid);
             cb_data->out_hdr->error = -ENOMEM;
             goto ret;
         }
     }
-    cb_data->out_hdr->len += vnfs->se->conn.proto_minor < 9 ?
+    cb_data->out_hdr->len += cb_data->se->conn.proto_minor < 9 ?
         FUSE_COMPAT_ENTRY_OUT_SIZE : sizeof(*cb_data->out_entry);
 
 ret:;
     struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
-    mpool2_free(vnfs->p, cb_data);
+    mpool2_free(cb_data->conn->p, cb_data);
     cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
 }
 
@@ -1281,7 +1698,9 @@ int lookup(struct fuse_session *se, struct virtionfs *vnfs,
            struct snap_fs_dev_io_done_ctx *cb)
 {
     struct vnfs_conn *conn = vnfs_get_conn(vnfs);
-    struct lookup_cb_data *cb_data = mpool2_alloc(vnfs->p);
+    if (!vnfs4_conn_has_room(conn))
+        return EBUSY;
+    struct lookup_cb_data *cb_data = mpool2_alloc(conn->p);
     if (!cb_data) {
         out_hdr->error = -ENOMEM;
         return 0;
@@ -1289,12 +1708,13 @@ int lookup(struct fuse_session *se, struct virtionfs *vnfs,
 
     cb_data->cb = cb;
     cb_data->vnfs = vnfs;
+    cb_data->se = se;
     cb_data->conn = conn;
     cb_data->out_hdr = out_hdr;
     cb_data->out_entry = out_entry;
 
     COMPOUND4args args;
-    nfs_argop4 op[5];
+    nfs_argop4 op[6];
     memset(&args.tag, 0, sizeof(args.tag));
     args.minorversion = NFS4DOT1_MINOR;
     args.argarray.argarray_len = sizeof(op) / sizeof(nfs_argop4);
@@ -1305,17 +1725,21 @@ int lookup(struct fuse_session *se, struct virtionfs *vnfs,
     struct inode *pi = vnfs4_op_putfh(vnfs, &op[1], in_hdr->nodeid);
     if (!pi) {
     	vnfs_error("Invalid nodeid supplied\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -ENOENT;
         return 0;
     }
+    cb_data->pi = pi;
+    cb_data->direct_io = fuse_ll_direct_io_name(&vnfs->direct_io, in_name);
+    // GETATTR of the directory, only its change attribute
+    nfs4_op_getattr(&op[2], change_attributes, 1);
     // LOOKUP
-    nfs4_op_lookup(&op[2], in_name);
+    nfs4_op_lookup(&op[3], in_name);
     // FH now replaced with in_name's FH
     // GETATTR
-    nfs4_op_getattr(&op[3], standard_attributes, 2);
+    nfs4_op_getattr(&op[4], standard_attributes, 2);
     // GETFH
-    op[4].argop = OP_GETFH;
+    op[5].argop = OP_GETFH;
 
 
 #ifdef LATENCY_MEASURING_ENABLED
@@ -1327,7 +1751,7 @@ int lookup(struct fuse_session *se, struct virtionfs *vnfs,
 
     if (rpc_nfs4_compound_async(conn->rpc, lookup_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send nfs4 LOOKUP request\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
@@ -1335,6 +1759,27 @@ int lookup(struct fuse_session *se, struct virtionfs *vnfs,
     return EWOULDBLOCK;
 }
 
+static void getattr_reply(struct fuse_session *se, struct virtionfs *vnfs, struct inode *i,
+                          nfs_resop4 *getattr_res,
+                          struct fuse_out_header *out_hdr, struct fuse_attr_out *out_attr)
+{
+    GETATTR4resok *resok = &getattr_res->nfs_resop4_u.opgetattr.GETATTR4res_u.resok4;
+    char *attrs = resok->obj_attributes.attr_vals.attrlist4_val;
+    u_int attrs_len = resok->obj_attributes.attr_vals.attrlist4_len;
+    uint64_t change;
+    if (nfs_parse_attributes(&out_attr->attr, &change, attrs, attrs_len) == 0) {
+        // This is not filled in by the parse_attributes fn
+        out_attr->attr.rdev = 0;
+        uint32_t ttl = vnfs_attr_timeout(vnfs, i, change, NULL);
+        out_attr->attr_valid = ttl / 1000;
+        out_attr->attr_valid_nsec = (ttl % 1000) * 1000000;
+        out_hdr->len += se->conn.proto_minor < 9 ?
+            FUSE_COMPAT_ATTR_OUT_SIZE : sizeof(*out_attr);
+    } else {
+        out_hdr->error = -EREMOTEIO;
+    }
+}
+
 void getattr_cb(struct rpc_context *rpc, int status, void *data,
                        void *private_data)
 {
@@ -1347,13 +1792,14 @@ void getattr_cb(struct rpc_context *rpc, int status, void *data,
     }
 #endif
 
-    cb_data->conn->session.slots[cb_data->slotid].in_use = false;
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
     if (status != RPC_STATUS_SUCCESS) {
         vnfs_error("FUSE_GETATTR:%lu - RPC error=%d, %s\n", cb_data->out_hdr->unique, status, (char *) data);
         cb_data->out_hdr->error = -EREMOTEIO;
         goto ret;
     }
     COMPOUND4res *res = data;
+    virtiofs_emu_ll_trace_status(cb_data->cb, res->status);
     if (res->status != NFS4_OK) {
         cb_data->out_hdr->error = -nfs_error_to_fuse_error(res->status);
         vnfs_error("FUSE_GETATTR:%lu - NFS error=%d, FUSE error=%d\n",
@@ -1361,23 +1807,12 @@ void getattr_cb(struct rpc_context *rpc, int status, void *data,
         goto ret;
     }
 
-    GETATTR4resok *resok = &res->resarray.resarray_val[2].nfs_resop4_u.opgetattr.GETATTR4res_u.resok4;
-    char *attrs = resok->obj_attributes.attr_vals.attrlist4_val;
-    u_int attrs_len = resok->obj_attributes.attr_vals.attrlist4_len;
-    if (nfs_parse_attributes(&cb_data->out_attr->attr, attrs, attrs_len) == 0) {
-        // This is not filled in by the parse_attributes fn
-        cb_data->out_attr->attr.rdev = 0;
-        cb_data->out_attr->attr_valid = 0;
-        cb_data->out_attr->attr_valid_nsec = 0;
-        cb_data->out_hdr->len += vnfs->se->conn.proto_minor < 9 ?
-            FUSE_COMPAT_ATTR_OUT_SIZE : sizeof(*cb_data->out_attr);
-    } else {
-        cb_data->out_hdr->error = -EREMOTEIO;
-    }
+    getattr_reply(cb_data->se, vnfs, cb_data->i, &res->resarray.resarray_val[2],
+                  cb_data->out_hdr, cb_data->out_attr);
 
 ret:;
     struct snap_fs_dev_io_done_ctx *cb = cb_data->cb;
-    mpool2_free(vnfs->p, cb_data);
+    mpool2_free(cb_data->conn->p, cb_data);
     cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
 }
 
@@ -1387,7 +1822,9 @@ int getattr(struct fuse_session *se, struct virtionfs *vnfs,
             struct snap_fs_dev_io_done_ctx *cb)
 {
     struct vnfs_conn *conn = vnfs_get_conn(vnfs);
-    struct getattr_cb_data *cb_data = mpool2_alloc(vnfs->p);
+    if (!vnfs4_conn_has_room(conn))
+        return EBUSY;
+    struct getattr_cb_data *cb_data = mpool2_alloc(conn->p);
     if (!cb_data) {
         out_hdr->error = -ENOMEM;
         return 0;
@@ -1395,6 +1832,7 @@ int getattr(struct fuse_session *se, struct virtionfs *vnfs,
 
     cb_data->cb = cb;
     cb_data->vnfs = vnfs;
+    cb_data->se = se;
     cb_data->conn = conn;
     cb_data->out_hdr = out_hdr;
     cb_data->out_attr = out_attr;
@@ -1410,10 +1848,11 @@ int getattr(struct fuse_session *se, struct virtionfs *vnfs,
     struct inode *i = vnfs4_op_putfh(vnfs, &op[1], in_hdr->nodeid);
     if (!i) {
     	vnfs_error("Invalid nodeid supplied\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -ENOENT;
         return 0;
     }
+    cb_data->i = i;
     nfs4_op_getattr(&op[2], standard_attributes, 2);
     
 
@@ -1425,13 +1864,178 @@ int getattr(struct fuse_session *se, struct virtionfs *vnfs,
 #endif
     if (rpc_nfs4_compound_async(conn->rpc, getattr_cb, &args, cb_data) != 0) {
     	vnfs_error("Failed to send nfs4 GETATTR request\n");
-        mpool2_free(vnfs->p, cb_data);
+        mpool2_free(cb_data->conn->p, cb_data);
         out_hdr->error = -EREMOTEIO;
         return 0;
     }
 
     return EWOULDBLOCK;
 }
+static int getattr_burst_send(struct getattr_burst_cb_data *cb_data);
+
+// Completes reqs[from..to) of the burst with error
+static void getattr_burst_fail(struct getattr_burst_cb_data *cb_data,
+                               uint32_t from, uint32_t to, int error)
+{
+    for (uint32_t i = from; i < to; i++) {
+        struct snap_fs_dev_io_done_ctx *cb = cb_data->reqs[i].cb;
+        cb_data->reqs[i].out_hdr->error = error;
+        cb->cb(SNAP_FS_DEV_OP_SUCCESS, cb->user_arg);
+    }
+}
+
+void getattr_burst_cb(struct rpc_context *rpc, int status, void *data,
+                       void *private_data)
+{
+    struct getattr_burst_cb_data *cb_data = (struct getattr_burst_cb_data *)private_data;
+    struct virtionfs *vnfs = cb_data->vnfs;
+    uint32_t done = cb_data->done;
+
+    if (status != RPC_STATUS_SUCCESS) {
+        vnfs_error("FUSE_GETATTR burst of %u - RPC error=%d, %s\n",
+                   cb_data->nreqs - done, status, (char *) data);
+        getattr_burst_fail(cb_data, done, cb_data->nreqs, -EREMOTEIO);
+        goto ret;
+    }
+    COMPOUND4res *res = data;
+    // The server stops at the first operation that fails, so the result of
+    // reqs[done + j] is at 2 + 2 * j, if the compound got that far
+    uint32_t nres = res->resarray.resarray_len;
+    uint32_t answered = cb_data->nreqs - done;
+    if (res->status != NFS4_OK) {
+        if (nres < 2) {
+            // The SEQUENCE itself failed
+            vnfs_error("FUSE_GETATTR burst of %u - NFS error=%d\n", answered, res->status);
+            for (uint32_t j = done; j < cb_data->nreqs; j++)
+                virtiofs_emu_ll_trace_status(cb_data->reqs[j].cb, res->status);
+            getattr_burst_fail(cb_data, done, cb_data->nreqs, -nfs_error_to_fuse_error(res->status));
+            goto ret;
+        }
+        answered = (nres - 2) / 2;
+    }
+
+    for (uint32_t j = 0; j < answered; j++) {
+        struct fuse_ll_getattr_req *r = &cb_data->reqs[done + j];
+        getattr_reply(cb_data->se, vnfs, cb_data->inodes[done + j], &res->resarray.resarray_val[2 + 2 * j],
+                      r->out_hdr, r->out_attr);
+        r->cb->cb(SNAP_FS_DEV_OP_SUCCESS, r->cb->user_arg);
+    }
+    if (done + answered == cb_data->nreqs)
+        goto ret;
+
+    // Only the GETATTR that failed gets the error
+    struct fuse_ll_getattr_req *r = &cb_data->reqs[done + answered];
+    virtiofs_emu_ll_trace_status(r->cb, res->status);
+    vnfs_error("FUSE_GETATTR:%lu - NFS error=%d, FUSE error=%d\n", r->in_hdr->unique,
+               res->status, -nfs_error_to_fuse_error(res->status));
+    getattr_burst_fail(cb_data, done + answered, done + answered + 1,
+                       -nfs_error_to_fuse_error(res->status));
+    // Resend the ones the server didn't get to, we still own the slot
+    cb_data->done = done + answered + 1;
+    if (cb_data->done < cb_data->nreqs && getattr_burst_send(cb_data) == 0)
+        return;
+
+ret:
+    vnfs4_slot_free(cb_data->conn, cb_data->slotid);
+    mpool2_free(cb_data->conn->p, cb_data);
+}
+
+// Sends reqs[done..nreqs) in one compound on the slot of cb_data,
+// they are failed if that doesn't work out
+static int getattr_burst_send(struct getattr_burst_cb_data *cb_data)
+{
+    struct vnfs_conn *conn = cb_data->conn;
+    uint32_t n = cb_data->nreqs - cb_data->done;
+
+    COMPOUND4args args;
+    nfs_argop4 op[1 + 2 * VNFS_GETATTR_BURST];
+    memset(&args.tag, 0, sizeof(args.tag));
+    args.minorversion = NFS4DOT1_MINOR;
+    args.argarray.argarray_len = 1 + 2 * n;
+    args.argarray.argarray_val = op;
+
+    cb_data->seq.sa_sequenceid = ++conn->session.slots[cb_data->slotid].seqid;
+    op[0].argop = OP_SEQUENCE;
+    op[0].nfs_argop4_u.opsequence = cb_data->seq;
+    for (uint32_t j = 0; j < n; j++) {
+        struct fuse_ll_getattr_req *r = &cb_data->reqs[cb_data->done + j];
+        // The nodeids were checked before the burst got its slot
+        vnfs4_op_putfh(cb_data->vnfs, &op[1 + 2 * j], r->in_hdr->nodeid);
+        nfs4_op_getattr(&op[2 + 2 * j], standard_attributes, 2);
+    }
+
+    if (rpc_nfs4_compound_async(conn->rpc, getattr_burst_cb, &args, cb_data) != 0) {
+        vnfs_error("Failed to send nfs4 GETATTR burst request\n");
+        getattr_burst_fail(cb_data, cb_data->done, cb_data->nreqs, -EREMOTEIO);
+        return -1;
+    }
+    return 0;
+}
+
+// Up to VNFS_GETATTR_BURST GETATTRs share one compound and thus one slot
+// Returns how many of reqs it took, the others wait in the emu layer for room
+uint32_t getattr_burst(struct fuse_session *se, struct virtionfs *vnfs,
+                       struct fuse_ll_getattr_req *reqs, uint32_t nreqs)
+{
+    struct vnfs_conn *conn = vnfs_get_conn(vnfs);
+    uint32_t per = (conn->session.attrs.ca_maxoperations - 1) / 2;
+    if (per > VNFS_GETATTR_BURST)
+        per = VNFS_GETATTR_BURST;
+
+    uint32_t i = 0;
+    while (i < nreqs) {
+        if (nreqs - i == 1 || per < 2) {
+            struct fuse_ll_getattr_req *r = &reqs[i];
+            int ret = getattr(se, vnfs, r->in_hdr, r->in_getattr, r->out_hdr, r->out_attr, r->cb);
+            if (ret == EBUSY)
+                return i;
+            i++;
+            if (ret != EWOULDBLOCK)
+                r->cb->cb(SNAP_FS_DEV_OP_SUCCESS, r->cb->user_arg);
+            continue;
+        }
+
+        // Like the other handlers, nothing fails for lack of room
+        if (!vnfs4_conn_has_room(conn))
+            return i;
+        struct getattr_burst_cb_data *cb_data = mpool2_alloc(conn->p);
+        if (!cb_data)
+            return i;
+        cb_data->vnfs = vnfs;
+        cb_data->se = se;
+        cb_data->conn = conn;
+        cb_data->done = 0;
+        cb_data->nreqs = 0;
+        for (; i < nreqs && cb_data->nreqs < per; i++) {
+            struct fuse_ll_getattr_req *r = &reqs[i];
+            struct inode *in = inode_table_get(vnfs->inodes, r->in_hdr->nodeid);
+            if (!in) {
+                vnfs_error("Invalid nodeid supplied\n");
+                r->out_hdr->error = -ENOENT;
+                r->cb->cb(SNAP_FS_DEV_OP_SUCCESS, r->cb->user_arg);
+                continue;
+            }
+            cb_data->inodes[cb_data->nreqs] = in;
+            cb_data->reqs[cb_data->nreqs++] = *r;
+        }
+        if (cb_data->nreqs == 0) {
+            mpool2_free(conn->p, cb_data);
+            continue;
+        }
+
+        nfs_argop4 seq;
+        cb_data->slotid = vnfs4_op_sequence(&seq, conn, false);
+        cb_data->seq = seq.nfs_argop4_u.opsequence;
+        // getattr_burst_send takes the next seqid itself
+        conn->session.slots[cb_data->slotid].seqid--;
+        if (getattr_burst_send(cb_data) != 0) {
+            vnfs4_slot_free(conn, cb_data->slotid);
+            mpool2_free(conn->p, cb_data);
+        }
+    }
+    return nreqs;
+}
+
 int destroy(struct fuse_session *se, struct virtionfs *vnfs,
             struct fuse_in_header *in_hdr,
             struct fuse_out_header *out_hdr,
@@ -1481,23 +2085,31 @@ int init(struct fuse_session *se, struct virtionfs *vnfs,
     conn->want &= ~FUSE_CAP_SPLICE_WRITE;
 
     // TODO FUSE:init always supplies uid=0 and gid=0,
-    // so only setting the uid and gid once in the init is not sufficient
+    // so only setting the uid and gid once is not sufficient
     // as in subsoquent operations different uid and gids can be supplied
     // however changing the uid and gid for every operations is very inefficient in libnfs
+    // The connections are made before FUSE_INIT, with the uid and gid it always supplies
     // NOTE: the root permissions only properly work if the server has no_root_squash
+    if (in_hdr->uid != vnfs->init_uid || in_hdr->gid != vnfs->init_gid)
+        vnfs_error("FUSE:init came from uid %u and gid %u, but the NFS connections use uid %u and gid %u\n",
+                   in_hdr->uid, in_hdr->gid, vnfs->init_uid, vnfs->init_gid);
     printf("%s, all NFS operations will go through uid %d and gid %d\n", __func__, vnfs->init_uid, vnfs->init_gid);
-    vnfs->init_uid = in_hdr->uid;
-    vnfs->init_gid = in_hdr->gid;
-
-    vnfs->se = se;
-    vnfs_new_connection(vnfs);
-
-    // TODO WARNING
-    // By returning 0, we allow the host to imediately start sending us requests,
-    // even though the lookup_true_rootfh or setclientid might not be done yet
-    // or even fail!
-    // This introduces a race condition, where if the rootfh is not found yet
-    // or there is no clientid virtionfs will crash horribly
+
+    // Without FUSE_OPEN and FUSE_RELEASE a small file is read in a single round trip
+    if (vnfs->no_open) {
+        if (conn->capable & FUSE_CAP_NO_OPEN_SUPPORT) {
+            conn->want |= FUSE_CAP_NO_OPEN_SUPPORT;
+        } else {
+            // Only this guest, see vnfs_io_start
+            printf("The guest's FUSE has no open-less I/O, it keeps sending FUSE_OPEN\n");
+        }
+        if (conn->capable & FUSE_CAP_NO_OPENDIR_SUPPORT)
+            conn->want |= FUSE_CAP_NO_OPENDIR_SUPPORT;
+    }
+
+    // The connections were started at startup, requests get EBUSY until they are all up
+    vnfs_session_up(vnfs, se);
+
     return 0;
 }
 
@@ -1505,6 +2117,7 @@ void virtionfs_assign_ops(struct fuse_ll_operations *ops) {
     ops->init = (typeof(ops->init)) init;
     ops->lookup = (typeof(ops->lookup)) lookup;
     ops->getattr = (typeof(ops->getattr)) getattr;
+    ops->getattr_burst = (typeof(ops->getattr_burst)) getattr_burst;
     // NFS accepts the NFS:fh (received from a NFS:lookup==FUSE:lookup) as
     // its parameter to the dir ops like readdir
     ops->opendir = NULL;
@@ -1520,10 +2133,17 @@ void virtionfs_assign_ops(struct fuse_ll_operations *ops) {
     //ops->setattr = (typeof(ops->setattr)) setattr;
     ops->statfs = (typeof(ops->statfs)) statfs;
     ops->destroy = (typeof(ops->destroy)) destroy;
+    ops->handoff = (typeof(ops->handoff)) vnfs_handoff_save;
+    ops->recover = (typeof(ops->recover)) vnfs_handoff_recover;
+    ops->capacity = (typeof(ops->capacity)) vnfs_capacity;
+    ops->max_io_size = (typeof(ops->max_io_size)) vnfs_max_io_size;
 }
 
 void virtionfs_main(char *server, char *export,
-               bool debug, double timeout, uint32_t nthreads,
+               bool debug, double timeout, double timeout_max,
+               const struct fuse_ll_direct_io *direct_io, bool no_open, uint32_t nthreads,
+               int *nfs_cpus, uint32_t nnfs_cpus,
+               const char *handoff_file, const char *recover_file,
                struct virtiofs_emu_params *emu_params) {
     struct virtionfs *vnfs = calloc(1, sizeof(struct virtionfs));
     if (!vnfs) {
@@ -1537,40 +2157,108 @@ void virtionfs_main(char *server, char *export,
     }
     vnfs->export = export;
     vnfs->debug = debug;
-    vnfs->timeout_sec = calc_timeout_sec(timeout);
-    vnfs->timeout_nsec = calc_timeout_nsec(timeout);
+    if (timeout_max > 0) {
+        // A timeout of 0 could never double
+        vnfs->ac_min_ms = timeout * 1000 >= 1 ? timeout * 1000 : 1;
+        vnfs->ac_max_ms = timeout_max > timeout ? timeout_max * 1000 : vnfs->ac_min_ms;
+    }
+    if (direct_io)
+        vnfs->direct_io = *direct_io;
+    vnfs->no_open = no_open;
     vnfs->nthreads = nthreads;
-
-    int ret = mpool2_init(&vnfs->p, sizeof(struct cb_data), 256);
-    if (ret < 0) {
-        vnfs_error("Failed to init mpool - err=%d", ret);
+    vnfs->nfs_cpus = nfs_cpus;
+    vnfs->nnfs_cpus = nnfs_cpus;
+    // All devices share the connections and the inode table
+    vnfs->ndevs = emu_params->ndevs ? emu_params->ndevs : 1;
+    vnfs->ses = calloc(vnfs->ndevs, sizeof(struct fuse_session *));
+    if (!vnfs->ses) {
+        warn("Failed to init virtionfs");
         goto ret_a;
     }
-
-    vnfs->conns = calloc(vnfs->nthreads, sizeof(struct vnfs_conn));
+    vnfs->handoff_file = handoff_file;
+    vnfs->recover_file = recover_file;
+    // Before the pollers get pinned
+    sched_getaffinity(0, sizeof(vnfs->init_cpus), &vnfs->init_cpus);
+
+    // Size the buffers from the virtqueue shape, every request the host
+    // can have outstanding needs a cb_data and a slot on its thread's connection
+    virtiofs_emu_params_fill_defaults(emu_params);
+    uint32_t pollers = nthreads > 1 ? nthreads : 1;
+    uint32_t queues_per_thread = (vnfs->ndevs * emu_params->num_queues + pollers - 1) / pollers;
+    vnfs->conn_max_requests = queues_per_thread * emu_params->queue_depth;
+    if (vnfs->conn_max_requests > vnfs->ndevs * emu_params->max_background)
+        vnfs->conn_max_requests = vnfs->ndevs * emu_params->max_background;
+    vnfs->conn_pool_chunk_size = sizeof(struct cb_data);
+    vnfs->conn_pool_chunks = 4;
+    while (vnfs->conn_pool_chunks <= vnfs->conn_max_requests)
+        vnfs->conn_pool_chunks <<= 1;
+
+    vnfs->conns = calloc(pollers, sizeof(struct vnfs_conn));
     if (!vnfs->conns) {
         warn("Failed to init NFS connections");
-        goto ret_b;
+        goto ret_a;
+    }
+    vnfs->nconns = pollers;
+    for (uint32_t i = 0; i < pollers; i++) {
+        vnfs->conns[i].vnfs_conn_id = i;
+        vnfs->conns[i].vnfs = vnfs;
+        vnfs->conns[i].nfs_cpu = nnfs_cpus ? nfs_cpus[i % nnfs_cpus] : -1;
     }
+    pthread_mutex_init(&vnfs->handshake_lock, NULL);
 
-    ret = inode_table_init(&vnfs->inodes);
+    int ret = inode_table_init(&vnfs->inodes);
     if (ret < 0) {
         vnfs_error("Failed to inode table - err=%d", ret);
         goto ret_c;
     }
+    // The filehandles of the root and everything the guest looked up
+    // are known again before the connections come up
+    if (recover_file) {
+        ret = vnfs_handoff_load(vnfs);
+        if (ret < 0)
+            goto ret_d;
+    }
+
+    // The NFS handshake takes several round trips, so it happens while the controller
+    // comes up instead of after FUSE_INIT
+    ret = vnfs_connect(vnfs);
+    if (ret < 0)
+        goto ret_d;
 
     struct fuse_ll_operations ops;
     memset(&ops, 0, sizeof(ops));
     virtionfs_assign_ops(&ops);
 
     virtiofs_emu_fuse_ll_main(&ops, emu_params, vnfs, debug);
-
+    // The sessions are freed, late NFS replies must not invalidate through them
+    pthread_mutex_lock(&vnfs->handshake_lock);
+    vnfs->nses = 0;
+    pthread_mutex_unlock(&vnfs->handshake_lock);
+    if (vnfs->ac_max_ms)
+        printf("Attribute timeouts between %u and %u ms: %lu replies, %lu found the inode changed "
+               "(%lu invalidations sent)\n",
+               vnfs->ac_min_ms, vnfs->ac_max_ms, atomic_load(&vnfs->ac_replies),
+               atomic_load(&vnfs->ac_changed), atomic_load(&vnfs->ac_invals));
+    printf("%lu opens: %lu kept the page cache, %lu direct io\n", atomic_load(&vnfs->opens),
+           atomic_load(&vnfs->opens_kept), atomic_load(&vnfs->opens_direct));
+    if (vnfs->no_open)
+        printf("Open-less I/O: %lu READs with the anonymous stateid, %lu OPENs taken along\n",
+               atomic_load(&vnfs->io_anonymous), atomic_load(&vnfs->lazy_opens));
+
+    vnfs_connect_join(vnfs);
+ret_d:
     inode_table_destroy(vnfs->inodes);
 ret_c:
+    for (uint32_t i = 0; i < pollers; i++) {
+        if (vnfs->conns[i].p)
+            mpool2_destroy(vnfs->conns[i].p);
+        free(vnfs->conns[i].session.slots);
+    }
+    pthread_mutex_destroy(&vnfs->handshake_lock);
     free(vnfs->conns);
-ret_b:
-    mpool2_destroy(vnfs->p);
 ret_a:
+    fuse_ll_direct_io_free(&vnfs->direct_io);
+    free(vnfs->ses);
     free(vnfs);
     printf("vnfs exited\n");
 }
@@ -8,16 +8,30 @@
 #ifndef VIRTIONFS_VIRTIONFS_H
 #define VIRTIONFS_VIRTIONFS_H
 
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdatomic.h>
 #include <sys/time.h>
 #include <nfsc/libnfs.h>
 #include <nfsc/libnfs-raw-nfs4.h>
 #include "virtiofs_emu_ll.h"
+#include "fuse_ll.h"
 #include "mpool2.h"
 
+// Default upper bound of the attribute timeouts, like acregmax of the Linux NFS client
+#define VNFS_ACMAX_SEC 60
+
+// timeout and timeout_max (seconds) bound the adaptive attribute timeouts, 0 for none
+// direct_io (NULL for none) is taken over and freed on return
+// no_open asks the guest for open-less I/O, see vnfs_io_start
+// nfs_cpus pins the NFS service thread of connection i to nfs_cpus[i % nnfs_cpus],
+// pair it with emu_params->poll_cpus so that both share a cache and NUMA node
 void virtionfs_main(char *server, char *export,
-               bool debug, double timeout, uint32_t nthreads,
+               bool debug, double timeout, double timeout_max,
+               const struct fuse_ll_direct_io *direct_io, bool no_open, uint32_t nthreads,
+               int *nfs_cpus, uint32_t nnfs_cpus,
+               const char *handoff_file, const char *recover_file,
                struct virtiofs_emu_params *emu_params);
 
 enum vnfs_conn_state {
@@ -42,6 +56,8 @@ struct vnfs_session {
     uint32_t nslots;
     // The highest slot ID for which the client has a request outstanding
     slotid4 highest_slot;
+    // Slots in use, claimed by the poller and freed by the service thread
+    atomic_uint nused;
 };
 
 struct vnfs_conn {
@@ -51,25 +67,75 @@ struct vnfs_conn {
     struct rpc_context *rpc;
     // The session under which this connection is operating
     struct vnfs_session session;
+    // -1 if the service thread is not pinned
+    int nfs_cpu;
+    // Pool for the cb_datas of this connection, allocated from its NFS service thread
+    // so that it lives on the same node. Its poller allocs and its service thread frees
+    struct mpool2 *p;
+    struct virtionfs *vnfs;
 };
 
 struct virtionfs {
-    struct fuse_session *se;
-
-    // We open connections on the main thread and when running
-    // each thread gets its own connection
+    // The FUSE sessions of the devices that did FUSE_INIT (or were taken over),
+    // every device is a guest mounting the same export, see vnfs_session_up()
+    struct fuse_session **ses;
+    uint32_t nses;
+    uint32_t ndevs;
+
+    // Every polling thread gets its own connection, they are opened in the background
+    // while the controller comes up, see vnfs_connect(). With elastic polling a connection
+    // stays with the virtqueues of its polling thread, whichever OS thread polls them, and
+    // its service thread sleeps in poll() while they are quiet.
     struct vnfs_conn *conns;
-    uint32_t conn_cntr;
+    uint32_t nconns;
+    pthread_t connect_thread;
+    // Protects conns_up, nfs_ready and ses
+    pthread_mutex_t handshake_lock;
+    uint32_t conns_up;
+    bool nfs_ready;
+    // The largest READ/WRITE payload, from the session of connection 0 and the
+    // maxread/maxwrite of the export (0 if unknown). 0 until connection 0 is up.
+    uint64_t fs_maxread;
+    uint64_t fs_maxwrite;
+    atomic_uint max_io_size;
 
     struct inode_table *inodes;
-    struct mpool2 *p;
 
     char *server;
     char *export;
     bool debug;
-    uint64_t timeout_sec;
-    uint32_t timeout_nsec;
+    // Attribute and entry timeouts, from ac_min_ms for an inode whose change attribute just
+    // moved up to ac_max_ms for one that stays the same (see vnfs_attr_timeout).
+    // Both 0 makes the guest ask every time.
+    uint32_t ac_min_ms;
+    uint32_t ac_max_ms;
+    // Replies that got a timeout, and how many of them found the inode changed
+    atomic_uint_fast64_t ac_replies;
+    atomic_uint_fast64_t ac_changed;
+    // FUSE_NOTIFY_INVAL_INODEs sent for the inodes that changed, see vnfs_inval
+    atomic_uint_fast64_t ac_invals;
+    // Opens of a file that did not change since its last open keep the guest's page
+    // cache (FOPEN_KEEP_CACHE), the direct_io ones bypass it (FOPEN_DIRECT_IO), see vopen
+    struct fuse_ll_direct_io direct_io;
+    atomic_uint_fast64_t opens;
+    atomic_uint_fast64_t opens_kept;
+    atomic_uint_fast64_t opens_direct;
+    // Open-less I/O, see vnfs_io_start: whether to ask the guests for it at FUSE_INIT,
+    // the READs that went out with the anonymous stateid and the OPENs that READs and
+    // WRITEs took along
+    bool no_open;
+    atomic_uint_fast64_t io_anonymous;
+    atomic_uint_fast64_t lazy_opens;
     uint32_t nthreads;
+    // The most requests a single connection can have outstanding,
+    // derived from the virtqueues that its polling thread serves
+    uint32_t conn_max_requests;
+    uint64_t conn_pool_chunks;
+    uint64_t conn_pool_chunk_size;
+    int *nfs_cpus;
+    uint32_t nnfs_cpus;
+    // The affinity of the process at startup, for unpinned service threads
+    cpu_set_t init_cpus;
     // TODO change uid and gid on a per-request basis
     uint32_t init_uid;
     uint32_t init_gid;
@@ -80,12 +146,29 @@ struct virtionfs {
 
     clientid4 clientid;
     verifier4 setclientid_confirm;
+
+    // Live restart, see vnfs_handoff.h
+    const char *handoff_file; // Written on exit, NULL for none
+    const char *recover_file; // Loaded at startup when taking over a device
+    struct fuse_ll_session_state handoff_session;
+    clientid4 handoff_clientid;
+    uint64_t handoff_ns; // When the state we took over was handed off, 0 if none
+    uint32_t handoff_inodes;
 };
 
 struct inode *vnfs4_op_putfh(struct virtionfs *vnfs, nfs_argop4 *op, uint64_t nodeid);
 
-int vnfs4_op_sequence(nfs_argop4 *op, struct vnfs_conn *conn, bool cachethis);
+// Claims a free slot and returns its slotid, the connection must have room for it
+uint32_t vnfs4_op_sequence(nfs_argop4 *op, struct vnfs_conn *conn, bool cachethis);
 int vnfs4_handle_sequence(COMPOUND4res *res, struct vnfs_conn *conn);
+void vnfs4_slot_free(struct vnfs_conn *conn, uint32_t slotid);
+// Whether the connection has a slot and a cb_data for one more request. If not the
+// handlers return EBUSY and the emu layer hands them the request again later.
+bool vnfs4_conn_has_room(struct vnfs_conn *conn);
+// The capacity op, see fuse_ll_operations
+uint32_t vnfs_capacity(struct virtionfs *vnfs, size_t thread_id);
+// The max_io_size op
+uint32_t vnfs_max_io_size(struct virtionfs *vnfs);
 
 #define vnfs_error(fmt, ...) fprintf(stderr, "vnfs error %s:%d - " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
 
@@ -5,35 +5,108 @@
 #
 */
 
+#define _GNU_SOURCE
 #include <sys/time.h>
+#include <unistd.h>
 #include <nfsc/libnfs.h>
 #include <err.h>
 #include <nfsc/libnfs-raw.h>
 #include <nfsc/libnfs-raw-nfs4.h>
 #include "vnfs_connect.h"
+#include "vnfs_handoff.h"
 #include "virtionfs.h"
 #include "nfs_v4.h"
 #include "inode.h"
+#include "mpool2.h"
 
-static void vnfs_conn_up(struct virtionfs *vnfs)
+// The payload left in the session's request and response size, and the export's maxread/maxwrite
+static void vnfs_set_max_io_size(struct vnfs_conn *conn)
 {
-    vnfs->conns[vnfs->conn_cntr].state = VNFS_CONN_STATE_ESTABLISHED;
-    printf("VNFS connection %u fully up!\n", vnfs->conn_cntr);
+    struct virtionfs *vnfs = conn->vnfs;
+    uint64_t max = conn->session.attrs.ca_maxrequestsize;
+    if (conn->session.attrs.ca_maxresponsesize < max)
+        max = conn->session.attrs.ca_maxresponsesize;
+    max = max > NFS4_COMPOUND_OVERHEAD ? max - NFS4_COMPOUND_OVERHEAD : 0;
+    if (vnfs->fs_maxread && vnfs->fs_maxread < max)
+        max = vnfs->fs_maxread;
+    if (vnfs->fs_maxwrite && vnfs->fs_maxwrite < max)
+        max = vnfs->fs_maxwrite;
+    if (max == 0) {
+        fprintf(stderr, "The NFS session of connection %u has no room for READ/WRITE data, "
+                "the guest gets a single page per request\n", conn->vnfs_conn_id);
+        max = getpagesize();
+    }
+    if (max > UINT32_MAX)
+        max = UINT32_MAX;
+    printf("NFS READ/WRITE up to %lu KiB (session request %u, response %u, maxread %lu, maxwrite %lu)\n",
+           max >> 10, conn->session.attrs.ca_maxrequestsize, conn->session.attrs.ca_maxresponsesize,
+           vnfs->fs_maxread, vnfs->fs_maxwrite);
+    atomic_store_explicit(&vnfs->max_io_size, max, memory_order_release);
+}
 
-    vnfs->conn_cntr++;
-    if (vnfs->conn_cntr < vnfs->nthreads) {
-        vnfs_new_connection(vnfs);
-    } else {
-        vnfs->se->init_done = true;
-        printf("VNFS boot finished! All %u connections are ready to roll!\n", vnfs->conn_cntr);
+static void vnfs_conn_up(struct vnfs_conn *conn)
+{
+    struct virtionfs *vnfs = conn->vnfs;
+    conn->state = VNFS_CONN_STATE_ESTABLISHED;
+    printf("VNFS connection %u fully up!\n", conn->vnfs_conn_id);
+    virtiofs_emu_ll_startup_mark("NFS connection %u up", conn->vnfs_conn_id);
+    // All connections have the same server, the first one speaks for them
+    if (conn->vnfs_conn_id == 0)
+        vnfs_set_max_io_size(conn);
+
+    pthread_mutex_lock(&vnfs->handshake_lock);
+    if (++vnfs->conns_up == vnfs->nconns) {
+        vnfs->nfs_ready = true;
+        // The devices that did not do FUSE_INIT yet get it in vnfs_session_up()
+        for (uint32_t i = 0; i < vnfs->nses; i++)
+            vnfs->ses[i]->init_done = true;
+        printf("VNFS boot finished! All %u connections are ready to roll!\n", vnfs->conns_up);
+        virtiofs_emu_ll_startup_mark("NFS ready");
+        if (vnfs->nses)
+            vnfs_handoff_serving(vnfs);
+    }
+    pthread_mutex_unlock(&vnfs->handshake_lock);
+}
+
+void vnfs_session_up(struct virtionfs *vnfs, struct fuse_session *se)
+{
+    pthread_mutex_lock(&vnfs->handshake_lock);
+    // A guest that mounts again does FUSE_INIT on the same session
+    bool known = false;
+    for (uint32_t i = 0; i < vnfs->nses; i++)
+        known |= vnfs->ses[i] == se;
+    if (!known && vnfs->nses < vnfs->ndevs)
+        vnfs->ses[vnfs->nses++] = se;
+    if (vnfs->nfs_ready) {
+        se->init_done = true;
+        vnfs_handoff_serving(vnfs);
     }
+    pthread_mutex_unlock(&vnfs->handshake_lock);
+}
+
+static uint32_t maxio_attributes[1] = {
+    (1U << FATTR4_MAXREAD |
+     1U << FATTR4_MAXWRITE)
+};
+
+// How much data the export takes per READ/WRITE, from the GETATTR(maxio_attributes) in res
+static void vnfs_parse_maxio_res(struct virtionfs *vnfs, COMPOUND4res *res)
+{
+    int i = nfs4_find_op(res, OP_GETATTR);
+    if (i < 0)
+        return;
+    fattr4 *attrs = &res->resarray.resarray_val[i].nfs_resop4_u.opgetattr.GETATTR4res_u
+        .resok4.obj_attributes;
+    if (nfs_parse_maxio(&vnfs->fs_maxread, &vnfs->fs_maxwrite, attrs->attr_vals.attrlist4_val,
+                        attrs->attr_vals.attrlist4_len))
+        vnfs->fs_maxread = vnfs->fs_maxwrite = 0;
 }
 
 static void reclaim_complete_cb(struct rpc_context *rpc, int status, void *data,
                                   void *private_data)
 {
-    struct virtionfs *vnfs = private_data;
-    struct vnfs_conn *conn = &vnfs->conns[vnfs->conn_cntr];
+    struct vnfs_conn *conn = private_data;
+    struct virtionfs *vnfs = conn->vnfs;
     COMPOUND4res *res = data;
 
     if (status != RPC_STATUS_SUCCESS) {
@@ -52,28 +125,38 @@ static void reclaim_complete_cb(struct rpc_context *rpc, int status, void *data,
     }
 
     vnfs4_handle_sequence(res, conn);
+    vnfs_parse_maxio_res(vnfs, res);
 
-    vnfs_conn_up(vnfs);
+    vnfs_conn_up(conn);
 }
 
-static void reclaim_complete(struct virtionfs *vnfs)
+// With rooti (a root handed off by the previous process, which skips lookup_true_rootfh)
+// the compound also GETATTRs how much data the export takes per READ/WRITE
+static void reclaim_complete(struct vnfs_conn *conn, struct inode *rooti)
 {
-    struct vnfs_conn *conn = &vnfs->conns[vnfs->conn_cntr];
-
     COMPOUND4args args;
-    nfs_argop4 op[2];
+    nfs_argop4 op[4];
     args.minorversion = NFS4DOT1_MINOR;
     memset(&args.tag, 0, sizeof(args.tag));
-    args.argarray.argarray_len = sizeof(op) / sizeof(nfs_argop4);
     args.argarray.argarray_val = op;
     memset(op, 0, sizeof(op));
+    int i = 0;
 
-    vnfs4_op_sequence(&op[0], conn, false);
+    vnfs4_op_sequence(&op[i++], conn, false);
 
-    op[1].argop = OP_RECLAIM_COMPLETE;
-    op[1].nfs_argop4_u.opreclaimcomplete.rca_one_fs = false;
+    // Before RECLAIM_COMPLETE, whose NFS4ERR_COMPLETE_ALREADY would end the compound
+    if (rooti) {
+        op[i].argop = OP_PUTFH;
+        op[i].nfs_argop4_u.opputfh.object.nfs_fh4_val = rooti->fh.val;
+        op[i++].nfs_argop4_u.opputfh.object.nfs_fh4_len = rooti->fh.len;
+        nfs4_op_getattr(&op[i++], maxio_attributes, 1);
+    }
 
-    if (rpc_nfs4_compound_async(conn->rpc, reclaim_complete_cb, &args, vnfs) != 0) {
+    op[i].argop = OP_RECLAIM_COMPLETE;
+    op[i++].nfs_argop4_u.opreclaimcomplete.rca_one_fs = false;
+    args.argarray.argarray_len = i;
+
+    if (rpc_nfs4_compound_async(conn->rpc, reclaim_complete_cb, &args, conn) != 0) {
     	fprintf(stderr, "%s: Failed to send nfs4 RECLAIM_COMPLETE request\n", __func__);
         vnfs_destroy_connection(conn, VNFS_CONN_STATE_SHOULD_CLOSE);
     }
@@ -82,8 +165,8 @@ static void reclaim_complete(struct virtionfs *vnfs)
 static void lookup_true_rootfh_cb(struct rpc_context *rpc, int status, void *data,
                        void *private_data)
 {
-    struct virtionfs *vnfs = private_data;
-    struct vnfs_conn *conn = &vnfs->conns[vnfs->conn_cntr];
+    struct vnfs_conn *conn = private_data;
+    struct virtionfs *vnfs = conn->vnfs;
     COMPOUND4res *res = data;
 
     if (status != RPC_STATUS_SUCCESS) {
@@ -105,13 +188,16 @@ static void lookup_true_rootfh_cb(struct rpc_context *rpc, int status, void *dat
     nfs4_clone_fh(&rooti->fh, &res->resarray.resarray_val[i].nfs_resop4_u.opgetfh
             .GETFH4res_u.resok4.object); 
     inode_table_insert(vnfs->inodes, rooti);
+    virtiofs_emu_ll_startup_mark("NFS root filehandle");
+
+    vnfs_parse_maxio_res(vnfs, res);
 
-    reclaim_complete(vnfs);
+    reclaim_complete(conn, NULL);
 }
 
-static int lookup_true_rootfh(struct virtionfs *vnfs)
+static int lookup_true_rootfh(struct vnfs_conn *conn)
 {
-    struct vnfs_conn *conn = &vnfs->conns[vnfs->conn_cntr];
+    struct virtionfs *vnfs = conn->vnfs;
 
     char *export = strdup(vnfs->export);
     int export_len = strlen(export);
@@ -126,7 +212,7 @@ static int lookup_true_rootfh(struct virtionfs *vnfs)
     while(*export_traverse) if (*export_traverse++ == '/') ++count;
 
     COMPOUND4args args;
-    nfs_argop4 op[3+count];
+    nfs_argop4 op[4+count];
     memset(&args.tag, 0, sizeof(args.tag));
     args.minorversion = NFS4DOT1_MINOR;
     args.argarray.argarray_len = sizeof(op) / sizeof(nfs_argop4);
@@ -143,9 +229,11 @@ static int lookup_true_rootfh(struct virtionfs *vnfs)
         token = strtok(NULL, "/");
     }
     // GETFH
-    op[i].argop = OP_GETFH;
+    op[i++].argop = OP_GETFH;
+    // GETATTR, how much data the export takes per READ/WRITE
+    nfs4_op_getattr(&op[i], maxio_attributes, 1);
 
-    if (rpc_nfs4_compound_async(conn->rpc, lookup_true_rootfh_cb, &args, vnfs) != 0) {
+    if (rpc_nfs4_compound_async(conn->rpc, lookup_true_rootfh_cb, &args, conn) != 0) {
     	fprintf(stderr, "%s: Failed to send nfs4 LOOKUP request\n", __func__);
         vnfs_destroy_connection(conn, VNFS_CONN_STATE_SHOULD_CLOSE);
         return -1;
@@ -158,8 +246,8 @@ static int lookup_true_rootfh(struct virtionfs *vnfs)
 static void create_session_cb(struct rpc_context *rpc, int status, void *data,
         void *private_data)
 {
-    struct virtionfs *vnfs = private_data;
-    struct vnfs_conn *conn = &vnfs->conns[vnfs->conn_cntr];
+    struct vnfs_conn *conn = private_data;
+    struct virtionfs *vnfs = conn->vnfs;
     COMPOUND4res *res = data;
     
     if (status != RPC_STATUS_SUCCESS) {
@@ -180,19 +268,35 @@ static void create_session_cb(struct rpc_context *rpc, int status, void *data,
     // The sequenceid we receive in this ok is the same as we sent, so no need to do anything
     // We set no flags, so no need to do anything
 
+    // We are on the (pinned) service thread of this connection,
+    // so the slots and pool get first-touched on its node
     conn->session.nslots = ok->csr_fore_chan_attrs.ca_maxrequests;
     conn->session.slots = calloc(conn->session.nslots, sizeof(struct vnfs_slot));
+    atomic_init(&conn->session.nused, 0);
+    int ret = mpool2_init(&conn->p, vnfs->conn_pool_chunk_size,
+            vnfs->conn_pool_chunks);
+    if (!conn->session.slots || ret < 0) {
+        fprintf(stderr, "Failed to allocate the slots and mpool of connection %u\n",
+                conn->vnfs_conn_id);
+        vnfs_destroy_connection(conn, VNFS_CONN_STATE_SHOULD_CLOSE);
+        return;
+    }
+
+    virtiofs_emu_ll_startup_mark("NFS session of connection %u", conn->vnfs_conn_id);
 
     // The session and connection is now fully up
-    // We might be the first connection and need to lookup the true rootfh
-    if (vnfs->conn_cntr == 0)
-        lookup_true_rootfh(vnfs);
+    // We might be the first connection and need to lookup the true rootfh,
+    // unless it was handed off by the previous process
+    struct inode *rooti = conn->vnfs_conn_id == 0 ? inode_table_get(vnfs->inodes, FUSE_ROOT_ID) : NULL;
+    if (rooti)
+        reclaim_complete(conn, rooti);
+    else if (conn->vnfs_conn_id == 0)
+        lookup_true_rootfh(conn);
     else // We only need to RECLAIM_COMPLETE once
-        vnfs_conn_up(vnfs);
+        vnfs_conn_up(conn);
 }
 
-static int create_session(struct virtionfs *vnfs, struct vnfs_conn *conn,
-        clientid4 clientid, sequenceid4 seqid)
+static int create_session(struct vnfs_conn *conn, clientid4 clientid, sequenceid4 seqid)
 {
     COMPOUND4args args;
     nfs_argop4 op[1];
@@ -202,9 +306,9 @@ static int create_session(struct virtionfs *vnfs, struct vnfs_conn *conn,
     args.argarray.argarray_val = op;
     memset(op, 0, sizeof(op));
 
-    nfs4_op_createsession(&op[0], clientid, seqid);
+    nfs4_op_createsession(&op[0], clientid, seqid, conn->vnfs->conn_max_requests);
     
-    if (rpc_nfs4_compound_async(conn->rpc, create_session_cb, &args, vnfs) != 0) {
+    if (rpc_nfs4_compound_async(conn->rpc, create_session_cb, &args, conn) != 0) {
     	fprintf(stderr, "Failed to send NFS:create_session request\n");
         vnfs_destroy_connection(conn, VNFS_CONN_STATE_SHOULD_CLOSE);
         return -1;
@@ -213,12 +317,14 @@ static int create_session(struct virtionfs *vnfs, struct vnfs_conn *conn,
     return 0;
 }
 
+static int exchangeid(struct vnfs_conn *conn);
+
 static verifier4 default_verifier = {'0', '1', '2', '3', '4', '5', '6', '7'};
 
 static void exchangeid_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
 {
-    struct virtionfs *vnfs = private_data;
-    struct vnfs_conn *conn = &vnfs->conns[vnfs->conn_cntr];
+    struct vnfs_conn *conn = private_data;
+    struct virtionfs *vnfs = conn->vnfs;
     COMPOUND4res *res = data;
     
     if (status != RPC_STATUS_SUCCESS) {
@@ -236,7 +342,7 @@ static void exchangeid_cb(struct rpc_context *rpc, int status, void *data, void
             .EXCHANGE_ID4res_u.eir_resok4;
 
     // If we are T0
-    if (vnfs->conn_cntr == 0) {
+    if (conn->vnfs_conn_id == 0) {
         memcpy(&vnfs->first_exchangeid, ok, sizeof(*ok));
         // The owner major string and server scope string must be copied over in new buffers
         vnfs->first_exchangeid.eir_server_owner.so_major_id.so_major_id_val =
@@ -250,19 +356,29 @@ static void exchangeid_cb(struct rpc_context *rpc, int status, void *data, void
                ok->eir_server_scope.eir_server_scope_val,
                vnfs->first_exchangeid.eir_server_scope.eir_server_scope_len);
 
-        create_session(vnfs, conn, ok->eir_clientid, ok->eir_sequenceid);
+        virtiofs_emu_ll_startup_mark("NFS EXCHANGE_ID");
+        vnfs->clientid = ok->eir_clientid;
+        vnfs_handoff_check_clientid(vnfs, ok->eir_clientid);
+
+        create_session(conn, ok->eir_clientid, ok->eir_sequenceid);
+        // The other connections only need first_exchangeid for the trunking check,
+        // so they do their handshake alongside the one of T0
+        for (uint32_t i = 1; i < vnfs->nconns; i++) {
+            if (vnfs->conns[i].state != VNFS_CONN_STATE_SHOULD_CLOSE)
+                exchangeid(&vnfs->conns[i]);
+        }
     } else {
         if (nfs4_check_clientid_trunking_allowed(&vnfs->first_exchangeid, ok)) {
-            create_session(vnfs, conn, ok->eir_clientid, ok->eir_sequenceid);
+            create_session(conn, ok->eir_clientid, ok->eir_sequenceid);
         } else {
             fprintf(stderr, "VNFS connection %u was not allowed to start trunking\n",
-                    vnfs->conn_cntr);
+                    conn->vnfs_conn_id);
             vnfs_destroy_connection(conn, VNFS_CONN_STATE_SHOULD_CLOSE);
         }
     }
 }
 
-static int exchangeid(struct virtionfs *vnfs, struct vnfs_conn *conn)
+static int exchangeid(struct vnfs_conn *conn)
 {
     COMPOUND4args args;
     nfs_argop4 op[1];
@@ -274,7 +390,7 @@ static int exchangeid(struct virtionfs *vnfs, struct vnfs_conn *conn)
 
     nfs4_op_exchangeid(&op[0], default_verifier, "virtionfs");
     
-    if (rpc_nfs4_compound_async(conn->rpc, exchangeid_cb, &args, vnfs) != 0) {
+    if (rpc_nfs4_compound_async(conn->rpc, exchangeid_cb, &args, conn) != 0) {
     	fprintf(stderr, "Failed to send NFS:exchange_id request\n");
         vnfs_destroy_connection(conn, VNFS_CONN_STATE_SHOULD_CLOSE);
         return -1;
@@ -283,6 +399,31 @@ static int exchangeid(struct virtionfs *vnfs, struct vnfs_conn *conn)
     return 0;
 }
 
+// libnfs does not let us set the affinity of its service thread,
+// but a new thread inherits the affinity of the thread that creates it
+static int vnfs_service_thread_start(struct vnfs_conn *conn)
+{
+    struct virtionfs *vnfs = conn->vnfs;
+    cpu_set_t orig_cpus, cpus;
+    pthread_getaffinity_np(pthread_self(), sizeof(orig_cpus), &orig_cpus);
+    if (conn->nfs_cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(conn->nfs_cpu, &cpus);
+    } else {
+        // Don't let it inherit the CPU of a pinned poller
+        cpus = vnfs->init_cpus;
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    int ret = nfs_mt_service_thread_start(conn->nfs);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(orig_cpus), &orig_cpus);
+    if (ret == 0 && conn->nfs_cpu >= 0)
+        printf("NFS service thread of connection %u pinned to CPU %d\n",
+               conn->vnfs_conn_id, conn->nfs_cpu);
+    return ret;
+}
+
 void vnfs_destroy_connection(struct vnfs_conn *conn, enum vnfs_conn_state state)
 {
     // This function might be called from inside of the NFS service thread,
@@ -294,13 +435,14 @@ void vnfs_destroy_connection(struct vnfs_conn *conn, enum vnfs_conn_state state)
     // RPC is paired with the NFS context, so NFS_destroy destroys RPC
 }
 
-int vnfs_new_connection(struct virtionfs *vnfs) {
-    struct vnfs_conn *conn = &vnfs->conns[vnfs->conn_cntr];
-    conn->vnfs_conn_id = vnfs->conn_cntr;
+// The blocking part of bringing up a connection, the TCP connect and the mount
+static int vnfs_new_connection(struct vnfs_conn *conn)
+{
+    struct virtionfs *vnfs = conn->vnfs;
 
     struct nfs_context *nfs = nfs_init_context();
     if (nfs == NULL) {
-        warn("Failed to init libnfs context for connection %u\n", vnfs->conn_cntr);
+        warn("Failed to init libnfs context for connection %u\n", conn->vnfs_conn_id);
         conn->state = VNFS_CONN_STATE_SHOULD_CLOSE;
         return -1;
     }
@@ -313,16 +455,17 @@ int vnfs_new_connection(struct virtionfs *vnfs) {
     nfs_set_gid(nfs, vnfs->init_gid);
 
     if(nfs_mount(nfs, vnfs->server, vnfs->export)) {
-        warn("Failed to mount nfs for connection %u\n", vnfs->conn_cntr);
+        warn("Failed to mount nfs for connection %u\n", conn->vnfs_conn_id);
         conn->state = VNFS_CONN_STATE_SHOULD_CLOSE;
         conn->rpc = NULL;
         nfs_destroy_context(conn->nfs);
         return -1;
     }
+    virtiofs_emu_ll_startup_mark("NFS mount of connection %u", conn->vnfs_conn_id);
 
     // We want to poll as fast as possible, MAX PERFORMANCE
     nfs_set_poll_timeout(nfs, -1);
-    if (nfs_mt_service_thread_start(nfs)) {
+    if (vnfs_service_thread_start(conn)) {
         warn("Failed to start libnfs service thread for connection %u\n", conn->vnfs_conn_id);
         conn->state = VNFS_CONN_STATE_SHOULD_CLOSE;
         conn->rpc = NULL;
@@ -330,10 +473,54 @@ int vnfs_new_connection(struct virtionfs *vnfs) {
         return -1;
     }
 
-    int ret = exchangeid(vnfs, conn);
-    if (ret != 0) {
-        vnfs_destroy_connection(conn, VNFS_CONN_STATE_SHOULD_CLOSE);
+    return 0;
+}
+
+static void *vnfs_new_connection_thread(void *arg)
+{
+    vnfs_new_connection(arg);
+    return NULL;
+}
+
+static void *vnfs_connect_thread(void *arg)
+{
+    struct virtionfs *vnfs = arg;
+    pthread_t threads[vnfs->nconns];
+    bool started[vnfs->nconns];
+
+    // The mounts are synchronous round trips, do them all at once
+    for (uint32_t i = 0; i < vnfs->nconns; i++) {
+        started[i] = pthread_create(&threads[i], NULL, vnfs_new_connection_thread,
+                                    &vnfs->conns[i]) == 0;
+        if (!started[i])
+            vnfs_new_connection(&vnfs->conns[i]);
     }
-    return ret;
+    for (uint32_t i = 0; i < vnfs->nconns; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+
+    struct vnfs_conn *conn = &vnfs->conns[0];
+    if (conn->state == VNFS_CONN_STATE_SHOULD_CLOSE) {
+        vnfs_error("The first NFS connection failed, virtionfs cannot serve requests\n");
+        return NULL;
+    }
+    // Its callback starts the handshake of the other connections
+    exchangeid(conn);
+    return NULL;
 }
 
+int vnfs_connect(struct virtionfs *vnfs)
+{
+    int ret = pthread_create(&vnfs->connect_thread, NULL, vnfs_connect_thread, vnfs);
+    if (ret) {
+        vnfs_error("Failed to start the NFS connect thread - err=%d\n", ret);
+        return -ret;
+    }
+    return 0;
+}
+
+void vnfs_connect_join(struct virtionfs *vnfs)
+{
+    pthread_join(vnfs->connect_thread, NULL);
+}
@@ -10,8 +10,15 @@
 
 #include "virtionfs.h"
 
-// Will keep trying to connections in the background until vnfs->ntreads is reached
-int vnfs_new_connection(struct virtionfs *vnfs);
+// Brings up all vnfs->nconns connections in the background, they mount in parallel
+// and do their handshake once the first connection did EXCHANGE_ID. The last one that
+// comes up sets init_done, FUSE_INIT can come in before or after that.
+// Returns 0 or a negative errno, vnfs_connect_join waits for the mounts
+int vnfs_connect(struct virtionfs *vnfs);
+void vnfs_connect_join(struct virtionfs *vnfs);
+// A device did FUSE_INIT or was taken over, sets init_done on its session
+// right away if the connections are already up, otherwise the last one does
+void vnfs_session_up(struct virtionfs *vnfs, struct fuse_session *se);
 void vnfs_destroy_connection(struct vnfs_conn *conn, enum vnfs_conn_state);
 
 #endif // VIRTIONFS_VNFS_CONNECT_H
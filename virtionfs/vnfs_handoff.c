@@ -0,0 +1,224 @@
+/*
+#
+# Copyright 2022- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "vnfs_handoff.h"
+#include "inode.h"
+#include "vnfs_connect.h"
+
+#define VNFS_HANDOFF_MAGIC 0x46464f4853464e56ULL // "VNFSHOFF"
+#define VNFS_HANDOFF_VERSION 1
+
+struct vnfs_handoff_hdr {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t ninodes;
+    // CLOCK_REALTIME, the processes do not share a monotonic clock epoch in general
+    uint64_t handoff_ns;
+    uint64_t clientid;
+    uint32_t open_owner_counter;
+    uint32_t pad;
+    // The next process must serve the same export
+    char server[256];
+    char export[1024];
+    struct fuse_ll_session_state session;
+};
+
+struct vnfs_handoff_inode {
+    uint64_t fileid;
+    uint64_t generation;
+    uint64_t nlookup;
+    uint64_t nopen;
+    vnfs_fh4 fh;
+    vnfs_fh4 fh_open;
+    stateid4 open_stateid;
+};
+
+static uint64_t vnfs_handoff_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int vnfs_handoff_save(struct fuse_session *se, struct virtionfs *vnfs)
+{
+    if (!vnfs->handoff_file)
+        return 0;
+
+    // Written next to it and renamed, the next process never sees half a file
+    char tmp[strlen(vnfs->handoff_file) + 5];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", vnfs->handoff_file);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        int ret = -errno;
+        vnfs_error("Failed to open the handoff file %s: %s\n", tmp, strerror(errno));
+        return ret;
+    }
+
+    struct vnfs_handoff_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = VNFS_HANDOFF_MAGIC;
+    hdr.version = VNFS_HANDOFF_VERSION;
+    hdr.clientid = vnfs->clientid;
+    hdr.open_owner_counter = atomic_load(&vnfs->open_owner_counter);
+    strncpy(hdr.server, vnfs->server, sizeof(hdr.server) - 1);
+    strncpy(hdr.export, vnfs->export, sizeof(hdr.export) - 1);
+    fuse_ll_session_save(se, &hdr.session);
+    // Rewritten with the count and time once the inodes are in
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    uint32_t nopen = 0;
+    struct inode_table *t = vnfs->inodes;
+    pthread_mutex_lock(&t->m);
+    for (size_t b = 0; b < t->size; b++) {
+        for (struct inode *i = t->array[b]; i != NULL; i = i->next) {
+            struct vnfs_handoff_inode rec;
+            memset(&rec, 0, sizeof(rec));
+            rec.fileid = i->fileid;
+            rec.generation = atomic_load(&i->generation);
+            rec.nlookup = atomic_load(&i->nlookup);
+            rec.nopen = atomic_load(&i->nopen);
+            rec.fh = i->fh;
+            rec.fh_open = i->fh_open;
+            rec.open_stateid = i->open_stateid;
+            fwrite(&rec, sizeof(rec), 1, f);
+            hdr.ninodes++;
+            if (rec.nopen)
+                nopen++;
+        }
+    }
+    pthread_mutex_unlock(&t->m);
+
+    hdr.handoff_ns = vnfs_handoff_now_ns();
+    rewind(f);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    bool failed = ferror(f);
+    failed |= fclose(f) != 0;
+    if (failed || rename(tmp, vnfs->handoff_file)) {
+        int ret = failed ? -EIO : -errno;
+        vnfs_error("Failed to write the handoff file %s\n", vnfs->handoff_file);
+        unlink(tmp);
+        return ret;
+    }
+
+    printf("Handed off %u inodes (%u open) to %s\n", hdr.ninodes, nopen, vnfs->handoff_file);
+    return 0;
+}
+
+int vnfs_handoff_load(struct virtionfs *vnfs)
+{
+    FILE *f = fopen(vnfs->recover_file, "r");
+    if (!f) {
+        int ret = -errno;
+        vnfs_error("Failed to open the handoff file %s: %s\n", vnfs->recover_file, strerror(errno));
+        return ret;
+    }
+
+    int ret = -EINVAL;
+    struct vnfs_handoff_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != VNFS_HANDOFF_MAGIC ||
+            hdr.version != VNFS_HANDOFF_VERSION) {
+        vnfs_error("%s is not a handoff file of this version of virtionfs\n", vnfs->recover_file);
+        goto out;
+    }
+    if (strcmp(hdr.server, vnfs->server) || strcmp(hdr.export, vnfs->export)) {
+        vnfs_error("%s was handed off by a process serving %s:%s\n", vnfs->recover_file,
+                   hdr.server, hdr.export);
+        goto out;
+    }
+
+    for (uint32_t n = 0; n < hdr.ninodes; n++) {
+        struct vnfs_handoff_inode rec;
+        if (fread(&rec, sizeof(rec), 1, f) != 1) {
+            vnfs_error("%s is truncated after %u of its %u inodes\n", vnfs->recover_file,
+                       n, hdr.ninodes);
+            goto out;
+        }
+        struct inode *i = inode_new(rec.fileid);
+        if (!i) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        i->fh = rec.fh;
+        i->fh_open = rec.fh_open;
+        i->open_stateid = rec.open_stateid;
+        atomic_init(&i->generation, rec.generation);
+        atomic_init(&i->nlookup, rec.nlookup);
+        atomic_init(&i->nopen, rec.nopen);
+        inode_table_insert(vnfs->inodes, i);
+    }
+
+    // New open owners must not collide with the ones of the open stateids we took over
+    atomic_store(&vnfs->open_owner_counter, hdr.open_owner_counter);
+    vnfs->handoff_session = hdr.session;
+    vnfs->handoff_clientid = hdr.clientid;
+    vnfs->handoff_ns = hdr.handoff_ns;
+    vnfs->handoff_inodes = hdr.ninodes;
+    unlink(vnfs->recover_file);
+    virtiofs_emu_ll_startup_mark("handoff of %u inodes loaded", hdr.ninodes);
+    ret = 0;
+out:
+    fclose(f);
+    return ret;
+}
+
+void vnfs_handoff_serving(struct virtionfs *vnfs)
+{
+    if (!vnfs->handoff_ns)
+        return;
+    printf("Live restart: serving the guest again %.3f ms after the handoff\n",
+           (vnfs_handoff_now_ns() - vnfs->handoff_ns) / 1e6);
+    // Only once, not when the guest mounts again later on
+    vnfs->handoff_ns = 0;
+}
+
+int vnfs_handoff_recover(struct fuse_session *se, struct virtionfs *vnfs)
+{
+    if (!vnfs->handoff_ns) {
+        vnfs_error("Asked to take over a device without a handoff file\n");
+        return -EINVAL;
+    }
+    fuse_ll_session_restore(se, &vnfs->handoff_session);
+    printf("Took over the FUSE session (protocol %u.%u) and %u inodes, %.3f ms after the handoff\n",
+           se->conn.proto_major, se->conn.proto_minor, vnfs->handoff_inodes,
+           (vnfs_handoff_now_ns() - vnfs->handoff_ns) / 1e6);
+
+    // Just like init(), the connections might still be coming up
+    vnfs_session_up(vnfs, se);
+    return 0;
+}
+
+void vnfs_handoff_check_clientid(struct virtionfs *vnfs, clientid4 clientid)
+{
+    if (!vnfs->handoff_ns || clientid == vnfs->handoff_clientid)
+        return;
+
+    // The server forgot the previous process, e.g. its lease expired, and with it the opens.
+    // Fall back to the anonymous stateid (all zeros) for the files the guest has open,
+    // which the server accepts for READ and WRITE as long as no share reservation denies it.
+    uint32_t dropped = 0;
+    struct inode_table *t = vnfs->inodes;
+    pthread_mutex_lock(&t->m);
+    for (size_t b = 0; b < t->size; b++) {
+        for (struct inode *i = t->array[b]; i != NULL; i = i->next) {
+            if (atomic_load(&i->nopen)) {
+                memset(&i->open_stateid, 0, sizeof(i->open_stateid));
+                dropped++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&t->m);
+    fprintf(stderr, "The NFS server gave out a new client ID, the open state of %u handed off "
+            "files is gone and they continue with the anonymous stateid\n", dropped);
+}
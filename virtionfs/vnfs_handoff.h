@@ -0,0 +1,34 @@
+/*
+#
+# Copyright 2022- IBM Inc. All rights reserved
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+*/
+
+#ifndef VIRTIONFS_VNFS_HANDOFF_H
+#define VIRTIONFS_VNFS_HANDOFF_H
+
+#include "fuse_ll.h"
+#include "virtionfs.h"
+
+// Live restart. On exit a process that still has the guest mounted writes the inode
+// table (fileid -> NFS filehandle, open filehandle and stateid, lookup and open counts)
+// with the FUSE session to a file, the next process loads it before it connects
+// and takes over the device (virtiofs_emu_params.recover) without a FUSE_INIT.
+// The guest keeps using the same nodeids, so nothing has to be looked up again.
+// Put the file on a tmpfs (e.g. /dev/shm) to keep the downtime short.
+
+// Called from the fuse_ll handoff and recover ops, return 0 or a negative errno
+int vnfs_handoff_save(struct fuse_session *se, struct virtionfs *vnfs);
+int vnfs_handoff_recover(struct fuse_session *se, struct virtionfs *vnfs);
+// Prints the downtime of a live restart once init_done is set, with handshake_lock held
+void vnfs_handoff_serving(struct virtionfs *vnfs);
+// Reads vnfs->recover_file into the inode table, before vnfs_connect()
+// The file is removed, so a crash later on cannot hand off stale state
+int vnfs_handoff_load(struct virtionfs *vnfs);
+// The open stateids belong to the NFS client ID, which the server only gives
+// out again while the lease of the previous process did not expire.
+// Called with the client ID of the first EXCHANGE_ID, before serving.
+void vnfs_handoff_check_clientid(struct virtionfs *vnfs, clientid4 clientid);
+
+#endif // VIRTIONFS_VNFS_HANDOFF_H